@@ -0,0 +1,263 @@
+#pragma once
+
+#include <vector>
+#include <mutex>
+#include <stack>
+#include <algorithm>
+
+#include "telemetry.h"
+#include "contention.h"
+#include "changeSink.h"
+
+// Per-node mutex variant of the m-ary tree locker.
+// Same path-to-root locking discipline as the spinlock variant, but waiters sleep
+// in the kernel instead of spinning.
+namespace song_m {
+
+// This struct encapsulates all the logic for the m-ary tree locking system.
+struct TreeLocker {
+    // n: total number of nodes, m: number of children per node (m-ary).
+    int n, m;
+
+    // parent[i] stores the index of the parent of node i.
+    std::vector<int> parent;
+
+    // lockedBy[i] stores the user ID (uid) who has locked node i. 0 means unlocked.
+    std::vector<int> lockedBy;
+
+    // An optimization: descLocked[i] stores the count of locked nodes in the subtree of node i.
+    // This avoids traversing the entire subtree to check for locked descendants.
+    std::vector<int> descLocked;
+
+    // A mutex for each node to ensure thread safety. Operations on a node or its state
+    // (like its ancestors' descLocked count) must acquire the corresponding mutex.
+    std::vector<std::mutex> nodeMx;
+    TL_CONTENTION_MEMBER; // Per-tree lock statistics, only with TREELOCKER_CONTENTION=1.
+
+    // Optional observer of successful changes (WAL, replication, ...), called while
+    // the operation still holds its node mutexes.
+    ChangeSink* sink = nullptr;
+
+    // Helper function to get the path from a given node 'v' up to the root.
+    // This is used to identify all nodes whose state might be affected by an operation,
+    // so we can lock their mutexes.
+    std::vector<int> getPathToRoot(int v, bool includeSelf = true) {
+        std::vector<int> path;
+        if (includeSelf) path.push_back(v);
+        int p = parent[v];
+        while (p != -1) {
+            path.push_back(p);
+            p = parent[p];
+        }
+        return path;
+    }
+
+    // Acquires locks for a given list of nodes in a deadlock-free manner.
+    // It sorts the node IDs to ensure a consistent lock acquisition order, preventing circular waits.
+    // 'unique_lock' is used for RAII-style locking, ensuring mutexes are automatically released.
+    void acquireLocks(const std::vector<int>& nodes, std::vector<std::unique_lock<std::mutex>>& locks) {
+        std::vector<int> sortedNodes = nodes;
+        std::sort(sortedNodes.begin(), sortedNodes.end());
+        // Remove duplicates as we only need to lock each node's mutex once.
+        sortedNodes.erase(std::unique(sortedNodes.begin(), sortedNodes.end()), sortedNodes.end());
+        locks.reserve(sortedNodes.size());
+        for (int id : sortedNodes) {
+            locks.emplace_back(TL_MUTEX_LOCK(nodeMx[id], id)); // Lock the mutex for each node.
+        }
+    }
+
+    // Helper for upgradeLock. Traverses the subtree of 'v' to check for locked descendants.
+    // It populates 'candidates' with descendants locked by 'uid' and sets 'foreignLockFound'
+    // to true if a descendant is locked by a different user.
+    void collectLockedDescendants(int v, int uid, std::vector<int>& candidates, bool& foreignLockFound) {
+        std::stack<int> st; // Using a stack for iterative DFS traversal.
+        st.push(v);
+
+        while (!st.empty()) {
+            int u = st.top();
+            st.pop();
+
+            // Calculate the index range for children of node 'u'.
+            long long base = 1LL * u * m + 1;
+            for (long long j = 0; j < m; ++j) {
+                long long c = base + j;
+                if (c >= n) break; // Stop if child index is out of bounds.
+
+                int w = (int)c;
+                TL_VISIT(1);
+
+                // Check if the child node 'w' is locked.
+                if (lockedBy[w] != 0) {
+                    if (lockedBy[w] != uid) {
+                        foreignLockFound = true; // Found a lock by another user.
+                        return; // Abort immediately.
+                    }
+                    candidates.push_back(w); // It's locked by the same user, add to list.
+                }
+
+                // Optimization: Only traverse deeper if this child has locked descendants.
+                if (descLocked[w] > 0) {
+                    st.push(w);
+                }
+            }
+        }
+    }
+
+    // Constructor to initialize the TreeLocker.
+    TreeLocker(int n_, int m_) : n(n_), m(m_), nodeMx(n_) {
+        parent.assign(n, -1);      // Root has no parent (-1).
+        lockedBy.assign(n, 0);     // All nodes are initially unlocked.
+        descLocked.assign(n, 0);   // No locked descendants initially.
+        // Pre-calculate parent for each node based on its index in the m-ary tree.
+        for (int i = 1; i < n; ++i) parent[i] = (i - 1) / m;
+        TL_CONTENTION_INIT(n, m);
+    }
+
+    // Checks if any ancestor of node 'v' is locked.
+    bool hasLockedAncestor(int v) {
+        int p = parent[v];
+        while (p != -1) {
+            if (lockedBy[p] != 0) return true;
+            p = parent[p];
+        }
+        return false;
+    }
+
+    // Updates the 'descLocked' count for all ancestors of 'v' by a 'delta' (+1 for lock, -1 for unlock).
+    void addToAncestors(int v, int delta) {
+        int p = parent[v];
+        while (p != -1) {
+            descLocked[p] += delta;
+            p = parent[p];
+        }
+    }
+
+    // Attempts to lock node 'v' for user 'uid'.
+    bool lockNode(int v, int uid) {
+        TL_OP_BEGIN(OP_LOCK, v, uid);
+        // Identify and lock all mutexes for the node and its ancestors to ensure atomicity.
+        std::vector<int> need = getPathToRoot(v, true);
+        std::vector<std::unique_lock<std::mutex>> locks;
+        acquireLocks(need, locks);
+
+        // A lock can only be acquired if:
+        // 1. The node itself is not already locked.
+        if (lockedBy[v] != 0) {
+            TL_OP_FAIL(SELF_LOCKED);
+            return false;
+        }
+        // 2. No ancestor is locked.
+        if (hasLockedAncestor(v)) {
+            TL_OP_FAIL(ANCESTOR_LOCKED);
+            return false;
+        }
+        // 3. No descendant is locked.
+        if (descLocked[v] != 0) {
+            TL_OP_FAIL(DESCENDANT_LOCKED);
+            return false;
+        }
+
+        // If all conditions pass, perform the lock.
+        lockedBy[v] = uid;
+        addToAncestors(v, 1); // Increment locked descendant count for all ancestors.
+        TL_LOCK_DELTA(v, m, 1);
+        if (sink) sink->onLock(v, uid);
+        return true;
+    }
+
+    // Attempts to unlock node 'v', which must have been locked by the same 'uid'.
+    bool unlockNode(int v, int uid) {
+        TL_OP_BEGIN(OP_UNLOCK, v, uid);
+        std::vector<int> need = getPathToRoot(v, true);
+        std::vector<std::unique_lock<std::mutex>> locks;
+        acquireLocks(need, locks);
+
+        // An unlock can only happen if the node is currently locked by the same user.
+        if (lockedBy[v] != uid) {
+            TL_OP_OUTCOME(telemetry::unlockFailure(lockedBy[v]));
+            return false;
+        }
+
+        // Perform the unlock.
+        lockedBy[v] = 0;
+        addToAncestors(v, -1); // Decrement locked descendant count for all ancestors.
+        TL_LOCK_DELTA(v, m, -1);
+        if (sink) sink->onUnlock(v, uid);
+        return true;
+    }
+
+    // Attempts to upgrade a lock to an ancestor node 'v' for user 'uid'.
+    bool upgradeNode(int v, int uid) {
+        TL_OP_BEGIN(OP_UPGRADE, v, uid);
+        // --- First phase: Initial checks with minimal locking ---
+        std::vector<int> basePath = getPathToRoot(v, true);
+        std::vector<std::unique_lock<std::mutex>> locks;
+        acquireLocks(basePath, locks);
+
+        // An upgrade can only happen if:
+        // 1. The target node 'v' is not already locked.
+        // 2. It has at least one locked descendant.
+        // 3. None of its ancestors are locked.
+        if (lockedBy[v] != 0 || descLocked[v] == 0 || hasLockedAncestor(v)) {
+            TL_OP_OUTCOME(telemetry::upgradeFailure(lockedBy[v], descLocked[v]));
+            return false;
+        }
+
+        // --- Second phase: Verify descendant locks ---
+        // Find all descendants locked by this user and check for any locks by other users.
+        std::vector<int> lockedDescendants;
+        bool foreignLockFound = false;
+        collectLockedDescendants(v, uid, lockedDescendants, foreignLockFound);
+
+        if (foreignLockFound) {
+            TL_OP_FAIL(FOREIGN_DESCENDANT);
+            return false; // Fail if a descendant is locked by another user.
+        }
+
+        // --- Third phase: Re-lock and perform atomic update ---
+        // The set of nodes to be modified includes the ancestors AND the descendants to be unlocked.
+        // We must release the old locks and acquire all necessary locks at once.
+        locks.clear();
+
+        std::vector<int> allNodesToLock = basePath;
+        allNodesToLock.insert(allNodesToLock.end(), lockedDescendants.begin(), lockedDescendants.end());
+
+        acquireLocks(allNodesToLock, locks);
+
+        // IMPORTANT: Re-check conditions after re-acquiring locks. Another thread could have
+        // changed the state while we were not holding the locks.
+        if (lockedBy[v] != 0 || descLocked[v] == 0 || hasLockedAncestor(v)) {
+            TL_OP_OUTCOME(telemetry::upgradeFailure(lockedBy[v], descLocked[v]));
+            return false;
+        }
+
+        // Re-run the descendant check to ensure consistency.
+        foreignLockFound = false;
+        std::vector<int> currentLockedDescendants;
+        collectLockedDescendants(v, uid, currentLockedDescendants, foreignLockFound);
+
+        if (foreignLockFound) {
+            TL_OP_FAIL(FOREIGN_DESCENDANT);
+            return false;
+        }
+
+        // Atomically unlock all found descendants.
+        for (int u : currentLockedDescendants) {
+            if (lockedBy[u] == uid) { // Should always be true based on checks.
+                lockedBy[u] = 0;
+                addToAncestors(u, -1);
+                TL_LOCK_DELTA(u, m, -1);
+            }
+        }
+
+        // Atomically lock the target ancestor node.
+        lockedBy[v] = uid;
+        addToAncestors(v, 1);
+        TL_LOCK_DELTA(v, m, 1);
+        if (sink) sink->onUpgrade(v, uid, currentLockedDescendants);
+
+        return true;
+    }
+};
+
+} // namespace song_m
@@ -0,0 +1,269 @@
+#pragma once
+
+#include <vector>
+#include <stack>
+#include <algorithm>
+
+#include "telemetry.h"
+#include "contention.h"
+#include "changeSink.h"
+
+// Per-node spinlock variant of the m-ary tree locker.
+// Every operation locks the node and its whole path to the root, in index order,
+// so operations on disjoint subtrees only meet at the shared ancestors.
+namespace song_s {
+
+// A simple spinlock for thread safety.
+// It busy-waits on an atomic test-and-set, so it is only a good fit for the very
+// short critical sections used below; a long hold burns CPU on every waiter.
+struct SpinLock {
+    volatile int locked; // 0 for unlocked, 1 for locked. Volatile tells the compiler this value can change unexpectedly.
+
+    SpinLock() : locked(0) {} // Constructor initializes the lock as unlocked.
+
+    // Acquires the lock. '__sync_lock_test_and_set' atomically writes 1 and returns the
+    // previous value, so exactly one thread sees 0 and leaves the loop.
+    void lock() {
+        while (__sync_lock_test_and_set(&locked, 1)) {
+        }
+    }
+
+    // Single attempt; true if we now own the lock.
+    bool tryLock() {
+        return !__sync_lock_test_and_set(&locked, 1);
+    }
+
+    // Same as lock(), but returns how many attempts failed before it succeeded.
+    // Used by the contention profiler.
+    unsigned long lockCounting() {
+        unsigned long spins = 0;
+        while (__sync_lock_test_and_set(&locked, 1)) ++spins;
+        return spins;
+    }
+
+    // Releases the lock. '__sync_lock_release' also acts as a release barrier so the
+    // next owner sees every write made inside the critical section.
+    void unlock() {
+        __sync_lock_release(&locked);
+    }
+};
+
+// Main class to handle the tree locking logic.
+struct TreeLocker {
+    int n, m; // n: total nodes, m: number of children per node (m-ary).
+    std::vector<int> parent; // Stores the parent index for each node. parent[i] = (i-1)/m.
+    std::vector<int> lockedBy; // Stores the user ID (uid) that has locked a node. 0 means unlocked.
+    std::vector<int> descLocked; // A counter for each node, storing how many of its descendants are currently locked. This is a key optimization.
+    std::vector<SpinLock> nodeLock; // A spinlock for each node to manage concurrent access to its state.
+    TL_CONTENTION_MEMBER;           // Per-tree lock statistics, only with TREELOCKER_CONTENTION=1.
+    ChangeSink* sink = nullptr; // Optional observer of successful changes (WAL, replication, ...).
+
+    // Helper function to get the path from a node 'v' up to the root.
+    // This is used to identify all ancestors that need to be checked or locked.
+    std::vector<int> getPathToRoot(int v, bool includeSelf = true) {
+        std::vector<int> path;
+        if (includeSelf) path.push_back(v); // Optionally include the starting node itself.
+        int p = parent[v];
+        while (p != -1) { // -1 would be the parent of the root.
+            path.push_back(p);
+            p = parent[p]; // Move up to the next parent.
+        }
+        return path;
+    }
+
+    // Acquires spinlocks for a given set of nodes.
+    // IMPORTANT: It sorts the node indices first to ensure a consistent locking order.
+    // This prevents deadlocks (e.g., Thread 1 locks A then waits for B, while Thread 2 locks B and waits for A).
+    void acquireSet(const std::vector<int>& nodes) {
+        std::vector<int> a = nodes;
+        std::sort(a.begin(), a.end()); // Establish a global locking order.
+        a.erase(std::unique(a.begin(), a.end()), a.end()); // Remove duplicates.
+        for (int u : a) TL_SPIN_LOCK(nodeLock[u], u); // Lock each node in the sorted order.
+    }
+
+    // Releases the spinlocks for a given set of nodes. The order doesn't matter here.
+    void releaseSet(const std::vector<int>& nodes) {
+        for (int u : nodes) nodeLock[u].unlock();
+    }
+
+    // Finds all locked descendants of node 'v' for the upgrade operation.
+    // It uses a stack for non-recursive tree traversal (to avoid stack overflow on deep trees).
+    void getDescendants(int v, int uid, std::vector<int>& toUnlock, bool& foreignLockFound) {
+        std::stack<int> st;
+        st.push(v); // Start traversal from node 'v'.
+
+        while (!st.empty()) {
+            int u = st.top(); st.pop();
+            // Calculate the index range of children for node 'u'.
+            long long base = 1LL * u * m + 1;
+            for (long long j = 0; j < m; ++j) {
+                long long c = base + j;
+                if (c >= n) break; // Stop if child index is out of bounds.
+                int w = (int)c;
+                TL_VISIT(1);
+
+                // Check if this child is locked.
+                if (lockedBy[w] != 0) {
+                    if (lockedBy[w] != uid) {
+                        foreignLockFound = true; // Found a descendant locked by a different user.
+                        return; // Abort immediately, upgrade is not possible.
+                    }
+                    toUnlock.push_back(w); // This descendant needs to be unlocked during the upgrade.
+                }
+
+                // If a descendant has locked children of its own, we need to explore its subtree.
+                if (descLocked[w] > 0) st.push(w);
+            }
+        }
+    }
+
+    // Constructor to initialize the TreeLocker.
+    TreeLocker(int n_, int m_) : n(n_), m(m_), nodeLock(n_) {
+        parent.assign(n, -1);
+        lockedBy.assign(n, 0);
+        descLocked.assign(n, 0);
+        // Pre-calculate the parent for each node based on its index. Root (0) has no parent.
+        for (int i = 1; i < n; ++i) parent[i] = (i - 1) / m;
+        TL_CONTENTION_INIT(n, m);
+    }
+
+    // Helper to check if any ancestor of 'v' is locked.
+    bool hasLockedAncestor(int v) {
+        int p = parent[v];
+        while (p != -1) {
+            if (lockedBy[p] != 0) return true;
+            p = parent[p];
+        }
+        return false;
+    }
+
+    // Updates the `descLocked` count for all ancestors of 'v'.
+    // 'delta' is +1 for locking and -1 for unlocking. This is O(log_m N).
+    void addToAncestors(int v, int delta) {
+        int p = parent[v];
+        while (p != -1) {
+            descLocked[p] += delta;
+            p = parent[p];
+        }
+    }
+
+    // Implements the lock operation.
+    bool lockNode(int v, int uid) {
+        TL_OP_BEGIN(OP_LOCK, v, uid);
+        // We need to lock the node itself and all its ancestors to check their state atomically.
+        std::vector<int> need = getPathToRoot(v);
+        acquireSet(need);
+
+        // Conditions for locking to fail:
+        // 1. Node 'v' is already locked.
+        // 2. Any ancestor of 'v' is locked.
+        // 3. Any descendant of 'v' is locked (checked via the descLocked counter).
+        if (lockedBy[v] != 0 || hasLockedAncestor(v) || descLocked[v] != 0) {
+            TL_OP_OUTCOME(telemetry::lockFailure(lockedBy[v], descLocked[v]));
+            releaseSet(need); // Release locks before returning.
+            return false;
+        }
+
+        // If all conditions pass, perform the lock.
+        lockedBy[v] = uid;
+        addToAncestors(v, 1); // Increment the locked descendant count for all ancestors.
+        TL_LOCK_DELTA(v, m, 1);
+        if (sink) sink->onLock(v, uid);
+        releaseSet(need); // Release the locks.
+        return true;
+    }
+
+    // Implements the unlock operation.
+    bool unlockNode(int v, int uid) {
+        TL_OP_BEGIN(OP_UNLOCK, v, uid);
+        std::vector<int> need = getPathToRoot(v);
+        acquireSet(need);
+
+        // Condition for unlocking to fail:
+        // 1. The node is not locked by the same user.
+        if (lockedBy[v] != uid) {
+            TL_OP_OUTCOME(telemetry::unlockFailure(lockedBy[v]));
+            releaseSet(need);
+            return false;
+        }
+
+        // Perform the unlock.
+        lockedBy[v] = 0;
+        addToAncestors(v, -1); // Decrement the locked descendant count for all ancestors.
+        TL_LOCK_DELTA(v, m, -1);
+        if (sink) sink->onUnlock(v, uid);
+        releaseSet(need);
+        return true;
+    }
+
+    // Implements the upgrade lock operation. This is the most complex.
+    bool upgradeNode(int v, int uid) {
+        TL_OP_BEGIN(OP_UPGRADE, v, uid);
+        std::vector<int> path = getPathToRoot(v);
+        acquireSet(path); // Initial lock on ancestors.
+
+        // Conditions for upgrade to fail immediately:
+        // 1. Node 'v' is already locked.
+        // 2. An ancestor is locked.
+        // 3. Node 'v' has no locked descendants to upgrade from.
+        if (lockedBy[v] != 0 || hasLockedAncestor(v) || descLocked[v] == 0) {
+            TL_OP_OUTCOME(telemetry::upgradeFailure(lockedBy[v], descLocked[v]));
+            releaseSet(path);
+            return false;
+        }
+
+        // Find all descendants to be unlocked and check for foreign locks.
+        std::vector<int> toUnlock;
+        bool foreignLockFound = false;
+        getDescendants(v, uid, toUnlock, foreignLockFound);
+        if (foreignLockFound) {
+            TL_OP_FAIL(FOREIGN_DESCENDANT);
+            releaseSet(path); // Found a lock by another user.
+            return false;
+        }
+
+        // --- Critical Section: Re-locking ---
+        // We must lock the ancestors AND the descendants we are about to modify.
+        std::vector<int> allNodes = path;
+        allNodes.insert(allNodes.end(), toUnlock.begin(), toUnlock.end());
+        releaseSet(path); // Release the initial, smaller lock set.
+        acquireSet(allNodes); // Acquire the comprehensive lock set.
+
+        // Double-check conditions. The state could have changed in the tiny window
+        // between releasing and acquiring locks. This is vital for correctness.
+        if (lockedBy[v] != 0 || hasLockedAncestor(v) || descLocked[v] == 0) {
+            TL_OP_OUTCOME(telemetry::upgradeFailure(lockedBy[v], descLocked[v]));
+            releaseSet(allNodes);
+            return false;
+        }
+        // Re-run descendant check to ensure no new foreign locks appeared.
+        toUnlock.clear();
+        foreignLockFound = false;
+        getDescendants(v, uid, toUnlock, foreignLockFound);
+        if (foreignLockFound) { // This check should ideally not fail if logic is correct, but is a good safeguard.
+             TL_OP_FAIL(FOREIGN_DESCENDANT);
+             releaseSet(allNodes);
+             return false;
+        }
+
+
+        // ---- Perform the atomic upgrade ----
+        // 1. Unlock all descendants that were locked by this user.
+        for (int u : toUnlock) {
+            lockedBy[u] = 0;
+            addToAncestors(u, -1);
+            TL_LOCK_DELTA(u, m, -1);
+        }
+
+        // 2. Lock the target node 'v'.
+        lockedBy[v] = uid;
+        addToAncestors(v, 1);
+        TL_LOCK_DELTA(v, m, 1);
+        if (sink) sink->onUpgrade(v, uid, toUnlock);
+
+        releaseSet(allNodes);
+        return true;
+    }
+};
+
+} // namespace song_s
@@ -0,0 +1,622 @@
+#pragma once
+
+// Coroutine API over any TreeLocker variant. Needs C++20 (-std=c++20).
+//
+//   async::Executor ex(4);
+//   async::Locker<song_s::TreeLocker> locker(tl, ex);
+//
+//   async::Task session(async::Locker<song_s::TreeLocker>& locker, int v, int uid) {
+//       async::Status s = co_await locker.lock(v, uid, {std::chrono::milliseconds(5)});
+//       if (s == async::ACQUIRED) {
+//           ...
+//           locker.unlock(v, uid);
+//       }
+//   }
+//   async::spawn(ex, session(locker, v, uid));
+//
+// A lock or upgrade that cannot be granted now does not spin and does not block
+// its thread: the coroutine parks on the wait queue of the node in the way (the
+// node itself or an ancestor when they hold a lock, 'v' when a descendant does)
+// and the thread moves on to other coroutines. Locker::unlock() wakes the queues
+// of the released node and its ancestors; a successful upgrade wakes every queue
+// in the upgraded subtree. Woken operations retry on the executor. Parking
+// re-reads the blocker under the queue's lock, and releases take that lock after
+// changing the tree, so a release between a failed attempt and parking is never
+// missed.
+//
+// Every release must go through the Locker: an unlockNode() made on the tree
+// directly wakes nobody. While no coroutine is parked, unlock() adds one atomic
+// load to the tree operation.
+//
+// Waiting is only useful for conflicts some other session will release. A lock
+// on a node the caller's uid already holds, or under an ancestor it holds, is
+// refused at once; a conflict with the caller's own locks further down is not
+// detected and needs a timeout.
+
+#if __cplusplus < 202002L
+#error "asyncLocker.h needs C++20 (-std=c++20)"
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace async {
+
+typedef std::chrono::steady_clock Clock;
+
+enum Status {
+    ACQUIRED,  // The lock or upgrade took effect.
+    REFUSED,   // Waiting cannot help: bad node or uid, a conflict with the caller's own lock,
+               // or an upgrade with no locked descendant.
+    TIMED_OUT,
+    CANCELLED,
+};
+
+inline const char* statusName(Status s) {
+    switch (s) {
+    case ACQUIRED: return "acquired";
+    case REFUSED: return "refused";
+    case TIMED_OUT: return "timed out";
+    default: return "cancelled";
+    }
+}
+
+class Waiter;
+
+// Worker threads running posted coroutines and retries, plus one timer thread
+// for timeouts (started on first use). Destroy it only after every coroutine
+// spawned on it has finished; work still queued is dropped.
+class Executor {
+public:
+    explicit Executor(int threads = 0) {
+        if (threads <= 0) threads = (int)std::max(1u, std::thread::hardware_concurrency());
+        for (int t = 0; t < threads; ++t) workers.emplace_back([this] { work(); });
+    }
+
+    ~Executor() {
+        {
+            std::lock_guard<std::mutex> g(mx);
+            stopping = true;
+        }
+        ready.notify_all();
+        timerWake.notify_all();
+        for (std::thread& w : workers) w.join();
+        if (timerThread.joinable()) timerThread.join();
+    }
+
+    void post(void (*fn)(void*), void* arg) {
+        {
+            std::lock_guard<std::mutex> g(mx);
+            queue.push_back(Item{fn, arg});
+        }
+        ready.notify_one();
+    }
+
+    void post(std::coroutine_handle<> h) { post(resumeHandle, h.address()); }
+
+    // co_await ex.yield() puts the calling coroutine at the back of the queue.
+    auto yield() {
+        struct Awaiter {
+            Executor& ex;
+            bool await_ready() const { return false; }
+            void await_suspend(std::coroutine_handle<> h) { ex.post(h); }
+            void await_resume() const {}
+        };
+        return Awaiter{*this};
+    }
+
+    // Calls w->expire() at 'when' (the waiter ignores it if it is done by then).
+    inline void expireAt(Clock::time_point when, std::shared_ptr<Waiter> w);
+
+    int threads() const { return (int)workers.size(); }
+
+private:
+    struct Item {
+        void (*fn)(void*);
+        void* arg;
+    };
+
+    std::mutex mx; // Guards everything below except the threads themselves.
+    std::condition_variable ready, timerWake;
+    std::deque<Item> queue;
+    std::multimap<Clock::time_point, std::shared_ptr<Waiter>> timers;
+    bool stopping = false;
+    std::vector<std::thread> workers;
+    std::thread timerThread;
+
+    static void resumeHandle(void* address) { std::coroutine_handle<>::from_address(address).resume(); }
+
+    void work() {
+        std::unique_lock<std::mutex> g(mx);
+        while (true) {
+            ready.wait(g, [&] { return stopping || !queue.empty(); });
+            if (stopping) return;
+            Item it = queue.front();
+            queue.pop_front();
+            g.unlock();
+            it.fn(it.arg);
+            g.lock();
+        }
+    }
+
+    inline void runTimers();
+};
+
+// Fire-and-forget coroutine: starts when spawn()ed and frees itself when done.
+struct Task {
+    struct promise_type {
+        Task get_return_object() { return Task{std::coroutine_handle<promise_type>::from_promise(*this)}; }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+    std::coroutine_handle<promise_type> handle;
+};
+
+inline void spawn(Executor& ex, Task t) { ex.post(t.handle); }
+
+// Cancels the operations it is passed to. cancel() finishes those currently
+// parked with CANCELLED, and every later one using it fails the same way. It
+// must outlive those operations.
+class Cancel {
+public:
+    inline void cancel();
+    bool cancelled() const { return flag.load(); }
+
+private:
+    friend class Waiter;
+    std::atomic<bool> flag{false};
+    std::mutex mx;
+    std::vector<std::shared_ptr<Waiter>> registered; // Operations that have blocked at least once.
+};
+
+struct Options {
+    Clock::duration timeout{0}; // 0: wait as long as it takes.
+    Cancel* cancel = nullptr;
+};
+
+// State of one blocked operation. Whoever moves 'state' off PARKED (a waker, the
+// timer, a cancel) owns the next step and posts it to the executor; everything
+// else about the operation is only touched by the one thread running that step.
+class Waiter : public std::enable_shared_from_this<Waiter> {
+public:
+    virtual ~Waiter() {}
+
+    // Wake-up from a queue: retry the operation. False if it had already been
+    // finished by its timeout or cancel.
+    bool wake() { return move(RETRY); }
+    // Timer: finish with TIMED_OUT if still parked.
+    void expire() { move(TIMED_OUT); }
+    void cancelled() { move(CANCELLED); }
+
+    Status result() const { return outcome; }
+
+protected:
+    enum : int { RUNNING = -1, PARKED = -2, RETRY = -3 }; // Or a Status once finished by someone else.
+
+    std::atomic<int> state{RUNNING};
+    std::coroutine_handle<> handle;
+    Executor* executor = nullptr;
+    Clock::time_point deadline = Clock::time_point::max();
+    Cancel* cancel = nullptr;
+    Status outcome = REFUSED;
+
+    // Tries the operation until it is done (true, 'outcome' set) or parked (false).
+    virtual bool attempt() = 0;
+
+    // Called by attempt() before the first park: arms the timeout and cancellation.
+    void registerOnce() {
+        if (registered) return;
+        registered = true;
+        if (deadline != Clock::time_point::max()) executor->expireAt(deadline, shared_from_this());
+        if (cancel) {
+            std::lock_guard<std::mutex> g(cancel->mx);
+            cancel->registered.push_back(shared_from_this());
+        }
+    }
+
+    // Whether the timeout or cancellation already applies; sets 'outcome'.
+    bool expiredNow() {
+        if (cancel && cancel->cancelled()) outcome = CANCELLED;
+        else if (Clock::now() >= deadline) outcome = TIMED_OUT;
+        else return false;
+        return true;
+    }
+
+    // Called by attempt() right after publishing PARKED: a timeout or cancel that
+    // fired while the operation was running saw it not parked and did nothing.
+    void afterPark() {
+        if (cancel && cancel->cancelled()) move(CANCELLED);
+        else if (Clock::now() >= deadline) move(TIMED_OUT);
+    }
+
+    // Runs the operation's first attempt in await_suspend(). True if the
+    // coroutine has to suspend.
+    bool start(std::coroutine_handle<> h, Executor& ex) {
+        handle = h;
+        executor = &ex;
+        std::shared_ptr<Waiter> self = shared_from_this(); // Outlives a resume racing with us.
+        if (!attempt()) return true;
+        unregister();
+        return false;
+    }
+
+    void unregister() {
+        if (!cancel || !registered) return;
+        std::lock_guard<std::mutex> g(cancel->mx);
+        auto& r = cancel->registered;
+        auto it = std::find(r.begin(), r.end(), shared_from_this());
+        if (it != r.end()) {
+            *it = r.back();
+            r.pop_back();
+        }
+    }
+
+    // Takes over a parked operation and schedules its next step.
+    bool move(int to) {
+        int expected = PARKED;
+        if (!state.compare_exchange_strong(expected, to)) return false;
+        executor->post(step, this);
+        return true;
+    }
+
+    // Retries when woken, or resumes the coroutine with the outcome. The
+    // operation object stays alive while its coroutine is suspended on it.
+    static void step(void* p) {
+        Waiter* w = (Waiter*)p;
+        std::shared_ptr<Waiter> self = w->shared_from_this(); // Parking may let another thread finish it.
+        int s = w->state.exchange(RUNNING);
+        if (s == RETRY && !w->attempt()) return;
+        if (s != RETRY) w->outcome = (Status)s;
+        w->unregister();
+        w->handle.resume();
+    }
+
+private:
+    bool registered = false;
+};
+
+inline void Cancel::cancel() {
+    flag.store(true);
+    std::vector<std::shared_ptr<Waiter>> parked;
+    {
+        std::lock_guard<std::mutex> g(mx);
+        parked = registered;
+    }
+    for (auto& w : parked) w->cancelled();
+}
+
+inline void Executor::expireAt(Clock::time_point when, std::shared_ptr<Waiter> w) {
+    std::lock_guard<std::mutex> g(mx);
+    if (!timerThread.joinable()) timerThread = std::thread([this] { runTimers(); });
+    bool earliest = timers.empty() || when < timers.begin()->first;
+    timers.emplace(when, std::move(w));
+    if (earliest) timerWake.notify_one();
+}
+
+inline void Executor::runTimers() {
+    std::unique_lock<std::mutex> g(mx);
+    std::vector<std::shared_ptr<Waiter>> due;
+    while (!stopping) {
+        if (timers.empty()) timerWake.wait(g);
+        else timerWake.wait_until(g, timers.begin()->first);
+        Clock::time_point now = Clock::now();
+        while (!timers.empty() && timers.begin()->first <= now) {
+            due.push_back(std::move(timers.begin()->second));
+            timers.erase(timers.begin());
+        }
+        g.unlock();
+        for (auto& w : due) w->expire();
+        due.clear();
+        g.lock();
+    }
+}
+
+template <class TL>
+class Locker {
+    class Pending;
+
+public:
+    enum Op { LOCK = 1, UPGRADE = 3 };
+
+    Locker(TL& tl, Executor& ex, int shards = 256) : tl(tl), ex(ex), queues(std::max(1, shards)) {}
+
+    // Awaitable result of lock() / upgrade(); co_await gives the Status.
+    class Awaitable {
+    public:
+        Awaitable(Locker& l, Op op, int v, int uid, Options o) : l(l), op(op), v(v), uid(uid), o(o) {}
+
+        // The uncontended case completes here, without allocating.
+        bool await_ready() {
+            if (!l.valid(v, uid)) status = REFUSED;
+            else if (o.cancel && o.cancel->cancelled()) status = CANCELLED;
+            else if (l.apply(op, v, uid)) status = ACQUIRED;
+            else return false;
+            return true;
+        }
+
+        bool await_suspend(std::coroutine_handle<> h) {
+            pending = std::make_shared<Pending>(l, op, v, uid, o);
+            return pending->begin(h);
+        }
+
+        Status await_resume() const { return pending ? pending->result() : status; }
+
+    private:
+        Locker& l;
+        Op op;
+        int v, uid;
+        Options o;
+        Status status = REFUSED;
+        std::shared_ptr<Pending> pending;
+    };
+
+    Awaitable lock(int v, int uid, Options o = Options()) { return Awaitable(*this, LOCK, v, uid, o); }
+    Awaitable upgrade(int v, int uid, Options o = Options()) { return Awaitable(*this, UPGRADE, v, uid, o); }
+
+    // Unlocks and wakes the operations the release may have unblocked.
+    bool unlock(int v, int uid) {
+        if (!valid(v, uid) || !tl.unlockNode(v, uid)) return false;
+        // Pairs with the fence in park(): either that parker sees this release or
+        // we see it parked.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (parked.load(std::memory_order_relaxed) == 0) return true;
+        for (int a = v;; a = (a - 1) / tl.m) {
+            wakeNode(a, v);
+            if (a == 0) break;
+        }
+        return true;
+    }
+
+    const TL& tree() const { return tl; }
+    uint64_t parks() const { return parkCount.load(); }
+    uint64_t wakeups() const { return wakeCount.load(); }
+
+private:
+    static const int TRANSIENT = -1, REFUSE = -2;
+    static const int SPINS_BEFORE_YIELD = 64;
+
+    // Why an operation waits on the queue of node b.
+    enum Kind {
+        HELD,    // b (v or an ancestor) is locked: wait for b's unlock.
+        BELOW,   // A lock of v waits for v's subtree to empty.
+        FOREIGN, // An upgrade of v waits for other uids' locks under v to go.
+    };
+
+    struct Block {
+        int node; // Or TRANSIENT / REFUSE.
+        Kind kind;
+        bool operator==(const Block& o) const { return node == o.node && kind == o.kind; }
+    };
+
+    struct Entry {
+        std::shared_ptr<Pending> w;
+        Kind kind;
+    };
+
+    struct Queue {
+        std::mutex mx;
+        std::atomic<int> waiting{0};
+        std::unordered_map<int, std::vector<Entry>> byNode;
+    };
+
+    class Pending : public Waiter {
+    public:
+        Pending(Locker& l, Op op, int v, int uid, const Options& o) : l(l), op(op), v(v), uid(uid) {
+            if (o.timeout > Clock::duration::zero()) deadline = Clock::now() + o.timeout;
+            cancel = o.cancel;
+        }
+
+        bool begin(std::coroutine_handle<> h) { return start(h, l.ex); }
+
+    protected:
+        bool attempt() override {
+            for (int spins = 0;; ++spins) {
+                if (l.apply(op, v, uid)) {
+                    outcome = ACQUIRED;
+                    baton = -1;
+                    return true;
+                }
+                if (expiredNow()) return passBaton();
+                Block b = l.blocker(op, v, uid);
+                if (b.node == REFUSE) {
+                    outcome = REFUSED;
+                    return passBaton();
+                }
+                if (b.node == TRANSIENT) {
+                    // Another operation is mid-flight on the path: retry, then let others run.
+                    if (spins < SPINS_BEFORE_YIELD) continue;
+                    state.store(PARKED);
+                    wake();
+                    return false;
+                }
+                registerOnce();
+                // The baton goes before parking: once PARKED is published a waker
+                // may hand this operation a new one. Back on the node it was
+                // handed, which is held again, it is just dropped: the rest of
+                // that queue waits for the same unlock.
+                int from = baton;
+                baton = -1;
+                if (from >= 0 && !(b == Block{from, HELD})) l.wakeNode(from, from);
+                if (l.park(b, *this)) {
+                    afterPark(); // Nothing else of this operation is touched from here on.
+                    return false;
+                }
+            }
+        }
+
+    private:
+        friend class Locker;
+        Locker& l;
+        Op op;
+        int v, uid;
+        int baton = -1; // Node whose unlock was handed to this operation alone (see wakeNode).
+
+        // Not taking the node it was handed: the next waiter for it gets a go.
+        bool passBaton() {
+            int from = baton;
+            baton = -1;
+            if (from >= 0) l.wakeNode(from, from);
+            return true;
+        }
+    };
+
+    TL& tl;
+    Executor& ex;
+    std::vector<Queue> queues;
+    std::atomic<long long> parked{0}; // Entries in all queues, including finished ones not yet swept.
+    std::atomic<uint64_t> parkCount{0}, wakeCount{0};
+
+    bool valid(int v, int uid) const { return v >= 0 && v < tl.n && uid != 0; }
+
+    bool apply(Op op, int v, int uid) {
+        if (op == LOCK) return tl.lockNode(v, uid);
+        if (!tl.upgradeNode(v, uid)) return false;
+        wakeSubtree(v); // Locks under v moved up to v; their waiters must re-park on it.
+        return true;
+    }
+
+    static int load(const int& x) { return __atomic_load_n(&x, __ATOMIC_SEQ_CST); }
+
+    // What (op, v, uid) waits for, TRANSIENT if nothing visible blocks it, or
+    // REFUSE if waiting cannot help.
+    Block blocker(Op op, int v, int uid) const {
+        int own = load(tl.lockedBy[v]);
+        if (own != 0) return Block{own == uid ? REFUSE : v, HELD};
+        for (int a = v; a != 0;) {
+            a = (a - 1) / tl.m;
+            int by = load(tl.lockedBy[a]);
+            if (by != 0) return Block{by == uid ? REFUSE : a, HELD};
+        }
+        int below = load(tl.descLocked[v]);
+        if (op == LOCK) return Block{below > 0 ? v : TRANSIENT, BELOW};
+        if (below == 0) return Block{REFUSE, FOREIGN}; // Nothing to upgrade.
+        return Block{foreignBelow(v, uid) ? v : TRANSIENT, FOREIGN};
+    }
+
+    // Whether a descendant of v is locked by someone other than uid. Costs about
+    // what the upgrade itself does.
+    bool foreignBelow(int v, int uid) const {
+        long long lo = v, hi = v;
+        while (true) {
+            lo = lo * tl.m + 1;
+            hi = hi * tl.m + tl.m;
+            if (lo >= tl.n) return false;
+            for (long long c = lo; c <= std::min<long long>(hi, tl.n - 1); ++c) {
+                int by = load(tl.lockedBy[c]);
+                if (by != 0 && by != uid) return true;
+            }
+        }
+    }
+
+    Queue& queueOf(int node) { return queues[(size_t)node % queues.size()]; }
+
+    // Parks w on b's queue, then checks b again: a release that ran before w was
+    // visible there did not wake it. False, with w not parked, if b no longer holds.
+    bool park(Block b, Pending& w) {
+        Queue& q = queueOf(b.node);
+        std::lock_guard<std::mutex> g(q.mx);
+        std::vector<Entry>& list = q.byNode[b.node];
+        list.push_back(Entry{std::static_pointer_cast<Pending>(w.shared_from_this()), b.kind});
+        q.waiting.fetch_add(1);
+        parked.fetch_add(1);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!(blocker(w.op, w.v, w.uid) == b)) {
+            list.pop_back();
+            if (list.empty()) q.byNode.erase(b.node);
+            q.waiting.fetch_sub(1);
+            parked.fetch_sub(1);
+            return false;
+        }
+        // Only now may a timer or cancel take it over; wakers need the queue lock.
+        w.state.store(Pending::PARKED);
+        parkCount.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    // Wakes the waiters on node a that the unlock of 'released' (a or one of its
+    // descendants) may have let through. Of the waiters that want a itself, only
+    // the first (in parking order) is woken, since the others would only find it
+    // taken again; if that one does not take it, it passes the wake on.
+    void wakeNode(int a, int released) {
+        Queue& q = queueOf(a);
+        if (q.waiting.load() == 0) return;
+        std::vector<std::shared_ptr<Pending>> woken;
+        bool handedOn = false;
+        size_t stale = 0;
+        {
+            std::lock_guard<std::mutex> g(q.mx);
+            auto it = q.byNode.find(a);
+            if (it == q.byNode.end()) return;
+            bool emptyBelow = load(tl.descLocked[a]) == 0;
+            std::vector<Entry>& list = it->second;
+            size_t keep = 0;
+            for (Entry& e : list) {
+                if (e.w->state.load() >= 0) { // Timed out or cancelled while parked here.
+                    ++stale;
+                    continue;
+                }
+                bool go = e.kind == FOREIGN || (e.kind == HELD ? a == released : emptyBelow);
+                if (go && e.kind == HELD && e.w->v == a) {
+                    go = !handedOn;
+                    handedOn = true;
+                    if (go) e.w->baton = a;
+                }
+                if (go) woken.push_back(std::move(e.w));
+                else list[keep++] = std::move(e);
+            }
+            list.resize(keep);
+            if (list.empty()) q.byNode.erase(it);
+            q.waiting.fetch_sub((int)(woken.size() + stale));
+        }
+        parked.fetch_sub((long long)stale);
+        finishWake(woken);
+    }
+
+    void wakeSubtree(int v) {
+        std::atomic_thread_fence(std::memory_order_seq_cst); // As in unlock().
+        if (parked.load(std::memory_order_relaxed) == 0) return;
+        std::vector<std::shared_ptr<Pending>> woken;
+        for (Queue& q : queues) {
+            if (q.waiting.load() == 0) continue;
+            std::lock_guard<std::mutex> g(q.mx);
+            for (auto it = q.byNode.begin(); it != q.byNode.end();) {
+                int x = it->first;
+                while (x > v) x = (x - 1) / tl.m;
+                if (x != v) {
+                    ++it;
+                    continue;
+                }
+                q.waiting.fetch_sub((int)it->second.size());
+                for (Entry& e : it->second) woken.push_back(std::move(e.w));
+                it = q.byNode.erase(it);
+            }
+        }
+        finishWake(woken);
+    }
+
+    void finishWake(std::vector<std::shared_ptr<Pending>>& woken) {
+        if (woken.empty()) return;
+        parked.fetch_sub((long long)woken.size());
+        wakeCount.fetch_add(woken.size(), std::memory_order_relaxed);
+        for (auto& w : woken) {
+            int from = w->baton;
+            if (!w->wake() && from >= 0) wakeNode(from, from); // Expired just now: hand the unlock on.
+        }
+    }
+};
+
+} // namespace async
@@ -0,0 +1,130 @@
+#include <iostream>
+#include <vector>
+#include <string>
+#include <atomic>
+#include <chrono>
+#include <latch>
+#include <type_traits>
+
+#include "workload.h"
+#include "variants.h"
+#include "asyncLocker.h"
+#include "verify.h"
+
+using namespace std;
+
+// Many logical sessions on a few threads through the coroutine API (asyncLocker.h).
+// Each of --sessions coroutines works through its share of a generated workload:
+// it locks the node (op 3: locks two children, then upgrades the node), holds it
+// for --hold executor turns, and unlocks. Conflicts park the session instead of
+// spinning, so --sessions can be far larger than --threads. Sessions that hold one
+// child while waiting for another can wait on each other, which --timeout-us
+// breaks (0 waits forever). At the end every lock has been released and the tree
+// must verify as empty.
+//   g++ -std=c++20 -O2 -pthread asyncSessions.cpp -o asyncSessions
+//   ./asyncSessions --variant Song_S --sessions 10000 --threads 4 --n 100000 --zipf 1.1 --timeout-us 2000
+
+struct Counters {
+    atomic<long long> outcomes[4] = {}, upgrades{0};
+};
+
+template <class TL>
+async::Task session(async::Locker<TL>& locker, async::Executor& ex, const vector<WorkloadOp>& ops, size_t first,
+                    size_t count, int uid, int hold, async::Options opt, Counters& c, latch& done) {
+    const TL& tl = locker.tree();
+    for (size_t i = first; i < first + count; ++i) {
+        int v = ops[i % ops.size()].node;
+        bool upgrade = ops[i % ops.size()].op == 3 && (long long)v * tl.m + 2 < tl.n;
+        async::Status s;
+        if (upgrade) {
+            int a = v * tl.m + 1, b = v * tl.m + 2;
+            s = co_await locker.lock(a, uid, opt);
+            if (s == async::ACQUIRED) {
+                async::Status t = co_await locker.lock(b, uid, opt);
+                if (t == async::ACQUIRED) {
+                    s = co_await locker.upgrade(v, uid, opt);
+                    if (s == async::ACQUIRED) c.upgrades++;
+                    else locker.unlock(b, uid);
+                } else {
+                    s = t;
+                }
+                if (s != async::ACQUIRED) locker.unlock(a, uid);
+            }
+        } else {
+            s = co_await locker.lock(v, uid, opt);
+        }
+        c.outcomes[s]++;
+        if (s != async::ACQUIRED) continue;
+        for (int h = 0; h < hold; ++h) co_await ex.yield();
+        locker.unlock(v, uid);
+    }
+    done.count_down();
+}
+
+int main(int argc, char** argv) {
+    WorkloadConfig cfg;
+    cfg.upgradeFrac = 0.05;
+    string variant = "Song_S";
+    int sessions = 10000, threads = 4, hold = 1;
+    long long opsPerSession = 100, timeoutUs = 10000;
+    for (int i = 1; i < argc; ++i) {
+        string key = argv[i];
+        if (i + 1 >= argc) {
+            cerr << "missing value for " << key << "\n";
+            return 1;
+        }
+        string val = argv[++i];
+        if (key == "--variant") variant = val;
+        else if (key == "--sessions") sessions = max(1, stoi(val));
+        else if (key == "--threads") threads = max(1, stoi(val));
+        else if (key == "--ops") opsPerSession = max(1LL, stoll(val));
+        else if (key == "--hold") hold = max(0, stoi(val));
+        else if (key == "--timeout-us") timeoutUs = stoll(val);
+        else if (!parseWorkloadFlag(cfg, key, val)) {
+            cerr << "usage: " << argv[0] << " [--variant Song_S|Song_M|mulSongs] [--sessions S] [--threads T]\n"
+                 << "  [--ops per session] [--hold turns] [--timeout-us U]\n" << workloadFlagsUsage();
+            return 1;
+        }
+    }
+    cfg.q = min<long long>(cfg.q, (long long)sessions * opsPerSession);
+    vector<WorkloadOp> ops = WorkloadGenerator(cfg).generate();
+
+    int status = 0;
+    bool known = withVariant(variant, cfg.n, cfg.m, [&](auto& tl) {
+        typedef typename std::remove_reference<decltype(tl)>::type TL;
+        Counters c;
+        latch done(sessions);
+        async::Options opt;
+        opt.timeout = chrono::microseconds(timeoutUs);
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        {
+            async::Executor ex(threads);
+            async::Locker<TL> locker(tl, ex);
+            for (int s = 0; s < sessions; ++s)
+                async::spawn(ex, session(locker, ex, ops, (size_t)s * opsPerSession, (size_t)opsPerSession, s + 1, hold,
+                                         opt, c, done));
+            done.wait();
+            double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            long long total = 0;
+            for (auto& o : c.outcomes) total += o.load();
+            cout << "variant,sessions,threads,ops,seconds,ops_per_sec,acquired,refused,timed_out,upgrades,parks,"
+                    "wakeups\n"
+                 << variant << "," << sessions << "," << threads << "," << total << "," << elapsed << ","
+                 << total / elapsed << "," << c.outcomes[async::ACQUIRED] << "," << c.outcomes[async::REFUSED] << ","
+                 << c.outcomes[async::TIMED_OUT] << "," << c.upgrades << "," << locker.parks() << ","
+                 << locker.wakeups() << "\n";
+        }
+        verify::Result r = verify::check(tl);
+        long long held = 0;
+        for (int v = 0; v < tl.n; ++v) held += tl.lockedBy[v] != 0;
+        if (!r.ok() || held != 0) {
+            cerr << "asyncSessions: " << r.describe() << ", " << held << " locks left\n";
+            status = 1;
+        }
+    });
+    if (!known) {
+        cerr << "unknown variant " << variant << "\n";
+        return 1;
+    }
+    return status;
+}
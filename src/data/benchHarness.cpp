@@ -0,0 +1,262 @@
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#include "workload.h"
+#include "latencyHistogram.h"
+#include "variants.h"
+#include "wal.h"
+#include "verify.h"
+
+using namespace std;
+
+// End-to-end benchmark across every TreeLocker variant.
+// Generates one workload, then for each (variant, thread count) forks a child that
+// builds a fresh tree, replays the ops split round-robin across threads, and reports
+// throughput and latency percentiles back over a pipe. Running each case in its own
+// process keeps peak RSS (taken from wait4) attributable to that case alone.
+//
+//   ./benchHarness --n 1000000 --m 4 --q 2000000 --zipf 0.9 --threads 1,2,4 --format json
+//
+// --wal DIR attaches a write-ahead log (DIR/<variant>.<threads>.wal, recreated per
+// case) with the given --wal-durability, to measure what durability costs.
+// --verify 1 checks descLocked and the lock hierarchy after each case, outside
+// the timed window; a case whose counters drifted is reported as failed.
+
+// Fixed-size record written by the child; plain data so it can cross the pipe as bytes.
+struct BenchResult {
+    double seconds;
+    long long ops;
+    long long successes;
+    uint64_t p50, p99, p999, maxNs;
+    double meanNs;
+};
+
+struct BenchRow {
+    string variant;
+    int threads;
+    BenchResult r;
+    long peakRssKb;
+};
+
+// Options for the optional write-ahead log of each case.
+struct WalOptions {
+    string dir;
+    wal::Durability durability = wal::GROUP;
+    int intervalUs = 1000;
+};
+
+template <class TL>
+BenchResult runOps(TL& tl, const vector<WorkloadOp>& ops, int threads, wal::Log* strictLog) {
+    vector<LatencyHistogram> hist(threads);
+    vector<long long> wins(threads, 0);
+    atomic<int> ready(0);
+    atomic<bool> go(false);
+
+    auto worker = [&](int t) {
+        LatencyHistogram& h = hist[t];
+        long long ok = 0;
+        ready.fetch_add(1);
+        while (!go.load(memory_order_acquire)) {
+        }
+        for (size_t i = t; i < ops.size(); i += threads) {
+            const WorkloadOp& o = ops[i];
+            auto s = chrono::steady_clock::now();
+            bool res = applyOp(tl, o.op, o.node, o.uid);
+            if (strictLog && !strictLog->commit()) { // Acknowledge only once durable.
+                cerr << "wal: commit failed\n";
+                _exit(5);
+            }
+            auto e = chrono::steady_clock::now();
+            h.record((uint64_t)chrono::duration_cast<chrono::nanoseconds>(e - s).count());
+            ok += res;
+        }
+        wins[t] = ok;
+    };
+
+    vector<thread> pool;
+    for (int t = 0; t < threads; ++t) pool.emplace_back(worker, t);
+    while (ready.load() < threads) {
+    }
+    auto start = chrono::steady_clock::now();
+    go.store(true, memory_order_release);
+    for (auto& th : pool) th.join();
+    auto end = chrono::steady_clock::now();
+
+    LatencyHistogram all;
+    long long successes = 0;
+    for (int t = 0; t < threads; ++t) {
+        all.merge(hist[t]);
+        successes += wins[t];
+    }
+    BenchResult r;
+    r.seconds = chrono::duration<double>(end - start).count();
+    r.ops = (long long)ops.size();
+    r.successes = successes;
+    r.p50 = all.percentile(0.50);
+    r.p99 = all.percentile(0.99);
+    r.p999 = all.percentile(0.999);
+    r.maxNs = all.max();
+    r.meanNs = all.mean();
+    return r;
+}
+
+// Runs one case in a child process. Returns false if the child failed.
+bool runCase(const string& variant, int threads, const WorkloadConfig& cfg,
+             const vector<WorkloadOp>& ops, const WalOptions& walOpt, bool verifyAfter, BenchRow& row) {
+    int fds[2];
+    if (pipe(fds) != 0) return false;
+    pid_t pid = fork();
+    if (pid < 0) return false;
+    if (pid == 0) {
+        close(fds[0]);
+        BenchResult r;
+        memset(&r, 0, sizeof(r));
+        bool known = withVariant(variant, cfg.n, cfg.m, [&](auto& tl) {
+            wal::Log log;
+            if (!walOpt.dir.empty()) {
+                string path = walOpt.dir + "/" + variant + "." + to_string(threads) + ".wal", error;
+                unlink(path.c_str());
+                if (!log.open(path, cfg.n, cfg.m, walOpt.durability, walOpt.intervalUs, 0, 0, error)) {
+                    cerr << error << "\n";
+                    _exit(3);
+                }
+                tl.sink = &log;
+            }
+            r = runOps(tl, ops, threads, log.strict() ? &log : nullptr);
+            log.close(); // The final flush is part of the case, but not of its timed window.
+            if (verifyAfter) {
+                verify::Result v = verify::check(tl);
+                if (!v.ok()) {
+                    cerr << "verify: " << variant << " x" << threads << ": " << v.describe() << "\n";
+                    _exit(4);
+                }
+            }
+        });
+        if (!known) _exit(2);
+#if TREELOCKER_TELEMETRY
+        cerr << "## " << variant << " x" << threads << "\n";
+        telemetry::report(cerr);
+#endif
+#if TREELOCKER_CONTENTION
+        cerr << "## " << variant << " x" << threads << "\n";
+        contention::Profiler::get().report(cerr); // The child leaves through _exit, so atexit never fires.
+#endif
+        ssize_t w = write(fds[1], &r, sizeof(r));
+        _exit(w == (ssize_t)sizeof(r) ? 0 : 1);
+    }
+    close(fds[1]);
+    BenchResult r;
+    ssize_t got = read(fds[0], &r, sizeof(r));
+    close(fds[0]);
+    int status = 0;
+    struct rusage ru;
+    if (wait4(pid, &status, 0, &ru) < 0) return false;
+    if (got != (ssize_t)sizeof(r) || !WIFEXITED(status) || WEXITSTATUS(status) != 0) return false;
+    row.variant = variant;
+    row.threads = threads;
+    row.r = r;
+    row.peakRssKb = ru.ru_maxrss; // Linux reports kilobytes.
+    return true;
+}
+
+vector<string> splitList(const string& s) {
+    vector<string> out;
+    stringstream ss(s);
+    string item;
+    while (getline(ss, item, ',')) if (!item.empty()) out.push_back(item);
+    return out;
+}
+
+void printCsv(const vector<BenchRow>& rows) {
+    cout << "variant,threads,ops,seconds,ops_per_sec,success_rate,p50_ns,p99_ns,p999_ns,max_ns,mean_ns,peak_rss_kb\n";
+    for (const BenchRow& b : rows) {
+        const BenchResult& r = b.r;
+        cout << b.variant << "," << b.threads << "," << r.ops << "," << r.seconds << ","
+             << (r.seconds > 0 ? r.ops / r.seconds : 0) << ","
+             << (r.ops ? (double)r.successes / r.ops : 0) << ","
+             << r.p50 << "," << r.p99 << "," << r.p999 << "," << r.maxNs << ","
+             << r.meanNs << "," << b.peakRssKb << "\n";
+    }
+}
+
+void printJson(const vector<BenchRow>& rows, const WorkloadConfig& c) {
+    cout << "{\"workload\":{\"n\":" << c.n << ",\"m\":" << c.m << ",\"q\":" << c.q
+         << ",\"lock\":" << c.lockFrac << ",\"unlock\":" << c.unlockFrac << ",\"upgrade\":" << c.upgradeFrac
+         << ",\"zipf\":" << c.zipf << ",\"uids\":" << c.uids << ",\"depth_bias\":" << c.depthBias
+         << ",\"seed\":" << c.seed << "},\"results\":[";
+    for (size_t i = 0; i < rows.size(); ++i) {
+        const BenchRow& b = rows[i];
+        const BenchResult& r = b.r;
+        cout << (i ? "," : "") << "{\"variant\":\"" << b.variant << "\",\"threads\":" << b.threads
+             << ",\"ops\":" << r.ops << ",\"seconds\":" << r.seconds
+             << ",\"ops_per_sec\":" << (r.seconds > 0 ? r.ops / r.seconds : 0)
+             << ",\"success_rate\":" << (r.ops ? (double)r.successes / r.ops : 0)
+             << ",\"p50_ns\":" << r.p50 << ",\"p99_ns\":" << r.p99 << ",\"p999_ns\":" << r.p999
+             << ",\"max_ns\":" << r.maxNs << ",\"mean_ns\":" << r.meanNs
+             << ",\"peak_rss_kb\":" << b.peakRssKb << "}";
+    }
+    cout << "]}\n";
+}
+
+int main(int argc, char** argv) {
+    WorkloadConfig cfg;
+    vector<string> variants = variantNames();
+    vector<int> threadCounts = {1};
+    string format = "csv";
+    WalOptions walOpt;
+    bool verifyAfter = false;
+
+    for (int i = 1; i < argc; ++i) {
+        string key = argv[i];
+        if (i + 1 >= argc) {
+            cerr << "missing value for " << key << "\n";
+            return 1;
+        }
+        string val = argv[++i];
+        if (key == "--variants") variants = splitList(val);
+        else if (key == "--threads") {
+            threadCounts.clear();
+            for (const string& t : splitList(val)) threadCounts.push_back(max(1, stoi(t)));
+        } else if (key == "--format") format = val;
+        else if (key == "--wal") walOpt.dir = val;
+        else if (key == "--wal-interval-us") walOpt.intervalUs = stoi(val);
+        else if (key == "--verify") verifyAfter = val != "0";
+        else if ((key != "--wal-durability" || !wal::parseDurability(val, walOpt.durability)) &&
+                 !parseWorkloadFlag(cfg, key, val)) {
+            cerr << "usage: " << argv[0] << " [--variants Song_S,Song_M,mulSongs] [--threads 1,2,4]"
+                 << " [--format csv|json]\n"
+                 << "  [--wal DIR --wal-durability off|group|strict --wal-interval-us N] [--verify 0|1]\n"
+                 << workloadFlagsUsage();
+            return 1;
+        }
+    }
+
+    WorkloadGenerator gen(cfg);
+    vector<WorkloadOp> ops = gen.generate();
+
+    vector<BenchRow> rows;
+    for (const string& v : variants) {
+        for (int t : threadCounts) {
+            BenchRow row;
+            if (!runCase(v, t, cfg, ops, walOpt, verifyAfter, row)) {
+                cerr << "case " << v << " x" << t << " failed\n";
+                continue;
+            }
+            rows.push_back(row);
+        }
+    }
+
+    if (format == "json") printJson(rows, cfg);
+    else printCsv(rows);
+    return 0;
+}
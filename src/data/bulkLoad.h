@@ -0,0 +1,102 @@
+#pragma once
+
+// Bulk loading of an initial lock state, without going through lockNode().
+//
+// Calling lockNode() for k locks costs O(k * depth) plus the path locks of every
+// call. load() instead writes lockedBy directly and builds every descLocked
+// counter in one bottom-up pass over the implicit tree. The pass runs a level at
+// a time, deepest first. Each node pulls the totals of its m children, which are
+// contiguous and all on the level below, so nodes of one level are independent
+// and a large level is split across threads without atomics.
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "telemetry.h"
+
+namespace bulk {
+
+// Levels smaller than this are not worth starting threads for.
+const int PARALLEL_MIN_LEVEL = 1 << 16;
+
+// Rebuilds descLocked[0..n) from lockedBy with the given number of threads
+// (0 = one per hardware thread).
+inline void countDescendants(const int32_t* lockedBy, int32_t* descLocked, int n, int m, int threads = 0) {
+    if (n <= 0) return;
+    if (threads <= 0) threads = (int)std::max(1u, std::thread::hardware_concurrency());
+    auto pull = [=](long long lo, long long hi) {
+        for (long long p = lo; p < hi; ++p) {
+            long long c = p * m + 1, end = std::min<long long>(c + m, n);
+            int32_t sum = 0;
+            for (; c < end; ++c) sum += descLocked[c] + (lockedBy[c] != 0);
+            descLocked[p] = sum;
+        }
+    };
+    // Serially, plain reverse index order already visits children first.
+    if (threads == 1 || m == 1 || n < 2 * PARALLEL_MIN_LEVEL) {
+        for (long long p = n - 1; p >= 0; --p) pull(p, p + 1);
+        return;
+    }
+
+    std::vector<long long> starts = {0}; // First index of each level.
+    while (starts.back() < n) starts.push_back(starts.back() * m + 1);
+    for (size_t l = starts.size() - 1; l-- > 0;) {
+        long long lo = starts[l], hi = std::min<long long>(starts[l + 1], n);
+        if (hi - lo < PARALLEL_MIN_LEVEL) {
+            pull(lo, hi);
+            continue;
+        }
+        std::vector<std::thread> workers;
+        long long chunk = (hi - lo + threads - 1) / threads;
+        for (long long a = lo + chunk; a < hi; a += chunk) workers.emplace_back(pull, a, std::min(a + chunk, hi));
+        pull(lo, std::min(lo + chunk, hi));
+        for (std::thread& t : workers) t.join();
+    }
+}
+
+// First locked node that also has a locked descendant (so some lock sits under
+// another one), or -1. Needs descLocked to be current.
+inline int firstNestedLock(const int32_t* lockedBy, const int32_t* descLocked, int n) {
+    for (int i = 0; i < n; ++i)
+        if (lockedBy[i] != 0 && descLocked[i] != 0) return i;
+    return -1;
+}
+
+// Replaces the whole state of 'tl' (which must not be in use) with the given
+// (node, uid) locks. Returns false with 'error' set, leaving 'tl' all unlocked,
+// if a node is out of range or listed twice, a uid is 0, or one lock lies under
+// another, since lockNode() could never have produced such a state.
+template <class TL>
+bool load(TL& tl, const std::vector<std::pair<int, int>>& locks, std::string& error, int threads = 0) {
+    std::fill(tl.lockedBy.begin(), tl.lockedBy.end(), 0);
+    for (const std::pair<int, int>& l : locks) {
+        bool valid = l.first >= 0 && l.first < tl.n && l.second != 0;
+        if (!valid || tl.lockedBy[l.first] != 0) {
+            error = valid ? "bulk load: node " + std::to_string(l.first) + " is listed twice"
+                          : "bulk load: bad entry (" + std::to_string(l.first) + ", " + std::to_string(l.second) + ")";
+            std::fill(tl.lockedBy.begin(), tl.lockedBy.end(), 0);
+            std::fill(tl.descLocked.begin(), tl.descLocked.end(), 0);
+            return false;
+        }
+        tl.lockedBy[l.first] = l.second;
+    }
+    countDescendants(tl.lockedBy.data(), tl.descLocked.data(), tl.n, tl.m, threads);
+    int nested = firstNestedLock(tl.lockedBy.data(), tl.descLocked.data(), tl.n);
+    if (nested >= 0) {
+        error = "bulk load: node " + std::to_string(nested) + " is locked together with a descendant";
+        std::fill(tl.lockedBy.begin(), tl.lockedBy.end(), 0);
+        std::fill(tl.descLocked.begin(), tl.descLocked.end(), 0);
+        return false;
+    }
+#if TREELOCKER_TELEMETRY
+    for (const std::pair<int, int>& l : locks) TL_LOCK_DELTA(l.first, tl.m, 1);
+#endif
+    return true;
+}
+
+} // namespace bulk
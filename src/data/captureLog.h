@@ -0,0 +1,215 @@
+#pragma once
+
+// Compact binary log of incoming queries, for offline record-and-replay.
+//
+// A log is a Header followed by frames. Each capturing thread fills its own buffer and
+// appends it as one frame (under a mutex) every FRAME_BYTES or at close, so capturing
+// threads never contend per query. Inside a frame, records are varint encoded:
+//   zigzag(ts - previous ts in frame), op byte, node, zigzag(uid)
+// with ts in nanoseconds since the log was opened, so a typical record is 6-9 bytes.
+//
+// Frame: varint tid, varint record count, varint payload bytes, payload.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace capture {
+
+const uint32_t VERSION = 1;
+const size_t FRAME_BYTES = 32 * 1024;
+
+struct Header {
+    char magic[8];       // "TLCAPTUR"
+    uint32_t version;
+    int32_t n, m;        // Tree shape the queries were issued against.
+    uint32_t reserved;
+    uint64_t startUnixNs; // Wall clock at open, for correlating with other logs.
+};
+
+struct Entry {
+    uint64_t tsNs; // Arrival time, nanoseconds since the log was opened.
+    uint32_t tid;  // Capturing thread, as numbered by the writer.
+    int op, node, uid;
+};
+
+inline void putVarint(std::string& out, uint64_t v) {
+    while (v >= 0x80) {
+        out.push_back((char)(v | 0x80));
+        v >>= 7;
+    }
+    out.push_back((char)v);
+}
+
+inline uint64_t zigzag(int64_t v) { return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63); }
+inline int64_t unzigzag(uint64_t v) { return (int64_t)(v >> 1) ^ -(int64_t)(v & 1); }
+
+// Returns false on truncated input.
+inline bool getVarint(const char*& p, const char* end, uint64_t& v) {
+    v = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7) {
+        uint8_t b = (uint8_t)*p++;
+        v |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) return true;
+    }
+    return false;
+}
+
+class Writer {
+public:
+    // Truncates 'path'. Returns false if it cannot be opened.
+    bool open(const std::string& path, int n, int m) {
+        out.open(path, std::ios::binary | std::ios::trunc);
+        if (!out) return false;
+        Header h;
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, "TLCAPTUR", 8);
+        h.version = VERSION;
+        h.n = n;
+        h.m = m;
+        h.startUnixNs = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            std::chrono::system_clock::now().time_since_epoch()).count();
+        out.write((const char*)&h, sizeof(h));
+        start = std::chrono::steady_clock::now();
+        ++generation;
+        return true;
+    }
+
+    bool isOpen() const { return out.is_open(); }
+
+    // Records one query arriving now on the calling thread.
+    void append(int op, int node, int uid) { append(op, node, uid, std::chrono::steady_clock::now()); }
+
+    // Records one query that arrived at 'at', for callers that log after the fact
+    // to keep the capture out of a timed section. A thread's calls must come in
+    // arrival order.
+    void append(int op, int node, int uid, std::chrono::steady_clock::time_point at) {
+        ThreadBuffer& b = local();
+        uint64_t ts = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(at - start).count();
+        putVarint(b.payload, zigzag((int64_t)(ts - b.lastTs)));
+        b.payload.push_back((char)op);
+        putVarint(b.payload, (uint32_t)node);
+        putVarint(b.payload, zigzag(uid));
+        b.lastTs = ts;
+        ++b.count;
+        if (b.payload.size() >= FRAME_BYTES) flush(b);
+    }
+
+    // Flushes every thread's pending records and closes the file. Capturing threads
+    // must be done appending.
+    void close() {
+        if (!out.is_open()) return;
+        std::lock_guard<std::mutex> g(mx);
+        for (auto& b : buffers) writeFrame(*b);
+        buffers.clear();
+        out.close();
+        ++generation;
+    }
+
+    ~Writer() { close(); }
+
+private:
+    struct ThreadBuffer {
+        uint32_t tid;
+        uint64_t count = 0, lastTs = 0;
+        std::string payload;
+    };
+
+    std::ofstream out;
+    std::chrono::steady_clock::time_point start;
+    std::mutex mx; // Guards 'out' and 'buffers'.
+    std::vector<std::unique_ptr<ThreadBuffer>> buffers;
+    uint64_t generation = 0; // Bumped per open/close so stale thread buffers are not reused.
+
+    ThreadBuffer& local() {
+        thread_local const Writer* owner = nullptr;
+        thread_local uint64_t ownerGeneration = 0;
+        thread_local ThreadBuffer* buf = nullptr;
+        if (owner != this || ownerGeneration != generation) {
+            std::lock_guard<std::mutex> g(mx);
+            buffers.emplace_back(new ThreadBuffer());
+            buf = buffers.back().get();
+            buf->tid = (uint32_t)(buffers.size() - 1);
+            owner = this;
+            ownerGeneration = generation;
+        }
+        return *buf;
+    }
+
+    void flush(ThreadBuffer& b) {
+        std::lock_guard<std::mutex> g(mx);
+        writeFrame(b);
+    }
+
+    void writeFrame(ThreadBuffer& b) {
+        if (b.count == 0) return;
+        std::string head;
+        putVarint(head, b.tid);
+        putVarint(head, b.count);
+        putVarint(head, b.payload.size());
+        out.write(head.data(), (std::streamsize)head.size());
+        out.write(b.payload.data(), (std::streamsize)b.payload.size());
+        b.payload.clear();
+        b.count = 0;
+        b.lastTs = 0;
+    }
+};
+
+// Loads a whole log, ordered by arrival time (ties keep per-thread order).
+// Returns false with a message in 'error' if the file is missing or malformed.
+inline bool readLog(const std::string& path, Header& h, std::vector<Entry>& entries, std::string& error) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        error = "cannot open " + path;
+        return false;
+    }
+    std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    if (data.size() < sizeof(Header) || memcmp(data.data(), "TLCAPTUR", 8) != 0) {
+        error = path + ": not a capture log";
+        return false;
+    }
+    memcpy(&h, data.data(), sizeof(h));
+    if (h.version != VERSION) {
+        error = path + ": unsupported capture version " + std::to_string(h.version);
+        return false;
+    }
+
+    const char* p = data.data() + sizeof(Header);
+    const char* end = data.data() + data.size();
+    entries.clear();
+    while (p < end) {
+        uint64_t tid, count, bytes;
+        if (!getVarint(p, end, tid) || !getVarint(p, end, count) || !getVarint(p, end, bytes) ||
+            bytes > (uint64_t)(end - p)) {
+            error = path + ": truncated frame";
+            return false;
+        }
+        const char* frameEnd = p + bytes;
+        uint64_t ts = 0;
+        for (uint64_t i = 0; i < count; ++i) {
+            uint64_t dts, node, uid;
+            if (!getVarint(p, frameEnd, dts) || p >= frameEnd) {
+                error = path + ": truncated record";
+                return false;
+            }
+            int op = (uint8_t)*p++;
+            if (!getVarint(p, frameEnd, node) || !getVarint(p, frameEnd, uid)) {
+                error = path + ": truncated record";
+                return false;
+            }
+            ts += (uint64_t)unzigzag(dts);
+            entries.push_back(Entry{ts, (uint32_t)tid, op, (int)node, (int)unzigzag(uid)});
+        }
+        p = frameEnd;
+    }
+    std::stable_sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) { return a.tsNs < b.tsNs; });
+    return true;
+}
+
+} // namespace capture
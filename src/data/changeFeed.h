@@ -0,0 +1,214 @@
+#pragma once
+
+// Change feed: subscribers watch nodes and hear about every lock, unlock and
+// upgrade in their subtrees.
+//
+// The Hub is a ChangeSink. Attach it with 'tl.sink = &hub'; another sink (the WAL)
+// can sit behind it as 'next'. It keeps a watch count per node. A change at v walks
+// v's path to the root and hands an event to the subscribers of every watched node
+// on it. With no watchers anywhere, a change costs one relaxed load on top of the
+// sink call. With watchers elsewhere in the tree, it costs one relaxed load per
+// level of v's path.
+//
+// Events are coalesced per subscriber: until the subscriber takes them, a node
+// that changes again keeps its place in the queue and shows only its latest state.
+// A subscriber learns about pending events through an eventfd, either its own
+// (fd(), for in-process consumers) or one it shares with others. The lock server
+// shares one per event loop and writes the events to the watching connection
+// (WATCH/UNWATCH in lockProtocol.h).
+//
+//   feed::Hub hub(tl.n, tl.m);
+//   tl.sink = &hub;
+//   feed::Subscriber s(hub);
+//   s.watch(albumNode);
+//   poll s.fd() for POLLIN, then s.take(events)
+//
+// A watch covers changes made after watch() returns. A change racing with the
+// call may or may not be reported, so read the current state after watching.
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "changeSink.h"
+
+namespace feed {
+
+enum Kind : uint8_t { LOCKED = 1, UNLOCKED = 2, UPGRADED = 3 };
+
+struct Event {
+    int32_t node;
+    int32_t uid;  // Holder after the change; 0 once unlocked.
+    uint8_t kind; // The last change to the node, if several were coalesced.
+};
+
+class Hub;
+
+class Subscriber {
+public:
+    // 'wakeFd' (an eventfd) is written whenever events become pending after a
+    // take(); with -1 the subscriber makes its own, see fd().
+    explicit Subscriber(Hub& hub, int wakeFd = -1);
+    ~Subscriber();
+    Subscriber(const Subscriber&) = delete;
+    Subscriber& operator=(const Subscriber&) = delete;
+
+    // False if 'v' is out of range or already watched.
+    bool watch(int v);
+    // False if 'v' was not watched.
+    bool unwatch(int v);
+
+    int fd() const { return wakeFd; }
+
+    // Moves the pending events, oldest first, into 'out'. False if there were none.
+    // Also resets the subscriber's own eventfd.
+    bool take(std::vector<Event>& out) {
+        if (ownFd) {
+            uint64_t n;
+            ssize_t r = read(wakeFd, &n, sizeof(n));
+            (void)r;
+        }
+        std::lock_guard<std::mutex> g(mx);
+        signalled = false;
+        if (pending.empty()) return false;
+        out.insert(out.end(), pending.begin(), pending.end());
+        pending.clear();
+        index.clear();
+        return true;
+    }
+
+private:
+    friend class Hub;
+    Hub& hub;
+    int wakeFd;
+    bool ownFd;
+    std::vector<int> watched; // Guarded by the hub's mutex.
+    std::mutex mx;            // Guards the queue.
+    std::vector<Event> pending;
+    std::unordered_map<int, size_t> index; // Node -> its event in 'pending'.
+    bool signalled = false;
+
+    void add(int v, int uid, Kind k) {
+        std::lock_guard<std::mutex> g(mx);
+        auto it = index.find(v);
+        if (it != index.end()) {
+            pending[it->second].uid = uid;
+            pending[it->second].kind = k;
+            return;
+        }
+        index.emplace(v, pending.size());
+        pending.push_back(Event{v, uid, k});
+        if (!signalled) {
+            signalled = true;
+            uint64_t one = 1;
+            ssize_t w = write(wakeFd, &one, sizeof(one));
+            (void)w;
+        }
+    }
+};
+
+class Hub : public ChangeSink {
+public:
+    ChangeSink* next = nullptr; // Called first, for every change.
+
+    Hub(int n, int m) : n(n), m(m), counts(new std::atomic<uint32_t>[n]()) {}
+
+    void onLock(int v, int uid) override {
+        if (next) next->onLock(v, uid);
+        if (total.load(std::memory_order_relaxed) != 0) publish(v, uid, LOCKED);
+    }
+
+    void onUnlock(int v, int uid) override {
+        if (next) next->onUnlock(v, uid);
+        if (total.load(std::memory_order_relaxed) != 0) publish(v, 0, UNLOCKED);
+    }
+
+    void onUpgrade(int v, int uid, const std::vector<int>& unlocked) override {
+        if (next) next->onUpgrade(v, uid, unlocked);
+        if (total.load(std::memory_order_relaxed) == 0) return;
+        for (int u : unlocked) publish(u, 0, UNLOCKED);
+        publish(v, uid, UPGRADED);
+    }
+
+    int nodes() const { return n; }
+    // Watches across all subscribers.
+    int watches() const { return total.load(); }
+
+private:
+    friend class Subscriber;
+    int n, m;
+    std::unique_ptr<std::atomic<uint32_t>[]> counts; // Watches per node.
+    std::atomic<int> total{0};
+    std::mutex mx; // Guards the map below and every Subscriber::watched.
+    std::unordered_multimap<int, Subscriber*> byNode;
+
+    void publish(int v, int uid, Kind k) {
+        for (int u = v;; u = (u - 1) / m) {
+            if (counts[u].load(std::memory_order_relaxed) != 0) {
+                std::lock_guard<std::mutex> g(mx);
+                auto range = byNode.equal_range(u);
+                for (auto it = range.first; it != range.second; ++it) it->second->add(v, uid, k);
+            }
+            if (u == 0) break;
+        }
+    }
+
+    bool add(Subscriber* s, int v) {
+        if (v < 0 || v >= n) return false;
+        std::lock_guard<std::mutex> g(mx);
+        for (int w : s->watched)
+            if (w == v) return false;
+        s->watched.push_back(v);
+        byNode.emplace(v, s);
+        counts[v].fetch_add(1);
+        total.fetch_add(1);
+        return true;
+    }
+
+    bool remove(Subscriber* s, int v) {
+        std::lock_guard<std::mutex> g(mx);
+        return removeLocked(s, v);
+    }
+
+    bool removeLocked(Subscriber* s, int v) {
+        auto range = byNode.equal_range(v);
+        for (auto it = range.first; it != range.second; ++it)
+            if (it->second == s) {
+                byNode.erase(it);
+                for (size_t i = 0; i < s->watched.size(); ++i)
+                    if (s->watched[i] == v) {
+                        s->watched[i] = s->watched.back();
+                        s->watched.pop_back();
+                        break;
+                    }
+                counts[v].fetch_sub(1);
+                total.fetch_sub(1);
+                return true;
+            }
+        return false;
+    }
+
+    void removeAll(Subscriber* s) {
+        std::lock_guard<std::mutex> g(mx);
+        while (!s->watched.empty()) removeLocked(s, s->watched.back());
+    }
+};
+
+inline Subscriber::Subscriber(Hub& hub, int wakeFd) : hub(hub), wakeFd(wakeFd), ownFd(wakeFd < 0) {
+    if (ownFd) this->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+}
+
+inline Subscriber::~Subscriber() {
+    hub.removeAll(this); // After this no publisher can reach us.
+    if (ownFd) close(wakeFd);
+}
+
+inline bool Subscriber::watch(int v) { return hub.add(this, v); }
+inline bool Subscriber::unwatch(int v) { return hub.remove(this, v); }
+
+} // namespace feed
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <vector>
+
+// Observer for the successful state changes of a TreeLocker (write-ahead log,
+// replication, change feeds). Every variant calls its sink from inside the
+// operation's critical section, so two conflicting changes reach the sink in the
+// order they took effect. Changes on disjoint subtrees can arrive concurrently,
+// so a sink must be thread-safe and should do very little work per call.
+struct ChangeSink {
+    virtual ~ChangeSink() {}
+    virtual void onLock(int v, int uid) = 0;
+    virtual void onUnlock(int v, int uid) = 0;
+    // 'unlocked' holds the descendants of 'v' whose locks the upgrade released.
+    virtual void onUpgrade(int v, int uid, const std::vector<int>& unlocked) = 0;
+};
+
+// What a server waits on before acknowledging changes: a strict write-ahead log,
+// synchronous replicas. commit() returns true once every change made so far is
+// safe, and false if they cannot be made safe any more; the caller must then not
+// acknowledge them.
+struct Committer {
+    virtual ~Committer() {}
+    virtual bool commit() = 0;
+};
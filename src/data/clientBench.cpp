@@ -0,0 +1,117 @@
+#include <iostream>
+#include <vector>
+#include <string>
+#include <thread>
+#include <chrono>
+
+#include "workload.h"
+#include "latencyHistogram.h"
+#include "lockClient.h"
+
+using namespace std;
+
+// Application-style load for lockServer through the client library (lockClient.h).
+// Each of --threads threads makes one blocking call at a time, as a request
+// handler would, and the library coalesces what the threads have outstanding into
+// shared frames over --connections sockets. --batch 1 --window 1 turns coalescing
+// off, so every call costs its own round trip. --n and --m must match the server's
+// tree. Reports throughput, the batching achieved and the latency of single calls:
+//   ./clientBench --unix /tmp/treelocker.sock --n 1000000 --m 4 --threads 256 --connections 2
+
+typedef chrono::steady_clock Clock;
+
+struct ThreadResult {
+    long long requests = 0, successes = 0, badRequests = 0, lost = 0;
+    LatencyHistogram latency;
+};
+
+void runThread(client::LockClient& c, const vector<WorkloadOp>& ops, Clock::time_point end, ThreadResult& res) {
+    for (size_t i = 0; Clock::now() < end; ++i) {
+        const WorkloadOp& o = ops[i % ops.size()];
+        Clock::time_point t = Clock::now();
+        client::Result r = c.request((uint8_t)o.op, o.node, o.uid).get();
+        res.latency.record((uint64_t)chrono::duration_cast<chrono::nanoseconds>(Clock::now() - t).count());
+        res.requests++;
+        res.successes += r == client::TRUE;
+        res.badRequests += r == client::BAD_REQUEST;
+        if (r == client::LOST) {
+            res.lost++;
+            return;
+        }
+    }
+}
+
+int main(int argc, char** argv) {
+    WorkloadConfig cfg;
+    client::Options opt;
+    string unixPath, host = "127.0.0.1";
+    int port = 0, connections = 1, threads = 64;
+    double seconds = 5;
+    for (int i = 1; i < argc; ++i) {
+        string key = argv[i];
+        if (i + 1 >= argc) {
+            cerr << "missing value for " << key << "\n";
+            return 1;
+        }
+        string val = argv[++i];
+        if (key == "--unix") unixPath = val;
+        else if (key == "--port") port = stoi(val);
+        else if (key == "--host") host = val;
+        else if (key == "--connections") connections = max(1, stoi(val));
+        else if (key == "--threads") threads = max(1, stoi(val));
+        else if (key == "--batch") opt.maxBatch = (uint32_t)max(1, stoi(val));
+        else if (key == "--window") opt.window = max(1, stoi(val));
+        else if (key == "--seconds") seconds = stod(val);
+        else if (!parseWorkloadFlag(cfg, key, val)) {
+            cerr << "usage: " << argv[0] << " (--unix PATH | --port PORT [--host ADDR]) [--connections C]\n"
+                 << "  [--threads T] [--batch B] [--window W] [--seconds S]\n" << workloadFlagsUsage();
+            return 1;
+        }
+    }
+    if (unixPath.empty() && port == 0) {
+        cerr << "need --unix or --port\n";
+        return 1;
+    }
+
+    client::LockClient c(opt);
+    string error;
+    if (!(unixPath.empty() ? c.connectTcp(host, port, connections, error)
+                           : c.connectUnix(unixPath, connections, error))) {
+        cerr << error << "\n";
+        return 1;
+    }
+    vector<vector<WorkloadOp>> ops(threads);
+    for (int t = 0; t < threads; ++t) {
+        WorkloadConfig w = cfg;
+        w.seed = cfg.seed + t;
+        w.q = min<long long>(cfg.q, 100000);
+        ops[t] = WorkloadGenerator(w).generate();
+    }
+
+    vector<ThreadResult> results(threads);
+    vector<thread> pool;
+    Clock::time_point start = Clock::now();
+    Clock::time_point end = start + chrono::duration_cast<Clock::duration>(chrono::duration<double>(seconds));
+    for (int t = 0; t < threads; ++t) pool.emplace_back(runThread, ref(c), cref(ops[t]), end, ref(results[t]));
+    for (thread& th : pool) th.join();
+    double elapsed = chrono::duration<double>(Clock::now() - start).count();
+
+    ThreadResult all;
+    for (const ThreadResult& r : results) {
+        all.requests += r.requests;
+        all.successes += r.successes;
+        all.badRequests += r.badRequests;
+        all.lost += r.lost;
+        all.latency.merge(r.latency);
+    }
+    uint64_t frames = c.framesSent();
+    cout << "threads,connections,batch,window,requests,seconds,ops_per_sec,requests_per_frame,success_rate,"
+            "bad_requests,call_p50_ns,call_p99_ns,call_p999_ns\n"
+         << threads << "," << connections << "," << opt.maxBatch << "," << opt.window << "," << all.requests << ","
+         << elapsed << "," << all.requests / elapsed << "," << (frames ? (double)c.requestsSent() / frames : 0)
+         << "," << (all.requests ? (double)all.successes / all.requests : 0) << "," << all.badRequests << ","
+         << all.latency.percentile(0.50) << "," << all.latency.percentile(0.99) << ","
+         << all.latency.percentile(0.999) << "\n";
+    if (all.lost) cerr << "connection lost\n";
+    return all.lost ? 1 : 0;
+}
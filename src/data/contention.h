@@ -0,0 +1,248 @@
+#pragma once
+
+// Lock contention profiler for the per-node locks of the TreeLocker variants.
+// Build with -DTREELOCKER_CONTENTION=1 to enable; otherwise the TL_*_LOCK macros
+// below are plain lock() calls and nothing here is referenced.
+//
+// Every node acquisition is counted per tree level in per-thread counters. Only when
+// the first try fails does the profiler time the wait (and, for spinlocks, count the
+// failed test-and-set rounds) and charge it to the node with relaxed atomics, so the
+// uncontended path costs one thread-local increment.
+//
+// The report groups acquisitions and waits by level and lists the top-K hottest
+// nodes, per tree. It is written to stderr at exit and on every SIGUSR2.
+
+#ifndef TREELOCKER_CONTENTION
+#define TREELOCKER_CONTENTION 0
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+
+#include "telemetry.h"
+
+namespace contention {
+
+const int MAX_LEVELS = 64;
+
+inline void installSignalDump(int sig);
+
+struct NodeStats {
+    std::atomic<uint64_t> contended{0}; // Acquisitions whose first attempt failed.
+    std::atomic<uint64_t> spins{0};     // Failed test-and-set rounds (spinlocks only).
+    std::atomic<uint64_t> waitNs{0};    // Time from the failed attempt to ownership.
+};
+
+struct alignas(64) ThreadLevels {
+    telemetry::Counter acquired[MAX_LEVELS + 1]; // Last slot is the global lock (node -1).
+};
+
+// Stats of one TreeLocker. Each tree owns its own, so a tree built while others
+// are serving (lockCluster's partitions and coordinator) neither resets nor mixes
+// with their numbers.
+struct Tree {
+    uint64_t id;
+    int n, m;
+    std::vector<uint8_t> level;               // Depth of every node, precomputed once.
+    std::unique_ptr<NodeStats[]> nodes;
+    NodeStats global;                         // mulSongs' single tree-wide spinlock.
+    std::mutex mx;                            // Guards the thread list only.
+    std::vector<std::unique_ptr<ThreadLevels>> threads;
+
+    Tree(uint64_t id_, int n_, int m_) : id(id_), n(n_), m(m_ < 1 ? 1 : m_), level(n_ > 0 ? n_ : 0, 0),
+                                         nodes(new NodeStats[n_ > 0 ? n_ : 1]) {
+        for (int i = 1; i < n; ++i) level[i] = (uint8_t)std::min(level[(i - 1) / m] + 1, MAX_LEVELS - 1);
+    }
+
+    ThreadLevels& local() {
+        // Threads usually stay on one tree; the list covers those that move between several.
+        thread_local uint64_t lastId = 0;
+        thread_local ThreadLevels* last = nullptr;
+        thread_local std::vector<std::pair<uint64_t, ThreadLevels*>> seen;
+        if (lastId == id) return *last;
+        ThreadLevels* t = nullptr;
+        for (auto& e : seen)
+            if (e.first == id) t = e.second;
+        if (!t) {
+            std::lock_guard<std::mutex> g(mx);
+            threads.emplace_back(new ThreadLevels());
+            t = threads.back().get();
+            seen.emplace_back(id, t);
+        }
+        lastId = id;
+        last = t;
+        return *t;
+    }
+
+    NodeStats* statsFor(int node) { return node < 0 || node >= n ? &global : &nodes[node]; }
+    int levelSlot(int node) { return node < 0 || node >= n ? MAX_LEVELS : level[node]; }
+
+    void acquired(int node) { local().acquired[levelSlot(node)].add(1); }
+
+    void waited(int node, uint64_t spins, uint64_t ns) {
+        NodeStats* s = statsFor(node);
+        s->contended.fetch_add(1, std::memory_order_relaxed);
+        s->spins.fetch_add(spins, std::memory_order_relaxed);
+        s->waitNs.fetch_add(ns, std::memory_order_relaxed);
+    }
+
+    bool contended() const {
+        if (global.contended.load(std::memory_order_relaxed) != 0) return true;
+        for (int i = 0; i < n; ++i)
+            if (nodes[i].contended.load(std::memory_order_relaxed) != 0) return true;
+        return false;
+    }
+
+    void report(std::ostream& out, int topK) {
+        std::lock_guard<std::mutex> g(mx);
+        uint64_t acq[MAX_LEVELS + 1] = {}, cont[MAX_LEVELS + 1] = {}, spins[MAX_LEVELS + 1] = {}, wait[MAX_LEVELS + 1] = {};
+        for (auto& t : threads)
+            for (int d = 0; d <= MAX_LEVELS; ++d) acq[d] += t->acquired[d].get();
+        struct Hot { int node; uint64_t contended, spins, waitNs; };
+        std::vector<Hot> hot;
+        for (int i = 0; i < n; ++i) {
+            uint64_t c = nodes[i].contended.load(std::memory_order_relaxed);
+            if (c == 0) continue;
+            Hot h{i, c, nodes[i].spins.load(std::memory_order_relaxed), nodes[i].waitNs.load(std::memory_order_relaxed)};
+            cont[level[i]] += h.contended;
+            spins[level[i]] += h.spins;
+            wait[level[i]] += h.waitNs;
+            hot.push_back(h);
+        }
+        cont[MAX_LEVELS] = global.contended.load(std::memory_order_relaxed);
+        spins[MAX_LEVELS] = global.spins.load(std::memory_order_relaxed);
+        wait[MAX_LEVELS] = global.waitNs.load(std::memory_order_relaxed);
+
+        uint64_t totalWait = 0;
+        for (int d = 0; d <= MAX_LEVELS; ++d) totalWait += wait[d];
+
+        out << "# contention by level\n";
+        out << "level,acquisitions,contended,contended_pct,spins,wait_ns,wait_share_pct\n";
+        for (int d = 0; d <= MAX_LEVELS; ++d) {
+            if (acq[d] == 0 && cont[d] == 0) continue;
+            if (d == MAX_LEVELS) out << "global";
+            else out << d;
+            out << "," << acq[d] << "," << cont[d] << "," << (acq[d] ? 100.0 * cont[d] / acq[d] : 0.0) << ","
+                << spins[d] << "," << wait[d] << "," << (totalWait ? 100.0 * wait[d] / totalWait : 0.0) << "\n";
+        }
+
+        size_t k = std::min(hot.size(), (size_t)topK);
+        std::partial_sort(hot.begin(), hot.begin() + k, hot.end(), [](const Hot& a, const Hot& b) {
+            return a.waitNs != b.waitNs ? a.waitNs > b.waitNs : a.contended > b.contended;
+        });
+        out << "# top " << k << " contended nodes\n";
+        out << "node,level,contended,spins,wait_ns\n";
+        for (size_t i = 0; i < k; ++i) {
+            out << hot[i].node << "," << (int)level[hot[i].node] << "," << hot[i].contended << ","
+                << hot[i].spins << "," << hot[i].waitNs << "\n";
+        }
+    }
+};
+
+// Registry of the trees, for the exit and signal reports. A tree's stats outlive
+// the tree, so the exit report still covers trees a tool has already dropped,
+// unless they never saw contention.
+struct Profiler {
+    std::mutex mx; // Guards the list.
+    std::vector<std::shared_ptr<Tree>> trees;
+    uint64_t nextId = 1;
+    int topK = 20;
+
+    static Profiler& get() {
+        static Profiler p;
+        return p;
+    }
+
+    // Called from the TreeLocker constructor. Sizes the per-node tables for the tree
+    // and arranges the exit-time report.
+    std::shared_ptr<Tree> addTree(int n, int m) {
+        std::lock_guard<std::mutex> g(mx);
+        static bool registered = false;
+        if (!registered) {
+            registered = true;
+            if (const char* k = std::getenv("TREELOCKER_CONTENTION_TOPK")) topK = std::max(1, std::atoi(k));
+            std::atexit([] { Profiler::get().report(std::cerr); });
+            installSignalDump(SIGUSR2);
+        }
+        // Dropped trees that saw no contention have nothing to report.
+        trees.erase(std::remove_if(trees.begin(), trees.end(),
+                                   [](const std::shared_ptr<Tree>& t) { return t.use_count() == 1 && !t->contended(); }),
+                    trees.end());
+        trees.push_back(std::make_shared<Tree>(nextId++, n, m));
+        return trees.back();
+    }
+
+    void report(std::ostream& out) {
+        std::lock_guard<std::mutex> g(mx);
+        for (size_t i = 0; i < trees.size(); ++i) {
+            if (trees.size() > 1) out << "## tree " << i << ": " << trees[i]->n << " nodes, m=" << trees[i]->m << "\n";
+            trees[i]->report(out, topK);
+        }
+        out.flush();
+    }
+};
+
+// Takes a spinlock (anything with tryLock()/lockCounting()) on behalf of 'node'.
+template <class Spin>
+inline void lockSpin(Tree& p, Spin& lk, int node) {
+    p.acquired(node);
+    if (lk.tryLock()) return;
+    auto start = std::chrono::steady_clock::now();
+    uint64_t spins = 1 + lk.lockCounting();
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    p.waited(node, spins, (uint64_t)ns);
+}
+
+// Takes a node mutex on behalf of 'node' and hands back the owning guard.
+inline std::unique_lock<std::mutex> lockMutex(Tree& p, std::mutex& mx, int node) {
+    p.acquired(node);
+    std::unique_lock<std::mutex> g(mx, std::try_to_lock);
+    if (g.owns_lock()) return g;
+    auto start = std::chrono::steady_clock::now();
+    g.lock();
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    p.waited(node, 0, (uint64_t)ns);
+    return g;
+}
+
+// Dumps the report to stderr whenever 'sig' arrives. The handler only writes a byte
+// to a pipe; a background thread does the (non async-signal-safe) formatting.
+inline void installSignalDump(int sig) {
+    static int fds[2] = {-1, -1};
+    if (fds[0] >= 0 || pipe(fds) != 0) return;
+    std::thread([] {
+        char c;
+        while (read(fds[0], &c, 1) == 1) Profiler::get().report(std::cerr);
+    }).detach();
+    std::signal(sig, [](int) {
+        char c = 1;
+        ssize_t w = write(fds[1], &c, 1);
+        (void)w;
+    });
+}
+
+} // namespace contention
+
+// TL_CONTENTION_MEMBER declares the tree's stats inside the TreeLocker; the lock
+// macros are used from its member functions.
+#if TREELOCKER_CONTENTION
+#define TL_CONTENTION_MEMBER std::shared_ptr<contention::Tree> contentionTree
+#define TL_CONTENTION_INIT(n, m) (contentionTree = contention::Profiler::get().addTree((n), (m)))
+#define TL_SPIN_LOCK(lk, node) contention::lockSpin(*contentionTree, (lk), (node))
+#define TL_MUTEX_LOCK(mx, node) contention::lockMutex(*contentionTree, (mx), (node))
+#else
+#define TL_CONTENTION_MEMBER static_assert(true, "")
+#define TL_CONTENTION_INIT(n, m) ((void)0)
+#define TL_SPIN_LOCK(lk, node) (lk).lock()
+#define TL_MUTEX_LOCK(mx, node) (mx)
+#endif
@@ -0,0 +1,288 @@
+#pragma once
+
+// Always-on flight recorder for the TreeLocker variants.
+// Every lock/unlock/upgrade appends one 24-byte record (start time, latency, op, node,
+// uid, outcome) to a fixed-size ring owned by the calling thread, so the last N
+// operations of every thread are available after an incident. Build with
+// -DTREELOCKER_FLIGHT=0 to compile it out.
+//
+// Recording is two timestamp reads (rdtsc on x86) and one store into thread-owned
+// memory. The rings are dumped to a binary file on SIGUSR1 and on crash signals
+// (SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT); the dump path only uses
+// async-signal-safe calls, so it runs straight from the handler. flightTrace.cpp
+// turns a dump into Chrome trace-event JSON.
+//
+// Environment:
+//   TREELOCKER_FLIGHT_RECORDS  records per thread, rounded up to a power of two (4096)
+//   TREELOCKER_FLIGHT_FILE     dump path prefix; ".<pid>.bin" is appended
+//                              (treelocker-flight)
+
+#ifndef TREELOCKER_FLIGHT
+#define TREELOCKER_FLIGHT 1
+#endif
+
+#include <atomic>
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+namespace flight {
+
+const uint32_t VERSION = 1;
+const int MAX_THREADS = 256; // Live threads past this limit are not recorded.
+
+struct Record {
+    uint64_t start;   // Ticks at operation start.
+    uint32_t latency; // Ticks spent in the operation, saturated at 2^32 - 1.
+    int32_t node;
+    int32_t uid;
+    uint8_t op;       // telemetry::OpKind
+    uint8_t outcome;  // telemetry::Outcome
+    uint16_t reserved;
+};
+static_assert(sizeof(Record) == 24, "flight record layout is part of the dump format");
+
+// Dump file layout: FileHeader, then per thread a ThreadHeader followed by
+// 'count' Records, oldest first.
+struct FileHeader {
+    char magic[8];     // "TLFLIGHT"
+    uint32_t version;
+    uint32_t recordSize;
+    uint64_t baseTicks; // Tick value that maps to baseNs.
+    uint64_t baseNs;    // CLOCK_MONOTONIC when the recorder started.
+    double nsPerTick;
+    uint32_t threads;
+    uint32_t pid;
+};
+
+struct ThreadHeader {
+    uint32_t tid;     // Start order, 0 for the first recording thread.
+    uint32_t count;   // Records that follow.
+    uint64_t dropped; // Older records already overwritten.
+};
+
+inline uint64_t monotonicNs() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+inline uint64_t ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return monotonicNs();
+#endif
+}
+
+// One thread's ring. Only the owner writes; the dumper reads whatever is there,
+// so a record being written during a dump may come out torn.
+struct Ring {
+    uint32_t tid;
+    uint64_t mask;
+    Record* records;
+    std::atomic<uint64_t> head{0}; // Records ever written.
+    std::atomic<bool> idle{false}; // Owner has exited; the next new thread takes it over.
+
+    void push(const Record& r) {
+        uint64_t h = head.load(std::memory_order_relaxed);
+        records[h & mask] = r;
+        head.store(h + 1, std::memory_order_release);
+    }
+};
+
+struct Recorder {
+    std::atomic<Ring*> rings[MAX_THREADS] = {};
+    std::atomic<int> registered{0};    // Rings allocated (may overshoot MAX_THREADS).
+    std::atomic<uint32_t> nextTid{0};
+    uint64_t capacity = 4096;
+    uint64_t baseTicks = 0, baseNs = 0;
+    char prefix[256] = "treelocker-flight";
+
+    static Recorder& get() {
+        static Recorder r;
+        return r;
+    }
+
+    Recorder() {
+        if (const char* s = std::getenv("TREELOCKER_FLIGHT_RECORDS")) {
+            uint64_t want = std::strtoull(s, nullptr, 10);
+            capacity = 1;
+            while (capacity < want) capacity <<= 1;
+        }
+        if (const char* s = std::getenv("TREELOCKER_FLIGHT_FILE")) {
+            strncpy(prefix, s, sizeof(prefix) - 1);
+        }
+        baseTicks = ticks();
+        baseNs = monotonicNs();
+        installHandlers();
+    }
+
+    // A thread's ring keeps its history after the thread exits, until a new thread
+    // takes it over (see release()). New rings are only allocated when none is idle,
+    // so tools that start threads per round use as many rings as they ever run at once.
+    Ring* add() {
+        uint32_t tid = nextTid.fetch_add(1, std::memory_order_relaxed);
+        int n = registered.load(std::memory_order_acquire);
+        for (int i = 0; i < n && i < MAX_THREADS; ++i) {
+            Ring* r = rings[i].load(std::memory_order_acquire);
+            bool wasIdle = true;
+            if (r && r->idle.compare_exchange_strong(wasIdle, false, std::memory_order_acq_rel)) {
+                r->head.store(0, std::memory_order_release);
+                r->tid = tid;
+                return r;
+            }
+        }
+        int slot = registered.fetch_add(1, std::memory_order_acq_rel);
+        if (slot >= MAX_THREADS) return nullptr;
+        Ring* r = new Ring();
+        r->tid = tid;
+        r->mask = capacity - 1;
+        r->records = new Record[capacity]();
+        rings[slot].store(r, std::memory_order_release);
+        return r;
+    }
+
+    // Writes every ring to 'fd'. Async-signal-safe.
+    void dump(int fd) {
+        FileHeader h;
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, "TLFLIGHT", 8);
+        h.version = VERSION;
+        h.recordSize = sizeof(Record);
+        h.baseTicks = baseTicks;
+        h.baseNs = baseNs;
+        uint64_t nowTicks = ticks(), nowNs = monotonicNs();
+        h.nsPerTick = nowTicks > baseTicks ? (double)(nowNs - baseNs) / (double)(nowTicks - baseTicks) : 1.0;
+        int n = registered.load(std::memory_order_acquire);
+        if (n > MAX_THREADS) n = MAX_THREADS;
+        uint32_t present = 0;
+        for (int i = 0; i < n; ++i)
+            if (rings[i].load(std::memory_order_acquire)) ++present;
+        h.threads = present;
+        h.pid = (uint32_t)getpid();
+        writeAll(fd, &h, sizeof(h));
+
+        for (int i = 0; i < n; ++i) {
+            Ring* r = rings[i].load(std::memory_order_acquire);
+            if (!r) continue;
+            uint64_t head = r->head.load(std::memory_order_acquire);
+            uint64_t count = head < capacity ? head : capacity;
+            ThreadHeader t{r->tid, (uint32_t)count, head - count};
+            writeAll(fd, &t, sizeof(t));
+            // Oldest record first; at most two contiguous pieces of the ring.
+            uint64_t first = (head - count) & r->mask;
+            uint64_t tail = count < capacity - first ? count : capacity - first;
+            writeAll(fd, r->records + first, tail * sizeof(Record));
+            writeAll(fd, r->records, (count - tail) * sizeof(Record));
+        }
+    }
+
+    // Dumps to "<prefix>.<pid>.bin". Async-signal-safe; returns false if the file
+    // could not be opened.
+    bool dumpToFile() {
+        char path[320];
+        size_t len = strnlen(prefix, sizeof(prefix));
+        memcpy(path, prefix, len);
+        path[len++] = '.';
+        char digits[16];
+        int d = 0;
+        for (unsigned pid = (unsigned)getpid(); pid || d == 0; pid /= 10) digits[d++] = (char)('0' + pid % 10);
+        while (d) path[len++] = digits[--d];
+        memcpy(path + len, ".bin", 5);
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) return false;
+        dump(fd);
+        close(fd);
+        return true;
+    }
+
+    static void writeAll(int fd, const void* p, size_t len) {
+        const char* c = (const char*)p;
+        while (len > 0) {
+            ssize_t w = write(fd, c, len);
+            if (w <= 0) return;
+            c += w;
+            len -= (size_t)w;
+        }
+    }
+
+    static void onDumpSignal(int) {
+        int saved = errno;
+        get().dumpToFile();
+        errno = saved;
+    }
+
+    // The crash handler is one-shot (SA_RESETHAND): it dumps, then re-raises so the
+    // process still dies with the original signal and core dump behaviour.
+    static void onCrashSignal(int sig) {
+        get().dumpToFile();
+        raise(sig);
+    }
+
+    static void installHandlers() {
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sigemptyset(&sa.sa_mask);
+        sa.sa_flags = SA_RESTART;
+        sa.sa_handler = onDumpSignal;
+        sigaction(SIGUSR1, &sa, nullptr);
+        sa.sa_flags = SA_RESETHAND | SA_NODEFER;
+        sa.sa_handler = onCrashSignal;
+        for (int sig : {SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT}) sigaction(sig, &sa, nullptr);
+    }
+};
+
+// Holds the calling thread's ring and hands it back when the thread exits.
+struct Lease {
+    Ring* ring = Recorder::get().add();
+    ~Lease() {
+        if (ring) ring->idle.store(true, std::memory_order_release);
+    }
+};
+
+inline Ring* local() {
+    thread_local Lease lease;
+    return lease.ring;
+}
+
+// Records one operation when it goes out of scope.
+struct Scope {
+    Ring* ring;
+    int32_t node, uid;
+    uint8_t op;
+    int outcome = 0;
+    uint64_t start;
+
+    Scope(int kind, int v, int u) : ring(local()), node(v), uid(u), op((uint8_t)kind), start(ticks()) {}
+
+    ~Scope() {
+        if (!ring) return;
+        uint64_t d = ticks() - start;
+        ring->push(Record{start, d > 0xffffffffull ? 0xffffffffu : (uint32_t)d, node, uid, op, (uint8_t)outcome, 0});
+    }
+};
+
+} // namespace flight
+
+#if TREELOCKER_FLIGHT
+namespace flight {
+// Sets the recorder up, handlers included, during static initialisation, so a
+// SIGUSR1 that arrives before the first op writes a dump instead of killing the process.
+inline const bool started = (Recorder::get(), true);
+} // namespace flight
+
+#define TL_FLIGHT_SCOPE(kind, v, uid) flight::Scope tlFlightScope_((kind), (v), (uid))
+#define TL_FLIGHT_SET(o) (tlFlightScope_.outcome = (o))
+#else
+#define TL_FLIGHT_SCOPE(kind, v, uid) ((void)0)
+#define TL_FLIGHT_SET(o) ((void)0)
+#endif
@@ -0,0 +1,71 @@
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "telemetry.h" // Op and outcome names; also pulls in flightRecorder.h.
+
+using namespace std;
+
+// Converts a flight recorder dump into Chrome trace-event JSON, one track per
+// recording thread, viewable in chrome://tracing or https://ui.perfetto.dev:
+//   kill -USR1 <pid>                         # or let it crash
+//   ./flightTrace treelocker-flight.<pid>.bin > trace.json
+int main(int argc, char** argv) {
+    if (argc != 2) {
+        cerr << "usage: " << argv[0] << " DUMP.bin > trace.json\n";
+        return 1;
+    }
+    ifstream in(argv[1], ios::binary);
+    if (!in) {
+        cerr << "cannot open " << argv[1] << "\n";
+        return 1;
+    }
+
+    flight::FileHeader h;
+    if (!in.read((char*)&h, sizeof(h)) || memcmp(h.magic, "TLFLIGHT", 8) != 0) {
+        cerr << argv[1] << ": not a flight recorder dump\n";
+        return 1;
+    }
+    if (h.version != flight::VERSION || h.recordSize != sizeof(flight::Record)) {
+        cerr << argv[1] << ": unsupported dump version " << h.version << "\n";
+        return 1;
+    }
+
+    ios::sync_with_stdio(false);
+    cout << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n";
+    cout << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" << h.pid
+         << ",\"tid\":0,\"args\":{\"name\":\"treelocker " << h.pid << "\"}}";
+
+    char buf[512];
+    for (uint32_t t = 0; t < h.threads; ++t) {
+        flight::ThreadHeader th;
+        if (!in.read((char*)&th, sizeof(th))) {
+            cerr << argv[1] << ": truncated at thread " << t << "\n";
+            break;
+        }
+        vector<flight::Record> recs(th.count);
+        if (!in.read((char*)recs.data(), (streamsize)(recs.size() * sizeof(flight::Record)))) {
+            cerr << argv[1] << ": truncated records for thread " << th.tid << "\n";
+            break;
+        }
+        cout << ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << h.pid << ",\"tid\":" << th.tid
+             << ",\"args\":{\"name\":\"thread " << th.tid << " (" << th.dropped << " older ops dropped)\"}}";
+        for (const flight::Record& r : recs) {
+            if (r.op >= telemetry::OP_KINDS || r.outcome >= telemetry::OUTCOMES) continue; // Torn record.
+            // Trace timestamps are microseconds on the CLOCK_MONOTONIC timeline.
+            double tsUs = ((double)h.baseNs + ((double)r.start - (double)h.baseTicks) * h.nsPerTick) / 1000.0;
+            double durUs = r.latency * h.nsPerTick / 1000.0;
+            snprintf(buf, sizeof(buf),
+                     ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%u,\"tid\":%u,"
+                     "\"args\":{\"node\":%d,\"uid\":%d,\"result\":\"%s\"}}",
+                     telemetry::opName(r.op), r.outcome == telemetry::OK ? "ok" : "failed", tsUs, durUs, h.pid,
+                     th.tid, r.node, r.uid, telemetry::outcomeName(r.outcome));
+            cout << buf;
+        }
+    }
+    cout << "\n]}\n";
+    return 0;
+}
@@ -0,0 +1,205 @@
+#pragma once
+
+// Minimal io_uring ring on the raw system calls (no liburing dependency).
+//
+// Covers what the lock server and the write-ahead log need: one ring per
+// thread, SQEs handed out zeroed and submitted in batches, CQEs drained in
+// place, and a pool of kernel-provided buffers for multishot receives. Ring::init() fails cleanly (ENOSYS, EPERM under seccomp, a kernel
+// without the requested features, io_uring_disabled) and callers then fall
+// back to their epoll/read/write paths.
+
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace uring {
+
+inline int sysSetup(unsigned entries, io_uring_params* p) { return (int)syscall(__NR_io_uring_setup, entries, p); }
+
+inline int sysEnter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, nullptr, 0);
+}
+
+class Ring {
+public:
+    Ring() = default;
+    Ring(const Ring&) = delete;
+    Ring& operator=(const Ring&) = delete;
+    ~Ring() { destroy(); }
+
+    // Sets up a ring for one owning thread, which must be the thread calling
+    // init(): with SINGLE_ISSUER the kernel rejects submissions from any other.
+    // Returns false if io_uring is not usable here; the object can then simply be dropped.
+    bool init(unsigned entries) {
+        io_uring_params p;
+        memset(&p, 0, sizeof(p));
+        // Completions are only reaped by the owner, so the kernel may defer task work to it.
+        p.flags = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+        fd = sysSetup(entries, &p);
+        if (fd < 0) {
+            memset(&p, 0, sizeof(p)); // Older kernels: plain ring.
+            fd = sysSetup(entries, &p);
+        }
+        if (fd < 0 || !(p.features & IORING_FEAT_NODROP)) return fail();
+
+        sqBytes = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+        cqBytes = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        bool single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if (single && cqBytes > sqBytes) sqBytes = cqBytes;
+        sqMap = mmap(nullptr, sqBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        if (sqMap == MAP_FAILED) return fail();
+        cqMap = single ? sqMap
+                       : mmap(nullptr, cqBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (cqMap == MAP_FAILED) return fail();
+        sqesBytes = p.sq_entries * sizeof(io_uring_sqe);
+        sqes = (io_uring_sqe*)mmap(nullptr, sqesBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                                   IORING_OFF_SQES);
+        if (sqes == MAP_FAILED) return fail();
+
+        char* sq = (char*)sqMap;
+        sqHead = (unsigned*)(sq + p.sq_off.head);
+        sqTail = (unsigned*)(sq + p.sq_off.tail);
+        sqMask = *(unsigned*)(sq + p.sq_off.ring_mask);
+        sqEntries = p.sq_entries;
+        unsigned* array = (unsigned*)(sq + p.sq_off.array);
+        for (unsigned i = 0; i < sqEntries; ++i) array[i] = i; // Identity: SQE i sits in slot i.
+        char* cq = (char*)cqMap;
+        cqHead = (unsigned*)(cq + p.cq_off.head);
+        cqTail = (unsigned*)(cq + p.cq_off.tail);
+        cqMask = *(unsigned*)(cq + p.cq_off.ring_mask);
+        cqes = (io_uring_cqe*)(cq + p.cq_off.cqes);
+        localTail = *sqTail;
+        skipCompletions = (p.features & IORING_FEAT_CQE_SKIP) != 0;
+        return true;
+    }
+
+    bool ok() const { return fd >= 0; }
+
+    // A zeroed SQE to fill in, submitting queued ones first if the queue is full.
+    io_uring_sqe* sqe() {
+        if (localTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries) submit(0);
+        io_uring_sqe* s = &sqes[localTail & sqMask];
+        memset(s, 0, sizeof(*s));
+        ++localTail;
+        return s;
+    }
+
+    // Submits everything queued and, with 'waitFor' > 0, waits until that many
+    // completions are ready. One system call either way.
+    int submit(unsigned waitFor) {
+        unsigned pending = localTail - *sqTail;
+        __atomic_store_n(sqTail, localTail, __ATOMIC_RELEASE);
+        ++enters;
+        int r;
+        do {
+            r = sysEnter(fd, pending, waitFor, waitFor > 0 ? IORING_ENTER_GETEVENTS : 0);
+        } while (r < 0 && errno == EINTR);
+        return r;
+    }
+
+    // Calls f(cqe) for every ready completion and releases them. Returns how
+    // many were passed to f.
+    template <class F>
+    unsigned drain(F f) {
+        unsigned head = *cqHead, tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE), seen = 0;
+        for (; head != tail; ++head) {
+            const io_uring_cqe& c = cqes[head & cqMask];
+            if (c.user_data == INTERNAL) continue;
+            f(c);
+            ++seen;
+        }
+        __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+        return seen;
+    }
+
+    // Hands 'count' buffers of 'size' bytes to the kernel as provided-buffer
+    // group 'group', for receives with IOSQE_BUFFER_SELECT. Uses
+    // IORING_OP_PROVIDE_BUFFERS, which every kernel with buffer selection has
+    // (registered buffer rings are not reliable everywhere yet). Call it right
+    // after init().
+    bool provideBuffers(uint16_t group, unsigned count, unsigned size) {
+        bufData = new char[(size_t)count * size];
+        bufSize = size;
+        bufGroup = group;
+        io_uring_sqe* s = sqe();
+        s->opcode = IORING_OP_PROVIDE_BUFFERS;
+        s->fd = (int)count;
+        s->addr = (uint64_t)(uintptr_t)bufData;
+        s->len = size;
+        s->buf_group = group;
+        s->user_data = INTERNAL;
+        if (submit(1) < 0) return false;
+        unsigned head = *cqHead; // Called on a fresh ring: this is the only completion.
+        if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) return false;
+        int result = cqes[head & cqMask].res;
+        __atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+        return result >= 0;
+    }
+
+    char* buffer(uint16_t bid) const { return bufData + (size_t)bid * bufSize; }
+
+    // Hands buffer 'bid' back to the kernel once its data has been consumed. The
+    // SQE goes out with the next submit(); its completion is not reported, and
+    // where the kernel allows it not even posted.
+    void recycle(uint16_t bid) {
+        io_uring_sqe* s = sqe();
+        s->opcode = IORING_OP_PROVIDE_BUFFERS;
+        s->fd = 1;
+        s->addr = (uint64_t)(uintptr_t)buffer(bid);
+        s->len = bufSize;
+        s->off = bid;
+        s->buf_group = bufGroup;
+        s->user_data = INTERNAL;
+        if (skipCompletions) s->flags = IOSQE_CQE_SKIP_SUCCESS;
+    }
+
+    uint64_t systemCalls() const { return enters; }
+
+    static const uint64_t INTERNAL = ~0ull; // user_data of the ring's own requests.
+
+private:
+    int fd = -1;
+    void *sqMap = nullptr, *cqMap = nullptr;
+    size_t sqBytes = 0, cqBytes = 0, sqesBytes = 0;
+    io_uring_sqe* sqes = nullptr;
+    io_uring_cqe* cqes = nullptr;
+    unsigned *sqHead = nullptr, *sqTail = nullptr, *cqHead = nullptr, *cqTail = nullptr;
+    unsigned sqMask = 0, sqEntries = 0, cqMask = 0, localTail = 0;
+    char* bufData = nullptr;
+    unsigned bufSize = 0;
+    uint16_t bufGroup = 0;
+    bool skipCompletions = false;
+    uint64_t enters = 0;
+
+    bool fail() {
+        destroy();
+        return false;
+    }
+
+    void destroy() {
+        if (sqes && sqes != MAP_FAILED) munmap(sqes, sqesBytes);
+        if (cqMap && cqMap != MAP_FAILED && cqMap != sqMap) munmap(cqMap, cqBytes);
+        if (sqMap && sqMap != MAP_FAILED) munmap(sqMap, sqBytes);
+        delete[] bufData;
+        if (fd >= 0) close(fd);
+        sqes = nullptr;
+        sqMap = cqMap = nullptr;
+        bufData = nullptr;
+        fd = -1;
+    }
+};
+
+// Whether this process can use io_uring at all (probed once).
+inline bool available() {
+    static bool usable = [] {
+        Ring r;
+        return r.init(2);
+    }();
+    return usable;
+}
+
+} // namespace uring
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+
+// Log-linear latency histogram (HdrHistogram-style bucketing).
+// Values below 2^SUB_BITS get one bucket each; above that every power of two is
+// split into 2^(SUB_BITS-1) equal sub-buckets, so the relative error of any
+// reported value is bounded by 2^-(SUB_BITS-1) (under 1% with SUB_BITS = 8).
+// Recording is a couple of shifts and one increment, cheap enough for every op.
+struct LatencyHistogram {
+    static const int SUB_BITS = 8;
+    static const uint64_t SUB_COUNT = 1ULL << SUB_BITS;     // 256 exact buckets for small values.
+    static const uint64_t HALF_COUNT = SUB_COUNT / 2;       // 128 sub-buckets per power of two after that.
+    static const int BUCKETS = (int)(SUB_COUNT + (64 - SUB_BITS) * HALF_COUNT);
+
+    std::vector<uint64_t> counts;
+    uint64_t total = 0;
+    uint64_t minValue = UINT64_MAX;
+    uint64_t maxValue = 0;
+    long double sum = 0;
+
+    LatencyHistogram() : counts(BUCKETS, 0) {}
+
+    // Maps a value to its bucket index.
+    static int indexOf(uint64_t v) {
+        if (v < SUB_COUNT) return (int)v;
+        int msb = 63 - __builtin_clzll(v);
+        int shift = msb - SUB_BITS + 1;              // >= 1 because v >= SUB_COUNT.
+        uint64_t sub = v >> shift;                   // In [HALF_COUNT, SUB_COUNT).
+        return (int)(SUB_COUNT + (uint64_t)(shift - 1) * HALF_COUNT + (sub - HALF_COUNT));
+    }
+
+    // Smallest value that lands in bucket 'idx'.
+    static uint64_t lowerBound(int idx) {
+        if ((uint64_t)idx < SUB_COUNT) return (uint64_t)idx;
+        uint64_t rel = (uint64_t)idx - SUB_COUNT;
+        int shift = (int)(rel / HALF_COUNT) + 1;
+        uint64_t sub = rel % HALF_COUNT + HALF_COUNT;
+        return sub << shift;
+    }
+
+    // Largest value that lands in bucket 'idx'.
+    static uint64_t upperBound(int idx) {
+        if (idx + 1 >= BUCKETS) return UINT64_MAX;
+        return lowerBound(idx + 1) - 1;
+    }
+
+    void record(uint64_t v) { recordN(v, 1); }
+
+    // Records 'n' samples of value 'v' at once.
+    void recordN(uint64_t v, uint64_t n) {
+        if (n == 0) return;
+        counts[indexOf(v)] += n;
+        total += n;
+        sum += (long double)v * n;
+        if (v < minValue) minValue = v;
+        if (v > maxValue) maxValue = v;
+    }
+
+    // Folds another histogram into this one (e.g. per-thread histograms after a run).
+    void merge(const LatencyHistogram& o) {
+        for (int i = 0; i < BUCKETS; ++i) counts[i] += o.counts[i];
+        total += o.total;
+        sum += o.sum;
+        minValue = std::min(minValue, o.minValue);
+        maxValue = std::max(maxValue, o.maxValue);
+    }
+
+    void reset() {
+        std::fill(counts.begin(), counts.end(), 0);
+        total = 0;
+        sum = 0;
+        minValue = UINT64_MAX;
+        maxValue = 0;
+    }
+
+    // Value at quantile 'q' in [0, 1]. Reports the bucket's upper bound, clamped to the
+    // observed maximum, so percentiles never understate the real latency.
+    uint64_t percentile(double q) const {
+        if (total == 0) return 0;
+        uint64_t rank = (uint64_t)(q * (double)total + 0.5);
+        if (rank < 1) rank = 1;
+        if (rank > total) rank = total;
+        uint64_t seen = 0;
+        for (int i = 0; i < BUCKETS; ++i) {
+            seen += counts[i];
+            if (seen >= rank) return std::min(upperBound(i), maxValue);
+        }
+        return maxValue;
+    }
+
+    double mean() const { return total ? (double)(sum / total) : 0.0; }
+    uint64_t min() const { return total ? minValue : 0; }
+    uint64_t max() const { return maxValue; }
+};
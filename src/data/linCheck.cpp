@@ -0,0 +1,276 @@
+#include <iostream>
+#include <vector>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <random>
+#include <unordered_set>
+#include <algorithm>
+
+#include "variants.h"
+
+using namespace std;
+
+// Differential linearizability checker for the TreeLocker variants.
+// Each round runs a small random script of lock/unlock/upgrade ops from several
+// threads at once against a fresh tree, stamping every call with invocation and
+// response times from one shared atomic clock. The resulting history must be
+// explainable by some serial order that respects real time, where "serial" means
+// the single-lock mulSongs TreeLocker. The search is Wing & Gong's algorithm with
+// Lowe's memoization of (linearized set, model state).
+//
+// A history with no valid order fails the gate (exit status 1). The checker then
+// shrinks the script, dropping ops and re-running each candidate until it
+// reproduces, and prints the smallest non-linearizable history it actually observed:
+//   ./linCheck --variant all --rounds 5000 --threads 4 --ops 6
+
+struct ScriptOp {
+    int op, node, uid;
+};
+
+struct Call {
+    int thread;
+    ScriptOp s;
+    uint64_t inv, resp;
+    bool result;
+};
+
+typedef vector<vector<ScriptOp>> Script; // One op list per thread.
+
+// Threads that persist across rounds, so every round starts its threads together
+// without paying for thread creation.
+class Pool {
+public:
+    explicit Pool(int threads) : n(threads) {
+        for (int t = 0; t < n; ++t) workers.emplace_back([this, t] { loop(t); });
+    }
+
+    ~Pool() {
+        {
+            lock_guard<mutex> g(mx);
+            stopping = true;
+            ++generation;
+        }
+        cv.notify_all();
+        for (auto& w : workers) w.join();
+    }
+
+    // Runs job(t) on every thread and waits for all of them.
+    void run(const function<void(int)>& f) {
+        unique_lock<mutex> g(mx);
+        job = f;
+        pending = n;
+        ++generation;
+        cv.notify_all();
+        doneCv.wait(g, [this] { return pending == 0; });
+    }
+
+private:
+    int n;
+    vector<thread> workers;
+    mutex mx;
+    condition_variable cv, doneCv;
+    function<void(int)> job;
+    uint64_t generation = 0;
+    int pending = 0;
+    bool stopping = false;
+
+    void loop(int t) {
+        uint64_t seen = 0;
+        while (true) {
+            function<void(int)> f;
+            {
+                unique_lock<mutex> g(mx);
+                cv.wait(g, [&] { return generation != seen; });
+                seen = generation;
+                if (stopping) return;
+                f = job;
+            }
+            f(t);
+            lock_guard<mutex> g(mx);
+            if (--pending == 0) doneCv.notify_one();
+        }
+    }
+};
+
+// Runs one script against a fresh instance of the variant and returns its history.
+vector<Call> runScript(const string& variant, int n, int m, const Script& script, Pool& pool) {
+    int threads = (int)script.size();
+    vector<vector<Call>> perThread(threads);
+    atomic<uint64_t> clock{0};
+    atomic<int> ready{0};
+    withVariant(variant, n, m, [&](auto& tl) {
+        pool.run([&](int t) {
+            // Spin until every thread is here so the ops really overlap.
+            ready.fetch_add(1);
+            while (ready.load() < threads) this_thread::yield();
+            for (const ScriptOp& s : script[t]) {
+                Call c;
+                c.thread = t;
+                c.s = s;
+                c.inv = clock.fetch_add(1);
+                c.result = applyOp(tl, s.op, s.node, s.uid);
+                c.resp = clock.fetch_add(1);
+                perThread[t].push_back(c);
+            }
+        });
+    });
+    vector<Call> history;
+    for (auto& v : perThread) history.insert(history.end(), v.begin(), v.end());
+    return history;
+}
+
+class Checker {
+public:
+    Checker(const vector<Call>& h, int n, int m) : calls(h), n(n), m(m) {}
+
+    bool linearizable() {
+        if (calls.size() > 64) return false; // Keep the bitmask search bounded.
+        mul_songs::TreeLocker model(n, m);
+        return search(0, model);
+    }
+
+private:
+    const vector<Call>& calls;
+    int n, m;
+    unordered_set<string> seen; // Configurations already shown to be dead ends.
+
+    bool search(uint64_t done, mul_songs::TreeLocker& model) {
+        uint64_t all = calls.size() == 64 ? ~0ull : (1ull << calls.size()) - 1;
+        if (done == all) return true;
+        string key((const char*)&done, sizeof(done));
+        key.append((const char*)model.lockedBy.data(), model.lockedBy.size() * sizeof(int));
+        if (seen.count(key)) return false;
+
+        // Only calls invoked before the earliest pending response can go next.
+        uint64_t minResp = ~0ull;
+        for (size_t i = 0; i < calls.size(); ++i)
+            if (!(done >> i & 1)) minResp = min(minResp, calls[i].resp);
+        for (size_t i = 0; i < calls.size(); ++i) {
+            if (done >> i & 1 || calls[i].inv > minResp) continue;
+            mul_songs::TreeLocker next = model;
+            if (applyOp(next, calls[i].s.op, calls[i].s.node, calls[i].s.uid) != calls[i].result) continue;
+            if (search(done | 1ull << i, next)) return true;
+        }
+        seen.insert(key);
+        return false;
+    }
+};
+
+Script randomScript(mt19937_64& rng, int threads, int ops, int n, int uids) {
+    Script s(threads);
+    for (int t = 0; t < threads; ++t) {
+        for (int i = 0; i < ops; ++i) {
+            int r = (int)(rng() % 100);
+            int op = r < 45 ? 1 : r < 75 ? 2 : 3;
+            s[t].push_back(ScriptOp{op, (int)(rng() % n), 1 + (int)(rng() % uids)});
+        }
+    }
+    return s;
+}
+
+// Re-runs a script until it yields a non-linearizable history (returned in 'bad').
+bool reproduces(const string& variant, int n, int m, const Script& s, Pool& pool, int attempts, vector<Call>& bad) {
+    for (int a = 0; a < attempts; ++a) {
+        vector<Call> h = runScript(variant, n, m, s, pool);
+        if (!Checker(h, n, m).linearizable()) {
+            bad = h;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Greedily drops single ops while the failure still reproduces.
+vector<Call> shrink(const string& variant, int n, int m, Script s, vector<Call> bad, Pool& pool, int attempts) {
+    bool progress = true;
+    while (progress) {
+        progress = false;
+        for (size_t t = 0; t < s.size(); ++t) {
+            for (size_t i = 0; i < s[t].size(); ++i) {
+                Script candidate = s;
+                candidate[t].erase(candidate[t].begin() + i);
+                vector<Call> h;
+                if (reproduces(variant, n, m, candidate, pool, attempts, h)) {
+                    s = candidate;
+                    bad = h;
+                    progress = true;
+                    --i;
+                }
+            }
+        }
+    }
+    return bad;
+}
+
+void printHistory(ostream& out, vector<Call> h) {
+    static const char* ops[] = {"", "lock", "unlock", "upgrade"};
+    sort(h.begin(), h.end(), [](const Call& a, const Call& b) { return a.inv < b.inv; });
+    out << "thread,invoke,respond,op,node,uid,result\n";
+    for (const Call& c : h) {
+        out << c.thread << "," << c.inv << "," << c.resp << "," << ops[c.s.op] << "," << c.s.node << ","
+            << c.s.uid << "," << (c.result ? "true" : "false") << "\n";
+    }
+}
+
+int main(int argc, char** argv) {
+    string variant = "all";
+    int rounds = 2000, threads = 4, ops = 5, n = 15, m = 2, uids = 2, attempts = 200;
+    uint64_t seed = 1;
+    for (int i = 1; i < argc; ++i) {
+        string key = argv[i];
+        if (i + 1 >= argc) {
+            cerr << "missing value for " << key << "\n";
+            return 2;
+        }
+        string val = argv[++i];
+        if (key == "--variant") variant = val;
+        else if (key == "--rounds") rounds = stoi(val);
+        else if (key == "--threads") threads = max(1, stoi(val));
+        else if (key == "--ops") ops = max(1, stoi(val));
+        else if (key == "--n") n = max(1, stoi(val));
+        else if (key == "--m") m = max(1, stoi(val));
+        else if (key == "--uids") uids = max(1, stoi(val));
+        else if (key == "--seed") seed = stoull(val);
+        else if (key == "--shrink-attempts") attempts = max(1, stoi(val));
+        else {
+            cerr << "usage: " << argv[0] << " [--variant NAME|all] [--rounds R] [--threads T] [--ops K]\n"
+                 << "  [--n N] [--m M] [--uids U] [--seed S] [--shrink-attempts A]\n";
+            return 2;
+        }
+    }
+    if ((long long)threads * ops > 64) {
+        cerr << "threads * ops must be at most 64\n";
+        return 2;
+    }
+
+    vector<string> names = variant == "all" ? variantNames() : vector<string>{variant};
+    for (const string& name : names) {
+        if (!withVariant(name, 1, 1, [](auto&) {})) {
+            cerr << "unknown variant " << name << "\n";
+            return 2;
+        }
+    }
+
+    Pool pool(threads);
+    bool ok = true;
+    for (const string& name : names) {
+        mt19937_64 rng(seed);
+        int failed = -1;
+        for (int r = 0; r < rounds && failed < 0; ++r) {
+            Script s = randomScript(rng, threads, ops, n, uids);
+            vector<Call> h = runScript(name, n, m, s, pool);
+            if (Checker(h, n, m).linearizable()) continue;
+            failed = r;
+            vector<Call> minimal = shrink(name, n, m, s, h, pool, attempts);
+            cout << name << ": history " << r << " is not linearizable; minimized to " << minimal.size() << " ops\n";
+            printHistory(cout, minimal);
+        }
+        if (failed < 0) cout << name << ": " << rounds << " histories linearizable\n";
+        ok = ok && failed < 0;
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,209 @@
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+
+#include "workload.h"
+#include "latencyHistogram.h"
+#include "variants.h"
+#include "captureLog.h"
+
+using namespace std;
+
+// Open-loop load driver for the TreeLocker variants.
+// Each thread owns a fixed schedule of intended send times (evenly spaced at the
+// thread's share of the offered rate) and measures every op from its *intended*
+// time, not from when it actually got issued. A slow op therefore shows up as
+// queueing delay on the ops behind it instead of silently lowering the offered load
+// (coordinated omission). Ops still unsent when a step's grace period runs out are
+// recorded with the delay they had accumulated by then.
+//
+// Without --rates the driver sweeps the offered load geometrically until the variant
+// saturates (achieved < 95% of offered) and reports the SLO verdict per step:
+//   ./loadDriver --variant Song_M --threads 4 --start-rate 250000 --slo-rate 2000000 --slo-p999-ns 50000
+//
+// The SLO verdict is taken at exactly --slo-rate; a sweep inserts that rate as
+// one of its steps.
+//
+// --capture PATH logs every issued op with its issue time and thread for ./replay,
+// one log per step since every step runs on a fresh tree: PATH itself for a single
+// --rates entry, otherwise PATH.0, PATH.1, ... The op is logged after its latency
+// has been taken, so capturing does not show up in the measured latencies.
+
+typedef chrono::steady_clock Clock;
+
+struct StepResult {
+    double offered;
+    double achieved;
+    long long issued;
+    long long dropped; // Ops whose intended time passed but that never got issued.
+    LatencyHistogram hist;
+};
+
+template <class TL>
+StepResult runStep(TL& tl, const vector<vector<WorkloadOp>>& perThread, double rate, double seconds,
+                   capture::Writer* captureLog) {
+    int threads = (int)perThread.size();
+    double perThreadRate = rate / threads;
+    long long perThreadOps = (long long)(perThreadRate * seconds);
+    chrono::nanoseconds interval((long long)(1e9 / perThreadRate));
+    vector<LatencyHistogram> hist(threads);
+    vector<long long> issued(threads, 0), dropped(threads, 0);
+
+    Clock::time_point start = Clock::now() + chrono::milliseconds(10);
+    // Ops past this point are not issued any more; their delay so far is still recorded.
+    Clock::time_point hardStop = start + chrono::duration_cast<Clock::duration>(chrono::duration<double>(seconds * 2 + 0.5));
+
+    auto worker = [&](int t) {
+        const vector<WorkloadOp>& ops = perThread[t];
+        LatencyHistogram& h = hist[t];
+        // Stagger threads so their schedules interleave instead of firing in bursts.
+        Clock::time_point intended = start + interval * t / threads;
+        long long i = 0;
+        for (; i < perThreadOps; ++i, intended += interval) {
+            Clock::time_point now = Clock::now();
+            while (now < intended) now = Clock::now();
+            if (now > hardStop) break;
+            const WorkloadOp& o = ops[i % ops.size()];
+            applyOp(tl, o.op, o.node, o.uid);
+            Clock::time_point done = Clock::now();
+            h.record((uint64_t)chrono::duration_cast<chrono::nanoseconds>(done - intended).count());
+            if (captureLog) captureLog->append(o.op, o.node, o.uid, now);
+        }
+        issued[t] = i;
+        Clock::time_point cut = Clock::now();
+        for (; i < perThreadOps; ++i, intended += interval) {
+            if (intended > cut) break;
+            h.record((uint64_t)chrono::duration_cast<chrono::nanoseconds>(cut - intended).count());
+            ++dropped[t];
+        }
+    };
+
+    vector<thread> pool;
+    for (int t = 0; t < threads; ++t) pool.emplace_back(worker, t);
+    for (auto& th : pool) th.join();
+    Clock::time_point end = Clock::now();
+
+    StepResult r;
+    r.offered = rate;
+    r.issued = 0;
+    r.dropped = 0;
+    for (int t = 0; t < threads; ++t) {
+        r.hist.merge(hist[t]);
+        r.issued += issued[t];
+        r.dropped += dropped[t];
+    }
+    double elapsed = chrono::duration<double>(end - start).count();
+    r.achieved = elapsed > 0 ? r.issued / elapsed : 0;
+    return r;
+}
+
+vector<double> parseRates(const string& s) {
+    vector<double> out;
+    stringstream ss(s);
+    string item;
+    while (getline(ss, item, ',')) if (!item.empty()) out.push_back(stod(item));
+    return out;
+}
+
+int main(int argc, char** argv) {
+    WorkloadConfig cfg;
+    cfg.q = 200000; // Ops per thread schedule; reused cyclically when a step needs more.
+    string variant = "Song_M";
+    int threads = 1;
+    double seconds = 2.0;
+    vector<double> rates;
+    double startRate = 100000, factor = 1.5;
+    int maxSteps = 20;
+    double sloRate = 2000000;
+    uint64_t sloP999 = 50000;
+    string capturePath;
+
+    for (int i = 1; i < argc; ++i) {
+        string key = argv[i];
+        if (i + 1 >= argc) {
+            cerr << "missing value for " << key << "\n";
+            return 1;
+        }
+        string val = argv[++i];
+        if (key == "--variant") variant = val;
+        else if (key == "--threads") threads = max(1, stoi(val));
+        else if (key == "--duration") seconds = stod(val);
+        else if (key == "--rates") rates = parseRates(val);
+        else if (key == "--start-rate") startRate = stod(val);
+        else if (key == "--factor") factor = stod(val);
+        else if (key == "--max-steps") maxSteps = stoi(val);
+        else if (key == "--slo-rate") sloRate = stod(val);
+        else if (key == "--slo-p999-ns") sloP999 = stoull(val);
+        else if (key == "--capture") capturePath = val;
+        else if (!parseWorkloadFlag(cfg, key, val)) {
+            cerr << "usage: " << argv[0] << " [--variant Song_S|Song_M|mulSongs] [--threads T] [--duration S]\n"
+                 << "  [--rates R1,R2,... | --start-rate R --factor F --max-steps K]\n"
+                 << "  [--slo-rate R --slo-p999-ns NS] [--capture PATH]\n" << workloadFlagsUsage();
+            return 1;
+        }
+    }
+
+    // Independent op streams per thread so threads do not replay each other's ops.
+    vector<vector<WorkloadOp>> perThread(threads);
+    for (int t = 0; t < threads; ++t) {
+        WorkloadConfig c = cfg;
+        c.seed = cfg.seed + t;
+        WorkloadGenerator gen(c);
+        perThread[t] = gen.generate();
+    }
+
+    bool sweep = rates.empty();
+    if (sweep) rates.push_back(startRate);
+    bool onePath = !sweep && rates.size() == 1;
+    capture::Writer captureLog;
+
+    cout << "variant,threads,offered_ops_per_sec,achieved_ops_per_sec,issued,dropped,p50_ns,p99_ns,p999_ns,max_ns,slo\n";
+    bool sloChecked = false, sloMet = false;
+    for (size_t step = 0; step < rates.size(); ++step) {
+        double rate = rates[step];
+        string stepPath = onePath ? capturePath : capturePath + "." + to_string(step);
+        if (!capturePath.empty() && !captureLog.open(stepPath, cfg.n, cfg.m)) {
+            cerr << "cannot open capture log " << stepPath << "\n";
+            return 1;
+        }
+        StepResult r;
+        bool known = withVariant(variant, cfg.n, cfg.m, [&](auto& tl) { r = runStep(tl, perThread, rate, seconds, captureLog.isOpen() ? &captureLog : nullptr); });
+        captureLog.close();
+        if (!known) {
+            cerr << "unknown variant " << variant << "\n";
+            return 1;
+        }
+        uint64_t p999 = r.hist.percentile(0.999);
+        bool saturated = r.achieved < 0.95 * rate || r.dropped > 0;
+        const char* slo = "-";
+        if (rate >= sloRate) {
+            slo = (p999 <= sloP999 && !saturated) ? "pass" : "fail";
+            if (rate == sloRate) {
+                sloChecked = true;
+                sloMet = slo[0] == 'p';
+            }
+        }
+        cout << variant << "," << threads << "," << rate << "," << r.achieved << "," << r.issued << ","
+             << r.dropped << "," << r.hist.percentile(0.50) << "," << r.hist.percentile(0.99) << ","
+             << p999 << "," << r.hist.max() << "," << slo << "\n";
+        cout.flush();
+        if (sweep && !saturated && (int)rates.size() < maxSteps && rate >= startRate)
+            rates.push_back(rate < sloRate && rate * factor > sloRate ? sloRate : rate * factor);
+        // A sweep that started above the SLO rate never steps onto it: one extra step there.
+        if (sweep && step + 1 == rates.size() && !sloChecked && startRate > sloRate) rates.push_back(sloRate);
+    }
+
+    if (sloChecked) {
+        cerr << "SLO p999 <= " << sloP999 << "ns at " << sloRate << " ops/s: " << (sloMet ? "met" : "missed") << "\n";
+    } else if (sweep) {
+        cerr << "SLO rate " << sloRate << " ops/s not reached by the sweep: not measured\n";
+    } else {
+        cerr << "SLO rate " << sloRate << " ops/s is not among --rates: not measured\n";
+    }
+    return 0;
+}
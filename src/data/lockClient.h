@@ -0,0 +1,351 @@
+#pragma once
+
+// Client library for the lock server (lockServer.cpp, protocol in lockProtocol.h).
+//
+//   client::LockClient c;
+//   std::string error;
+//   if (!c.connectUnix("/tmp/treelocker.sock", 2, error)) ...
+//   std::future<client::Result> f = c.lock(v, uid);      // From any thread.
+//   c.unlock(v, uid, [](client::Result r) { ... });     // Or with a callback.
+//
+// Calls never block on the network. Each one encodes its request into the
+// pending buffer of one connection and returns. The connection's I/O thread sends
+// whatever has accumulated as one frame, keeps up to Options::window frames in
+// flight, and completes futures and callbacks as response frames come back. A
+// lone request therefore goes out at once, while under load many threads' calls
+// share each frame and round trip. Requests made by one thread always use the
+// same connection, so they take effect in the order they were made.
+//
+// watch(v) subscribes the connection to changes in v's subtree (changeFeed.h);
+// the events go to Options::events, also on the I/O thread.
+//
+// Callbacks run on the I/O thread and must not block. A connection that fails
+// completes everything outstanding on it, and everything submitted to it later,
+// with LOST; there is no reconnect.
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "lockProtocol.h"
+
+namespace client {
+
+enum Result : uint8_t {
+    FALSE = proto::FALSE,
+    TRUE = proto::TRUE,
+    BAD_REQUEST = proto::BAD_REQUEST,
+    STALE = proto::STALE,
+    NOT_LEADER = proto::NOT_LEADER,
+    LOST = 255, // The connection failed before the answer arrived.
+};
+
+typedef std::function<void(Result)> Callback;
+typedef std::function<void(const proto::Event&)> EventCallback;
+
+// Blocking connect; -1 on failure.
+inline int connectUnix(const std::string& path) {
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    if (fd >= 0 && connect(fd, (sockaddr*)&addr, sizeof(addr)) == 0) return fd;
+    if (fd >= 0) close(fd);
+    return -1;
+}
+
+inline int connectTcp(const std::string& host, int port) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)port);
+    int one = 1;
+    if (fd >= 0) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (fd >= 0 && inet_pton(AF_INET, host.c_str(), &addr.sin_addr) == 1 &&
+        connect(fd, (sockaddr*)&addr, sizeof(addr)) == 0)
+        return fd;
+    if (fd >= 0) close(fd);
+    return -1;
+}
+
+struct Options {
+    uint32_t maxBatch = 1024; // Requests per frame.
+    int window = 4;           // Frames in flight per connection.
+    EventCallback events;     // Receives the events of watched subtrees.
+};
+
+// One socket and its I/O thread.
+class Connection {
+public:
+    Connection(int fd, const Options& o) : fd(fd), opt(o) {
+        opt.maxBatch = std::max(1u, std::min(opt.maxBatch, proto::MAX_FRAME / proto::REQUEST_BYTES));
+        opt.window = std::max(1, opt.window);
+        wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        io = std::thread([this] { run(); });
+    }
+
+    // Sends what is still pending, waits for the answers and disconnects.
+    ~Connection() {
+        {
+            std::lock_guard<std::mutex> g(mx);
+            closing = true;
+        }
+        wake();
+        io.join();
+        close(fd);
+        close(wakeFd);
+    }
+
+    void submit(uint8_t op, int v, int uid, Callback cb) {
+        std::unique_lock<std::mutex> g(mx);
+        if (lost) {
+            g.unlock();
+            cb(LOST);
+            return;
+        }
+        proto::putRequest(pending, proto::Request{nextTag++, op, (uint32_t)v, uid});
+        waiting.push_back(std::move(cb));
+        bool kick = idle;
+        idle = false;
+        g.unlock();
+        if (kick) wake();
+    }
+
+    uint64_t framesSent() const { return frames.load(); }
+    uint64_t requestsSent() const { return requests.load(); }
+
+private:
+    struct Batch {
+        uint32_t firstTag;
+        std::vector<Callback> callbacks;
+    };
+
+    int fd, wakeFd;
+    Options opt;
+    std::mutex mx; // Guards the fields up to 'io'.
+    std::string pending;            // Encoded requests not yet framed.
+    std::vector<Callback> waiting;  // Their callbacks, in tag order.
+    uint32_t nextTag = 0;           // Tag of the next request submitted.
+    uint32_t sentTag = 0;           // Tag of the first request in 'pending'.
+    bool idle = false;              // The I/O thread sleeps with room in its window.
+    bool closing = false, lost = false;
+    std::thread io;
+    std::atomic<uint64_t> frames{0}, requests{0};
+
+    void wake() {
+        uint64_t one = 1;
+        ssize_t w = write(wakeFd, &one, sizeof(one));
+        (void)w;
+    }
+
+    void run() {
+        std::deque<Batch> inFlight;
+        std::string out, in;
+        size_t outOff = 0;
+        std::vector<char> buf(64 << 10);
+        bool failed = false;
+        while (!failed) {
+            // Frame what has accumulated, as far as the window allows.
+            bool done = false;
+            {
+                std::lock_guard<std::mutex> g(mx);
+                while ((int)inFlight.size() < opt.window && !pending.empty()) {
+                    size_t count = std::min<size_t>(waiting.size(), opt.maxBatch);
+                    size_t bytes = count * proto::REQUEST_BYTES;
+                    size_t at = proto::beginFrame(out);
+                    out.append(pending, 0, bytes);
+                    proto::endFrame(out, at);
+                    pending.erase(0, bytes);
+                    Batch b{sentTag, std::vector<Callback>()};
+                    b.callbacks.assign(std::make_move_iterator(waiting.begin()),
+                                       std::make_move_iterator(waiting.begin() + count));
+                    waiting.erase(waiting.begin(), waiting.begin() + count);
+                    sentTag += (uint32_t)count;
+                    inFlight.push_back(std::move(b));
+                    frames.fetch_add(1, std::memory_order_relaxed);
+                    requests.fetch_add(count, std::memory_order_relaxed);
+                }
+                done = closing && pending.empty() && inFlight.empty() && outOff == out.size();
+                // Submitters wake us only if a new request could be sent right away.
+                idle = pending.empty() && (int)inFlight.size() < opt.window;
+            }
+            if (done) break;
+
+            while (outOff < out.size()) {
+                ssize_t w = send(fd, out.data() + outOff, out.size() - outOff, MSG_NOSIGNAL | MSG_DONTWAIT);
+                if (w < 0) {
+                    if (errno != EAGAIN && errno != EWOULDBLOCK) failed = true;
+                    break;
+                }
+                outOff += (size_t)w;
+            }
+            if (outOff == out.size()) {
+                out.clear();
+                outOff = 0;
+            }
+            if (failed) break;
+
+            pollfd p[2] = {{fd, (short)(POLLIN | (out.empty() ? 0 : POLLOUT)), 0}, {wakeFd, POLLIN, 0}};
+            if (poll(p, 2, -1) < 0) {
+                if (errno == EINTR) continue;
+                break;
+            }
+            if (p[1].revents & POLLIN) {
+                uint64_t n;
+                ssize_t r = read(wakeFd, &n, sizeof(n));
+                (void)r;
+            }
+            if (p[0].revents & (POLLERR | POLLHUP) && !(p[0].revents & POLLIN)) failed = true;
+            if (!(p[0].revents & POLLIN)) continue;
+
+            ssize_t r = recv(fd, buf.data(), buf.size(), MSG_DONTWAIT);
+            if (r <= 0) {
+                if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) continue;
+                failed = true;
+                break;
+            }
+            in.append(buf.data(), (size_t)r);
+            size_t off = 0;
+            long long len;
+            while (true) {
+                if (proto::isEventFrame(in.data() + off, in.size() - off)) {
+                    if ((len = proto::eventFrameBody(in.data() + off, in.size() - off)) <= 0) break;
+                    for (const char* e = in.data() + off + 4; e < in.data() + off + 4 + len; e += proto::EVENT_BYTES)
+                        if (opt.events) opt.events(proto::getEvent(e));
+                    off += 4 + (size_t)len;
+                    continue;
+                }
+                if ((len = proto::frameBody(in.data() + off, in.size() - off, proto::RESPONSE_BYTES)) <= 0) break;
+                const char* body = in.data() + off + 4;
+                if (inFlight.empty() || (size_t)len != inFlight.front().callbacks.size() * proto::RESPONSE_BYTES ||
+                    proto::getResponse(body).tag != inFlight.front().firstTag) {
+                    failed = true; // Not an answer to what we sent.
+                    break;
+                }
+                Batch b = std::move(inFlight.front());
+                inFlight.pop_front();
+                for (size_t i = 0; i < b.callbacks.size(); ++i)
+                    b.callbacks[i]((Result)proto::getResponse(body + i * proto::RESPONSE_BYTES).result);
+                off += 4 + (size_t)len;
+            }
+            if (len < 0) failed = true;
+            in.erase(0, off);
+        }
+
+        // Whatever is left will never be answered.
+        std::vector<Callback> rest;
+        {
+            std::lock_guard<std::mutex> g(mx);
+            lost = true;
+            pending.clear();
+            rest.swap(waiting);
+        }
+        for (Batch& b : inFlight)
+            for (Callback& cb : b.callbacks) cb(LOST);
+        for (Callback& cb : rest) cb(LOST);
+    }
+};
+
+class LockClient {
+public:
+    LockClient() = default;
+    explicit LockClient(const Options& o) : opt(o) {}
+    LockClient(const LockClient&) = delete;
+    LockClient& operator=(const LockClient&) = delete;
+
+    // Opens 'connections' sockets to the server. False (with 'error') if any fails.
+    bool connectUnix(const std::string& path, int connections, std::string& error) {
+        return open([&] { return client::connectUnix(path); }, connections, "cannot connect to " + path, error);
+    }
+
+    bool connectTcp(const std::string& host, int port, int connections, std::string& error) {
+        return open([&] { return client::connectTcp(host, port); }, connections,
+                    "cannot connect to " + host + ":" + std::to_string(port), error);
+    }
+
+    void lock(int v, int uid, Callback cb) { submit(1, v, uid, std::move(cb)); }
+    void unlock(int v, int uid, Callback cb) { submit(2, v, uid, std::move(cb)); }
+    void upgrade(int v, int uid, Callback cb) { submit(3, v, uid, std::move(cb)); }
+
+    std::future<Result> lock(int v, int uid) { return request(1, v, uid); }
+    std::future<Result> unlock(int v, int uid) { return request(2, v, uid); }
+    std::future<Result> upgrade(int v, int uid) { return request(3, v, uid); }
+    std::future<Result> isLocked(int v) { return request(4, v, 0); }
+    std::future<Result> canLock(int v) { return request(5, v, 0); }
+    std::future<Result> holds(int v, int uid) { return request(6, v, uid); }
+    // Events arrive on the connection of the calling thread.
+    std::future<Result> watch(int v) { return request(proto::WATCH, v, 0); }
+    std::future<Result> unwatch(int v) { return request(proto::UNWATCH, v, 0); }
+
+    // op as in lockProtocol.h: 1 lock, 2 unlock, 3 upgrade, 4-6 reads, 7-8 watches.
+    void submit(uint8_t op, int v, int uid, Callback cb) {
+        if (conns.empty()) {
+            cb(LOST);
+            return;
+        }
+        size_t i = std::hash<std::thread::id>()(std::this_thread::get_id()) % conns.size();
+        conns[i]->submit(op, v, uid, std::move(cb));
+    }
+
+    std::future<Result> request(uint8_t op, int v, int uid) {
+        std::shared_ptr<std::promise<Result>> p = std::make_shared<std::promise<Result>>();
+        std::future<Result> f = p->get_future();
+        submit(op, v, uid, [p](Result r) { p->set_value(r); });
+        return f;
+    }
+
+    // Frames and requests sent so far; their ratio is the batching achieved.
+    uint64_t framesSent() const {
+        uint64_t s = 0;
+        for (auto& c : conns) s += c->framesSent();
+        return s;
+    }
+
+    uint64_t requestsSent() const {
+        uint64_t s = 0;
+        for (auto& c : conns) s += c->requestsSent();
+        return s;
+    }
+
+    // Waits for every outstanding answer, then disconnects. Also done on destruction.
+    void close() { conns.clear(); }
+
+private:
+    Options opt;
+    std::vector<std::unique_ptr<Connection>> conns;
+
+    bool open(const std::function<int()>& connectOne, int connections, const std::string& what, std::string& error) {
+        close();
+        for (int i = 0; i < std::max(1, connections); ++i) {
+            int fd = connectOne();
+            if (fd < 0) {
+                close();
+                error = what;
+                return false;
+            }
+            conns.emplace_back(new Connection(fd, opt));
+        }
+        return true;
+    }
+};
+
+} // namespace client
@@ -0,0 +1,578 @@
+#pragma once
+
+// Partitioned lock manager: one implicit tree served by several processes.
+//
+// The nodes above depth --split ("top" nodes, [0, topEnd)) belong to a coordinator.
+// Every node at depth --split roots a subtree. The subtrees are dealt out in
+// contiguous runs to --partitions partition processes, and may migrate later. A partition keeps one
+// TreeLocker per subtree, numbered locally, so its memory is proportional to the
+// nodes it owns. Both roles run inside lockServer and speak lockProtocol.h;
+// the coordinator reaches the partitions through lockClient.h.
+//
+// Ops on deep nodes only involve their subtree. A client that knows the layout
+// (Layout::partitionOf) sends them straight to the owning partition; the
+// coordinator forwards any that reach it. The cross-partition parts of the tree
+// state are top-node locks and the locks below them:
+//  - A subtree below a locked top node is "fenced" in its partition. Every op
+//    in a fenced subtree fails, exactly as if the ancestor lock were visible there.
+//  - Locking, unlocking or upgrading a top node runs on the coordinator, under one
+//    mutex, with two phases. PREPARE_LOCK / PREPARE_UPGRADE go to every partition
+//    that holds subtrees below the node. Each one checks its subtrees (no locks at
+//    all, or only the caller's, respectively), fences them and votes. If every
+//    partition votes yes, COMMIT releases the caller's locks below the node (for an
+//    upgrade) and turns the fences into held ones; otherwise ABORT drops them.
+//    The coordinator applies its own half (the top TreeLocker) only after COMMIT.
+//  - Unlocking a top node sends RELEASE, which drops the fences below it.
+// While a prepare is in doubt (one round trip), its subtrees are fenced, so a deep
+// op racing with it is refused even if the two-phase op then aborts. A single
+// client issuing ops one after another sees exactly the single-process results.
+//
+//   P=--peers /tmp/p0.sock,/tmp/p1.sock
+//   ./lockServer --n 1000000 --m 4 --split 2 --partitions 2 --partition 0 $P --unix /tmp/p0.sock
+//   ./lockServer --n 1000000 --m 4 --split 2 --partitions 2 --partition 1 $P --unix /tmp/p1.sock
+//   ./lockServer --n 1000000 --m 4 --split 2 $P --unix /tmp/treelocker.sock --rebalance-ms 1000
+//
+// Subtrees can move between partitions while the cluster runs. The coordinator
+// holds new deep ops for the subtree, waits for the ones in flight, and sends
+// MIGRATE to the old owner. The old owner keeps the subtree's mutex while it
+// streams the locked nodes (node, uid) to the new owner, which replays them into
+// a fresh instance. descLocked follows from those, as in a snapshot. Then the old
+// owner drops the subtree and the coordinator flips its routing table and lets the
+// held ops through. Routed ops are delayed, never refused. Ops sent straight to
+// the old owner wait out the move and are then refused (BAD_REQUEST), as for any
+// node a partition does not own. With --rebalance-ms the coordinator polls every
+// subtree's op count (LOAD) and moves load from the busiest partition to the
+// idlest one whenever they differ by more than --rebalance-ratio.
+//
+// A lost partition is not recovered from: its ops, and two-phase ops that need it,
+// get BAD_REQUEST from the coordinator.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <string>
+#include <vector>
+
+#include "variants.h"
+#include "lockProtocol.h"
+#include "lockClient.h"
+
+namespace cluster {
+
+// Coordinator-to-partition ops, carried in the op byte of an ordinary request.
+// 'node' is the top node concerned, 'uid' the caller of the op on it.
+enum ControlOp : uint8_t {
+    PREPARE_LOCK = 16,    // Fence the subtrees below node if none of them holds a lock.
+    PREPARE_UPGRADE = 17, // Fence them if every lock in them is uid's.
+    COMMIT = 18,          // Release uid's locks in the prepared subtrees; their fences stay.
+    ABORT = 19,           // Drop the fences the prepare set.
+    RELEASE = 20,         // The node was unlocked: drop every fence below it.
+    // Subtree ops; 'node' is the subtree's root.
+    MIGRATE = 21,         // Freeze the subtree, stream it to partition uid - 1, drop it.
+    IMPORT_BEGIN = 22,    // Partition to partition: a subtree arrives (uid 2: fenced).
+    IMPORT_LOCK = 23,     // 'node' (any node of it) is locked by uid.
+    IMPORT_END = 24,      // The subtree is complete; start serving it.
+    LOAD = 25,            // Ops served on the subtree since the last LOAD, as LOAD_BASE + bit length.
+};
+
+// PREPARE_UPGRADE vote for "no objection, but no locks of uid's here either".
+const uint8_t VOTE_EMPTY = 4;
+const uint8_t LOAD_BASE = 16, LOAD_BUCKETS = 64;
+
+struct Layout {
+    int n = 0, m = 0, split = 0, partitions = 0;
+    int topEnd = 0; // Nodes [0, topEnd) are the coordinator's.
+    int roots = 0;  // Subtree roots: the nodes [topEnd, topEnd + roots) at depth 'split'.
+    std::vector<long long> levelStart, levelWidth; // First node and width of each depth.
+
+    // False (with 'error') unless 0 < split < depth of the tree and roots >= partitions.
+    bool init(int n_, int m_, int split_, int partitions_, std::string& error) {
+        n = n_, m = m_, split = split_, partitions = partitions_;
+        levelStart.assign(1, 0);
+        levelWidth.assign(1, 1);
+        while (levelStart.back() < n) {
+            levelStart.push_back(levelStart.back() + levelWidth.back());
+            levelWidth.push_back(levelWidth.back() * m);
+        }
+        int depth = (int)levelStart.size() - 1; // Levels that hold nodes.
+        if (split < 1 || split >= depth) {
+            error = "--split must be between 1 and " + std::to_string(depth - 1) + " for this tree";
+            return false;
+        }
+        topEnd = (int)levelStart[split];
+        roots = (int)std::min<long long>(levelWidth[split], n - topEnd);
+        if (partitions < 1 || partitions > roots) {
+            error = "need between 1 and " + std::to_string(roots) + " partitions at --split " + std::to_string(split);
+            return false;
+        }
+        return true;
+    }
+
+    bool top(int v) const { return v < topEnd; }
+
+    int depthOf(int v) const {
+        return (int)(std::upper_bound(levelStart.begin(), levelStart.end(), (long long)v) - levelStart.begin()) - 1;
+    }
+
+    // Subtree index (0-based) of deep node v.
+    int subtreeOf(int v) const {
+        int d = depthOf(v);
+        return (int)((v - levelStart[d]) / levelWidth[d - split]);
+    }
+
+    // Id of deep node v inside its subtree's own implicit tree.
+    int localId(int v) const {
+        int d = depthOf(v), k = d - split;
+        long long pos = v - levelStart[d];
+        return (int)(levelStart[k] + pos % levelWidth[k]);
+    }
+
+    // Node count of subtree s; its last level is a prefix, as in the whole tree.
+    int subtreeSize(int s) const {
+        long long size = 0;
+        for (int k = 0; split + k < (int)levelStart.size(); ++k) {
+            long long first = levelStart[split + k] + s * levelWidth[k];
+            size += std::max(0LL, std::min(levelWidth[k], (long long)n - first));
+        }
+        return (int)size;
+    }
+
+    // Inverse of localId() for subtree s.
+    int globalId(int s, int local) const {
+        int k = depthOf(local);
+        return (int)(levelStart[split + k] + s * levelWidth[k] + (local - levelStart[k]));
+    }
+
+    int subtreeRoot(int s) const { return topEnd + s; }
+
+    // Partitions start with contiguous runs of subtrees: [firstSubtree(p), firstSubtree(p + 1)).
+    int firstSubtree(int p) const { return (int)(((long long)p * roots + partitions - 1) / partitions); }
+    int partitionOfSubtree(int s) const { return (int)((long long)s * partitions / roots); }
+    int partitionOf(int v) const { return partitionOfSubtree(subtreeOf(v)); }
+
+    // Subtrees below top node t: [lo, hi), possibly empty.
+    void subtreesBelow(int t, int& lo, int& hi) const {
+        long long a = t, b = t;
+        for (int d = depthOf(t); d < split; ++d) a = a * m + 1, b = b * m + m;
+        lo = (int)std::min<long long>(a - topEnd, roots);
+        hi = (int)std::min<long long>(b - topEnd + 1, roots);
+    }
+};
+
+// Locked nodes of tl, found by following descLocked down from the root.
+template <class TL>
+void lockedNodes(const TL& tl, int root, std::vector<int>& out) {
+    std::vector<int> stack(1, root);
+    while (!stack.empty()) {
+        int u = stack.back();
+        stack.pop_back();
+        if (tl.lockedBy[u] != 0) out.push_back(u);
+        if (tl.descLocked[u] == 0) continue;
+        for (long long c = (long long)u * tl.m + 1; c <= (long long)u * tl.m + tl.m && c < tl.n; ++c)
+            stack.push_back((int)c);
+    }
+}
+
+// One partition process. It starts with the subtrees the layout gives it, and
+// gains or loses whole subtrees as the coordinator migrates them.
+template <class TL>
+class Partition {
+public:
+    // 'peers' (the partition sockets, in partition order) are only needed to
+    // migrate subtrees away; they are connected on first use.
+    Partition(const Layout& layout, int index, const std::vector<std::string>& peers)
+        : layout(layout), peerPaths(peers), peerClients(peers.size()) {
+        for (int s = layout.firstSubtree(index); s < layout.firstSubtree(index + 1); ++s)
+            subtrees[s] = std::make_shared<Subtree>(layout.subtreeSize(s), layout.m);
+    }
+
+    int subtreeCount() {
+        std::lock_guard<std::mutex> g(mapMx);
+        return (int)subtrees.size();
+    }
+
+    long long nodes() {
+        std::lock_guard<std::mutex> g(mapMx);
+        long long total = 0;
+        for (auto& s : subtrees) total += s.second->tl.n;
+        return total;
+    }
+
+    uint8_t serve(const proto::Request& q) {
+        if (q.uid == 0 || q.node >= (uint32_t)layout.n) return proto::BAD_REQUEST;
+        int v = (int)q.node;
+        if (q.op >= 1 && q.op <= 3) {
+            if (layout.top(v)) return proto::BAD_REQUEST;
+            std::shared_ptr<Subtree> t = find(layout.subtreeOf(v));
+            if (!t) return proto::BAD_REQUEST;
+            std::lock_guard<std::mutex> g(t->mx);        // Waits out a migration.
+            if (t->gone) return proto::BAD_REQUEST;      // Moved to another partition.
+            ++t->ops;
+            if (t->fenced) return proto::FALSE;
+            return applyOp(t->tl, q.op, layout.localId(v), q.uid) ? proto::TRUE : proto::FALSE;
+        }
+        if (q.op >= MIGRATE) return move(q.op, v, q.uid);
+        if (!layout.top(v)) return proto::BAD_REQUEST;
+        int lo, hi;
+        layout.subtreesBelow(v, lo, hi);
+        std::vector<std::shared_ptr<Subtree>> below;
+        {
+            std::lock_guard<std::mutex> g(mapMx);
+            for (auto it = subtrees.lower_bound(lo); it != subtrees.end() && it->first < hi; ++it)
+                below.push_back(it->second);
+        }
+        std::vector<std::unique_lock<std::mutex>> held; // Index order, like acquireSet.
+        for (auto& t : below) held.emplace_back(t->mx);
+        std::vector<int> locked;
+        switch (q.op) {
+        case PREPARE_LOCK:
+            for (auto& t : below)
+                if (t->fenced || t->tl.lockedBy[0] != 0 || t->tl.descLocked[0] != 0) return proto::FALSE;
+            for (auto& t : below) t->fenced = t->prepared = true;
+            return proto::TRUE;
+        case PREPARE_UPGRADE: {
+            // A subtree that is already fenced sits below one of the caller's top
+            // locks (the coordinator checked those), so it holds nothing.
+            bool mine = false;
+            for (auto& t : below) {
+                if (t->fenced) continue;
+                locked.clear();
+                lockedNodes(t->tl, 0, locked);
+                for (int u : locked)
+                    if (t->tl.lockedBy[u] != q.uid) return proto::FALSE;
+                mine = mine || !locked.empty();
+            }
+            for (auto& t : below)
+                if (!t->fenced) t->fenced = t->prepared = true;
+            return mine ? (uint8_t)proto::TRUE : VOTE_EMPTY;
+        }
+        case COMMIT:
+            for (auto& t : below) {
+                if (!t->prepared) continue;
+                locked.clear();
+                lockedNodes(t->tl, 0, locked);
+                for (int u : locked) t->tl.unlockNode(u, q.uid);
+                t->prepared = false;
+            }
+            return proto::TRUE;
+        case ABORT:
+            for (auto& t : below)
+                if (t->prepared) t->fenced = t->prepared = false;
+            return proto::TRUE;
+        case RELEASE:
+            for (auto& t : below) t->fenced = false;
+            return proto::TRUE;
+        }
+        return proto::BAD_REQUEST;
+    }
+
+private:
+    struct Subtree {
+        TL tl;
+        std::mutex mx;          // Held by every op on the subtree, and by a migration throughout.
+        bool fenced = false;    // A top ancestor is locked, or a two-phase op on one is in doubt.
+        bool prepared = false;  // The fence belongs to an in-doubt prepare.
+        bool gone = false;      // Migrated away; ops are refused.
+        long long ops = 0;      // Served since the last LOAD.
+
+        Subtree(int n, int m) : tl(n, m) {}
+    };
+
+    Layout layout;
+    std::mutex mapMx; // Guards the two maps (not the subtrees).
+    std::map<int, std::shared_ptr<Subtree>> subtrees;
+    std::map<int, std::shared_ptr<Subtree>> arriving; // Being imported; not served yet.
+    std::vector<std::string> peerPaths;
+    std::mutex peerMx;
+    std::vector<std::unique_ptr<client::LockClient>> peerClients;
+
+    std::shared_ptr<Subtree> find(int s) {
+        std::lock_guard<std::mutex> g(mapMx);
+        auto it = subtrees.find(s);
+        return it == subtrees.end() ? nullptr : it->second;
+    }
+
+    client::LockClient* peer(int p) {
+        std::lock_guard<std::mutex> g(peerMx);
+        if (p < 0 || p >= (int)peerPaths.size()) return nullptr;
+        if (!peerClients[p]) {
+            std::string error;
+            peerClients[p].reset(new client::LockClient());
+            if (!peerClients[p]->connectUnix(peerPaths[p], 1, error)) {
+                peerClients[p].reset();
+                return nullptr;
+            }
+        }
+        return peerClients[p].get();
+    }
+
+    // Migration and load ops; v is a subtree root except for IMPORT_LOCK.
+    uint8_t move(uint8_t op, int v, int uid) {
+        if (layout.top(v)) return proto::BAD_REQUEST;
+        int s = layout.subtreeOf(v);
+        if (op >= IMPORT_BEGIN && op <= IMPORT_END) {
+            std::lock_guard<std::mutex> g(mapMx);
+            if (op == IMPORT_BEGIN) {
+                std::shared_ptr<Subtree> t = std::make_shared<Subtree>(layout.subtreeSize(s), layout.m);
+                t->fenced = uid == 2;
+                arriving[s] = t;
+                return proto::TRUE;
+            }
+            auto it = arriving.find(s);
+            if (it == arriving.end()) return proto::BAD_REQUEST;
+            if (op == IMPORT_LOCK)
+                return it->second->tl.lockNode(layout.localId(v), uid) ? proto::TRUE : proto::FALSE;
+            subtrees[s] = it->second;
+            arriving.erase(it);
+            return proto::TRUE;
+        }
+        std::shared_ptr<Subtree> t = find(s);
+        if (!t) return proto::BAD_REQUEST;
+        std::lock_guard<std::mutex> g(t->mx);
+        if (t->gone) return proto::BAD_REQUEST;
+        if (op == LOAD) {
+            long long n = t->ops;
+            t->ops = 0;
+            int bucket = 0;
+            while (n > 0 && bucket < LOAD_BUCKETS - 1) n >>= 1, ++bucket;
+            return (uint8_t)(LOAD_BASE + bucket);
+        }
+        if (op != MIGRATE) return proto::BAD_REQUEST;
+
+        // Stream the locked nodes to the new owner and let go. Ops on the subtree
+        // queue on its mutex meanwhile; once it is gone they are refused here.
+        // The new owner never calls back, so waiting for it cannot deadlock.
+        client::LockClient* to = peer(uid - 1);
+        if (!to) return proto::FALSE;
+        std::vector<int> locked;
+        lockedNodes(t->tl, 0, locked);
+        std::vector<std::future<client::Result>> acks;
+        acks.push_back(to->request(IMPORT_BEGIN, v, t->fenced ? 2 : 1));
+        for (int u : locked) acks.push_back(to->request(IMPORT_LOCK, layout.globalId(s, u), t->tl.lockedBy[u]));
+        acks.push_back(to->request(IMPORT_END, v, 1));
+        bool ok = true;
+        for (auto& a : acks) ok = a.get() == client::TRUE && ok;
+        if (!ok) return proto::FALSE;
+        std::lock_guard<std::mutex> m(mapMx);
+        subtrees.erase(s);
+        t->gone = true;
+        return proto::TRUE;
+    }
+};
+
+// The coordinator: top nodes locally, everything else through the partitions.
+// It routes deep ops by its own table of subtree owners, which migrate() changes.
+template <class TL>
+class Coordinator {
+public:
+    explicit Coordinator(const Layout& layout)
+        : layout(layout), top(layout.topEnd, layout.m), owner(layout.roots), migrating(layout.roots),
+          inFlight(layout.roots) {
+        for (int s = 0; s < layout.roots; ++s) owner[s] = layout.partitionOfSubtree(s);
+    }
+
+    ~Coordinator() {
+        {
+            std::lock_guard<std::mutex> g(routeMx);
+            stopping = true;
+        }
+        routed.notify_all();
+        if (rebalancer.joinable()) rebalancer.join();
+    }
+
+    // One connection per partition, in partition order.
+    bool connect(const std::vector<std::string>& peers, std::string& error) {
+        for (const std::string& path : peers) {
+            partitions.emplace_back(new client::LockClient());
+            if (!partitions.back()->connectUnix(path, 1, error)) return false;
+        }
+        return true;
+    }
+
+    uint8_t serve(const proto::Request& q) {
+        if (q.op < 1 || q.op > 3 || q.uid == 0 || q.node >= (uint32_t)layout.n) return proto::BAD_REQUEST;
+        int v = (int)q.node, uid = q.uid;
+        if (!layout.top(v)) return forward(q.op, v, uid);
+        std::lock_guard<std::mutex> g(mx);
+        if (q.op == 1) {
+            if (!top.lockNode(v, uid)) return proto::FALSE;
+            std::vector<uint8_t> votes = broadcast(PREPARE_LOCK, v, uid);
+            bool yes = unanimous(votes), told = finish(yes, v, uid);
+            if (!yes || !told) top.unlockNode(v, uid);
+            return !told ? proto::BAD_REQUEST : yes ? proto::TRUE : proto::FALSE;
+        }
+        if (q.op == 2) {
+            if (!top.unlockNode(v, uid)) return proto::FALSE;
+            return unanimous(broadcast(RELEASE, v, uid)) ? proto::TRUE : proto::BAD_REQUEST;
+        }
+
+        // Upgrade: the top half first, then the partitions' votes.
+        for (int u = v; u >= 0; u = u == 0 ? -1 : (u - 1) / layout.m)
+            if (top.lockedBy[u] != 0) return proto::FALSE;
+        std::vector<int> locked;
+        lockedNodes(top, v, locked);
+        for (int u : locked)
+            if (top.lockedBy[u] != uid) return proto::FALSE;
+        std::vector<uint8_t> votes = broadcast(PREPARE_UPGRADE, v, uid);
+        bool below = !locked.empty();
+        for (uint8_t r : votes) below = below || r == proto::TRUE;
+        bool yes = unanimous(votes) && below;
+        if (!finish(yes, v, uid)) return proto::BAD_REQUEST;
+        if (!yes) return proto::FALSE;
+        if (!locked.empty()) top.upgradeNode(v, uid);
+        else top.lockNode(v, uid);
+        return proto::TRUE;
+    }
+
+    // Moves subtree s to partition 'to'. Deep ops for it wait here meanwhile;
+    // two-phase ops wait for the whole move. False if the old owner refused.
+    bool migrate(int s, int to) {
+        std::lock_guard<std::mutex> g(mx);
+        int from;
+        {
+            std::unique_lock<std::mutex> r(routeMx);
+            from = owner[s];
+            if (from == to) return true;
+            migrating[s] = true;
+            routed.wait(r, [&] { return inFlight[s] == 0; });
+        }
+        bool ok = partitions[from]->request(MIGRATE, layout.subtreeRoot(s), to + 1).get() == client::TRUE;
+        {
+            std::lock_guard<std::mutex> r(routeMx);
+            if (ok) owner[s] = to;
+            migrating[s] = false;
+        }
+        routed.notify_all();
+        return ok;
+    }
+
+    // Every 'intervalMs', polls each subtree's load from its partition and, if the
+    // busiest partition carries more than 'ratio' times the idlest one's load,
+    // moves the subtree that best evens the two out.
+    void startRebalancer(int intervalMs, double ratio) {
+        rebalancer = std::thread([this, intervalMs, ratio] {
+            std::unique_lock<std::mutex> r(routeMx);
+            while (!routed.wait_for(r, std::chrono::milliseconds(intervalMs), [&] { return stopping; })) {
+                std::vector<int> owners = owner;
+                r.unlock();
+                rebalance(owners, ratio);
+                r.lock();
+            }
+        });
+    }
+
+    long long migrations() const { return moved.load(); }
+
+private:
+    Layout layout;
+    TL top;
+    std::mutex mx; // Serializes the two-phase ops and migrations, and with them every change to 'top'.
+    std::vector<std::unique_ptr<client::LockClient>> partitions;
+    std::mutex routeMx; // Guards the routing table below.
+    std::condition_variable routed;
+    std::vector<int> owner;         // Partition of each subtree.
+    std::vector<char> migrating;    // Deep ops for these wait.
+    std::vector<int> inFlight;      // Deep ops forwarded and not yet answered.
+    bool stopping = false;
+    std::thread rebalancer;
+    std::atomic<long long> moved{0};
+
+    uint8_t forward(uint8_t op, int v, int uid) {
+        int s = layout.subtreeOf(v), p;
+        {
+            std::unique_lock<std::mutex> r(routeMx);
+            routed.wait(r, [&] { return !migrating[s]; });
+            p = owner[s];
+            ++inFlight[s];
+        }
+        client::Result res = partitions[p]->request(op, v, uid).get();
+        {
+            std::lock_guard<std::mutex> r(routeMx);
+            if (--inFlight[s] == 0 && migrating[s]) routed.notify_all();
+        }
+        return res == client::LOST ? (uint8_t)proto::BAD_REQUEST : (uint8_t)res;
+    }
+
+    void rebalance(const std::vector<int>& owners, double ratio) {
+        std::vector<std::future<client::Result>> answers;
+        for (int s = 0; s < layout.roots; ++s)
+            answers.push_back(partitions[owners[s]]->request(LOAD, layout.subtreeRoot(s), 1));
+        std::vector<long long> load(layout.roots), total(partitions.size());
+        std::vector<int> count(partitions.size());
+        for (int s = 0; s < layout.roots; ++s) {
+            int r = (int)answers[s].get() - LOAD_BASE;
+            load[s] = r <= 0 || r >= LOAD_BUCKETS ? 0 : 1LL << (r - 1); // Ops served, to within 2x.
+            total[owners[s]] += load[s];
+            ++count[owners[s]];
+        }
+        int hot = (int)(std::max_element(total.begin(), total.end()) - total.begin());
+        int cold = (int)(std::min_element(total.begin(), total.end()) - total.begin());
+        if (count[hot] < 2 || total[hot] <= ratio * (double)std::max(1LL, total[cold])) return;
+        // Moving load l leaves max(hot - l, cold + l), which only helps while l < hot - cold.
+        long long gap = total[hot] - total[cold];
+        int best = -1;
+        for (int s = 0; s < layout.roots; ++s)
+            if (owners[s] == hot && load[s] > 0 && load[s] < gap &&
+                (best < 0 || std::llabs(2 * load[s] - gap) < std::llabs(2 * load[best] - gap)))
+                best = s;
+        if (best < 0) return;
+        if (migrate(best, cold)) {
+            ++moved;
+            std::cerr << "cluster: moved subtree " << best << " from partition " << hot << " to " << cold << "\n";
+        }
+    }
+
+    // Sends (op, t, uid) to every partition holding subtrees below t, all at once,
+    // and collects the answers.
+    std::vector<uint8_t> broadcast(uint8_t op, int t, int uid) {
+        int lo, hi;
+        layout.subtreesBelow(t, lo, hi);
+        std::vector<char> involved(partitions.size());
+        {
+            std::lock_guard<std::mutex> r(routeMx);
+            for (int s = lo; s < hi; ++s) involved[owner[s]] = 1;
+        }
+        std::vector<std::future<client::Result>> answers;
+        for (size_t p = 0; p < partitions.size(); ++p)
+            if (involved[p]) answers.push_back(partitions[p]->request(op, t, uid));
+        std::vector<uint8_t> votes;
+        for (auto& a : answers) votes.push_back((uint8_t)a.get());
+        return votes;
+    }
+
+    static bool unanimous(const std::vector<uint8_t>& votes) {
+        for (uint8_t r : votes)
+            if (r != proto::TRUE && r != VOTE_EMPTY) return false;
+        return true;
+    }
+
+    // Second phase. False if a partition could not be told.
+    bool finish(bool commit, int t, int uid) {
+        for (uint8_t r : broadcast(commit ? COMMIT : ABORT, t, uid))
+            if (r != proto::TRUE) {
+                std::cerr << "cluster: lost a partition during " << (commit ? "commit" : "abort") << " of " << t << "\n";
+                return false;
+            }
+        return true;
+    }
+};
+
+// The lock server's per-request hook (lockServer.cpp) for the two roles.
+template <class TL>
+uint8_t serveRequest(Partition<TL>& p, const proto::Request& q) {
+    return p.serve(q);
+}
+
+template <class TL>
+uint8_t serveRequest(Coordinator<TL>& c, const proto::Request& q) {
+    return c.serve(q);
+}
+
+} // namespace cluster
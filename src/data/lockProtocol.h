@@ -0,0 +1,132 @@
+#pragma once
+
+// Wire protocol of the lock server (lockServer.cpp).
+//
+// Everything is little endian. A frame is a uint32 body length followed by the
+// body. A request frame carries one or more 13-byte requests:
+//   uint32 tag | uint8 op | uint32 node | int32 uid
+// with op 1 lock, 2 unlock, 3 upgrade, or one of the reads 4 isLocked, 5 canLock
+// (whether a lock would succeed now; both ignore uid) and 6 holds (node locked
+// by uid). The server answers every request frame with one response frame holding
+// a 5-byte response per request, in the same order:
+//   uint32 tag | uint8 result (0 false, 1 true, 2 bad request, 3 stale, 4 not leader)
+// The last two come from replicas (replication.h): a follower too far behind
+// to answer a read, and a follower asked to change the state.
+//
+// Op 7 watches a node's subtree and op 8 stops watching it (changeFeed.h). Once
+// a connection watches anything, the server also sends it event frames between
+// response frames. An event frame has the top bit of its length set and carries
+// 9-byte events:
+//   uint32 node | int32 uid (holder now, 0 unlocked) | uint8 kind (1 locked, 2 unlocked, 3 upgraded)
+// Events are coalesced: a node that changes several times before its event
+// goes out is reported once, with its latest state.
+// Tags are chosen by the client and echoed back untouched. Clients may pipeline:
+// any number of frames can be in flight on a connection, and their responses
+// come back in order. Putting several requests in one frame is how clients batch.
+
+#include <cstdint>
+#include <string>
+
+namespace proto {
+
+const uint32_t MAX_FRAME = 1u << 20;  // Larger frames are a protocol error.
+const uint32_t REQUEST_BYTES = 13, RESPONSE_BYTES = 5, EVENT_BYTES = 9;
+const uint32_t EVENT_FRAME = 1u << 31; // Length flag of event frames.
+
+enum Op : uint8_t { WATCH = 7, UNWATCH = 8 };
+
+enum Result : uint8_t { FALSE = 0, TRUE = 1, BAD_REQUEST = 2, STALE = 3, NOT_LEADER = 4 };
+
+struct Request {
+    uint32_t tag;
+    uint8_t op;
+    uint32_t node;
+    int32_t uid;
+};
+
+struct Response {
+    uint32_t tag;
+    uint8_t result;
+};
+
+struct Event {
+    uint32_t node;
+    int32_t uid;
+    uint8_t kind;
+};
+
+inline void putU32(std::string& out, uint32_t v) {
+    char b[4] = {(char)v, (char)(v >> 8), (char)(v >> 16), (char)(v >> 24)};
+    out.append(b, 4);
+}
+
+inline uint32_t getU32(const char* p) {
+    const uint8_t* u = (const uint8_t*)p;
+    return (uint32_t)u[0] | (uint32_t)u[1] << 8 | (uint32_t)u[2] << 16 | (uint32_t)u[3] << 24;
+}
+
+// Reserves a frame length in 'out'; pass the returned offset to endFrame() once
+// the body has been appended.
+inline size_t beginFrame(std::string& out) {
+    size_t at = out.size();
+    out.append(4, '\0');
+    return at;
+}
+
+inline void endFrame(std::string& out, size_t at) {
+    uint32_t len = (uint32_t)(out.size() - at - 4);
+    for (int i = 0; i < 4; ++i) out[at + i] = (char)(len >> (8 * i));
+}
+
+inline void putRequest(std::string& out, const Request& r) {
+    putU32(out, r.tag);
+    out.push_back((char)r.op);
+    putU32(out, r.node);
+    putU32(out, (uint32_t)r.uid);
+}
+
+inline Request getRequest(const char* p) {
+    return Request{getU32(p), (uint8_t)p[4], getU32(p + 5), (int32_t)getU32(p + 9)};
+}
+
+inline void putResponse(std::string& out, uint32_t tag, uint8_t result) {
+    putU32(out, tag);
+    out.push_back((char)result);
+}
+
+inline Response getResponse(const char* p) { return Response{getU32(p), (uint8_t)p[4]}; }
+
+inline void putEvent(std::string& out, const Event& e) {
+    putU32(out, e.node);
+    putU32(out, (uint32_t)e.uid);
+    out.push_back((char)e.kind);
+}
+
+inline Event getEvent(const char* p) { return Event{getU32(p), (int32_t)getU32(p + 4), (uint8_t)p[8]}; }
+
+inline bool isEventFrame(const char* p, size_t avail) { return avail >= 4 && (getU32(p) & EVENT_FRAME) != 0; }
+
+// Length of the complete frame body at 'p' (of 'avail' bytes), 0 if the frame
+// is not complete yet, or -1 if its length is not a valid multiple of 'unit'.
+inline long long frameBody(const char* p, size_t avail, uint32_t unit) {
+    if (avail < 4) return 0;
+    uint32_t len = getU32(p);
+    if (len == 0 || len > MAX_FRAME || len % unit != 0) return -1;
+    return avail - 4 >= len ? (long long)len : 0;
+}
+
+// frameBody() for an event frame.
+inline long long eventFrameBody(const char* p, size_t avail) {
+    if (avail < 4) return 0;
+    uint32_t len = getU32(p) & ~EVENT_FRAME;
+    if (len == 0 || len > MAX_FRAME || len % EVENT_BYTES != 0) return -1;
+    return avail - 4 >= len ? (long long)len : 0;
+}
+
+// Closes a frame begun with beginFrame() as an event frame.
+inline void endEventFrame(std::string& out, size_t at) {
+    endFrame(out, at);
+    out[at + 3] = (char)(out[at + 3] | 0x80);
+}
+
+} // namespace proto
@@ -0,0 +1,906 @@
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <type_traits>
+#include <unordered_map>
+#include <csignal>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "variants.h"
+#include "lockProtocol.h"
+#include "wal.h"
+#include "ioUring.h"
+#include "lockCluster.h"
+#include "replication.h"
+#include "changeFeed.h"
+#include "lockStatus.h"
+#include "metrics.h"
+
+using namespace std;
+
+// Lock server: serves lock/unlock/upgrade over Unix domain and TCP sockets so
+// applications share one TreeLocker instead of each embedding a copy.
+// Protocol in lockProtocol.h (length-prefixed binary frames, pipelined, several
+// requests per frame).
+//
+// Each of --threads event loops has its own epoll instance. All of them watch the
+// listening sockets (EPOLLEXCLUSIVE, so one loop wakes per connection) and serve
+// the connections they accepted. Every loop runs ops directly on the shared
+// concurrent TreeLocker, so the variant's own locking is what multiplexes the
+// connections. A loop drains everything a readable connection has sent, answers
+// every complete frame and writes all the responses back with one send(). A
+// pipelining client therefore costs a few syscalls per batch rather than per request.
+//
+//   ./lockServer --n 1000000 --m 4 --unix /tmp/treelocker.sock --port 7000 --threads 4
+//   ./serverLoad --unix /tmp/treelocker.sock --connections 64 --depth 8 --batch 32
+//
+// With --wal the server recovers from and logs to a write-ahead log. In strict
+// mode each loop commits once per round of reads before sending their responses.
+// SIGINT/SIGTERM stop the loops and flush the log.
+//
+// --io uring (the default where the kernel allows it) runs each loop on an
+// io_uring instead of epoll: multishot accept and multishot receive into a ring
+// of kernel-provided buffers, sends queued as SQEs, and one io_uring_enter()
+// per round submitting everything and waiting for the next completions. Under
+// pipelined load that is far less than one system call per request. If a ring
+// cannot be set up the loop falls back to epoll; --io epoll forces that.
+//
+// Connections can watch subtrees (ops 7 and 8, changeFeed.h). Each loop has one
+// eventfd that its connections' subscribers share. When it fires, the loop writes
+// the coalesced events of every watching connection out as event frames.
+//
+// --http-unix/--http-port add a small HTTP endpoint: GET /metrics, and POST
+// /lock-status, which answers the lock state of a whole list of nodes (by id, or
+// by the names from --names) in one response (lockStatus.h).
+//
+// --split runs one role of a partitioned cluster (lockCluster.h); --replicas runs
+// one replica of a replicated server (replication.h).
+
+const size_t READ_CHUNK = 64 << 10;
+const size_t OUTPUT_LIMIT = 4 << 20; // Stop reading from a client that does not read its responses.
+
+int stopFd = -1; // eventfd every loop watches; written by the signal handler.
+feed::Hub* watchHub = nullptr; // Only with a plain variant; the cluster and replica roles have no feed.
+
+void onStopSignal(int) {
+    uint64_t one = 1;
+    ssize_t w = write(stopFd, &one, sizeof(one));
+    (void)w;
+}
+
+// Changes that cannot be made safe (the log failed, replicas went away) must not be
+// acknowledged: the loop that found out returns without sending and stops the rest.
+atomic<bool> commitFailed{false};
+
+void stopOnCommitFailure() {
+    commitFailed = true;
+    onStopSignal(0);
+}
+
+struct Listener {
+    int fd;
+    bool tcp;
+};
+
+struct Conn {
+    enum Kind { CLIENT, LISTENER, STOP, EVENTS } kind;
+    int fd;
+
+    Conn(Kind k, int f) : kind(k), fd(f) {}
+
+    bool tcp = false;
+    bool closing = false; // No more input (EOF or error); finish answering, then close.
+    string in, out;
+    size_t inOff = 0, outOff = 0;
+    uint32_t events = 0;
+    int wakeFd = -1;                  // The loop's event eventfd, for 'sub'.
+    unique_ptr<feed::Subscriber> sub; // Created by the first WATCH.
+
+    // Whether a complete request frame is still waiting for an answer.
+    bool frameBuffered() const {
+        return proto::frameBody(in.data() + inOff, in.size() - inOff, proto::REQUEST_BYTES) > 0;
+    }
+};
+
+// The answer to one request. The cluster roles (lockCluster.h) overload this.
+template <class TL>
+uint8_t serveRequest(TL& tl, const proto::Request& q) {
+    if (q.op < 1 || q.op > 6 || q.node >= (uint32_t)tl.n || (q.uid == 0 && q.op != 4 && q.op != 5))
+        return proto::BAD_REQUEST;
+    if (q.op > 3) return readOp(tl, q.op, (int)q.node, q.uid) ? proto::TRUE : proto::FALSE;
+    return applyOp(tl, q.op, (int)q.node, q.uid) ? proto::TRUE : proto::FALSE;
+}
+
+uint8_t watchRequest(Conn* c, const proto::Request& q) {
+    if (!watchHub || q.node >= (uint32_t)watchHub->nodes()) return proto::BAD_REQUEST;
+    if (!c->sub) c->sub.reset(new feed::Subscriber(*watchHub, c->wakeFd));
+    bool ok = q.op == proto::WATCH ? c->sub->watch((int)q.node) : c->sub->unwatch((int)q.node);
+    return ok ? proto::TRUE : proto::FALSE;
+}
+
+// Appends the events pending for 'c' to c->out as event frames. False if there were
+// none, or if the output not yet sent (plus 'pendingElsewhere') is over
+// OUTPUT_LIMIT: a watcher that does not read then leaves its events in the
+// subscriber, where they coalesce per node, and the loop comes back for them
+// once its output has drained.
+bool appendEvents(Conn* c, size_t pendingElsewhere = 0) {
+    thread_local vector<feed::Event> events;
+    events.clear();
+    if (!c->sub || pendingElsewhere + c->out.size() - c->outOff > OUTPUT_LIMIT || !c->sub->take(events)) return false;
+    const size_t perFrame = proto::MAX_FRAME / proto::EVENT_BYTES;
+    for (size_t i = 0; i < events.size(); i += perFrame) {
+        size_t frame = proto::beginFrame(c->out);
+        for (size_t j = i; j < min(events.size(), i + perFrame); ++j)
+            proto::putEvent(c->out, proto::Event{(uint32_t)events[j].node, events[j].uid, events[j].kind});
+        proto::endEventFrame(c->out, frame);
+    }
+    return true;
+}
+
+// Answers every complete request frame buffered on 'c' into c->out, while the
+// output not yet sent (plus 'pendingElsewhere') stays under OUTPUT_LIMIT.
+// Returns false on a malformed frame: not our protocol, nothing sensible to answer.
+template <class TL>
+bool answerFrames(TL& tl, Conn* c, size_t pendingElsewhere, long long& served) {
+    bool ok = true;
+    while (pendingElsewhere + c->out.size() - c->outOff <= OUTPUT_LIMIT) {
+        const char* p = c->in.data() + c->inOff;
+        long long len = proto::frameBody(p, c->in.size() - c->inOff, proto::REQUEST_BYTES);
+        if (len < 0) {
+            c->inOff = c->in.size();
+            ok = false;
+        }
+        if (len <= 0) break;
+        size_t frame = proto::beginFrame(c->out);
+        for (const char* r = p + 4; r < p + 4 + len; r += proto::REQUEST_BYTES) {
+            proto::Request q = proto::getRequest(r);
+            bool watching = q.op == proto::WATCH || q.op == proto::UNWATCH;
+            proto::putResponse(c->out, q.tag, watching ? watchRequest(c, q) : serveRequest(tl, q));
+            ++served;
+        }
+        proto::endFrame(c->out, frame);
+        c->inOff += 4 + (size_t)len;
+    }
+    if (c->inOff == c->in.size()) {
+        c->in.clear();
+        c->inOff = 0;
+    } else if (c->inOff > c->in.size() / 2) {
+        c->in.erase(0, c->inOff);
+        c->inOff = 0;
+    }
+    return ok;
+}
+
+template <class TL>
+class EventLoop {
+public:
+    EventLoop(TL& tl, Committer* committer, const vector<Listener>& listeners) : tl(tl), committer(committer) {
+        ep = epoll_create1(EPOLL_CLOEXEC);
+        for (const Listener& l : listeners) {
+            Conn* c = new Conn(Conn::LISTENER, l.fd);
+            c->tcp = l.tcp;
+            watch(c, EPOLLIN | EPOLLEXCLUSIVE);
+        }
+        watch(new Conn(Conn::STOP, stopFd), EPOLLIN);
+        eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        watch(new Conn(Conn::EVENTS, eventFd), EPOLLIN);
+    }
+
+    ~EventLoop() {
+        for (auto& c : clients) close(c.first);
+        clients.clear(); // Their subscribers write to eventFd.
+        close(eventFd);
+        close(ep);
+    }
+
+    void run() {
+        epoll_event events[256];
+        vector<Conn*> ready;
+        while (true) {
+            int k = epoll_wait(ep, events, 256, -1);
+            ++syscalls;
+            if (k < 0) {
+                if (errno == EINTR) continue;
+                return;
+            }
+            ready.clear();
+            bool eventsDue = false;
+            for (int i = 0; i < k; ++i) {
+                Conn* c = (Conn*)events[i].data.ptr;
+                if (c->kind == Conn::STOP) return;
+                if (c->kind == Conn::EVENTS) {
+                    uint64_t n;
+                    ssize_t r = read(eventFd, &n, sizeof(n));
+                    (void)r;
+                    eventsDue = true;
+                    continue;
+                }
+                if (c->kind == Conn::LISTENER) {
+                    acceptAll(c->fd, c->tcp);
+                    continue;
+                }
+                if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                    drop(c);
+                    continue;
+                }
+                if ((events[i].events & EPOLLIN) && !readAll(c)) c->closing = true;
+                answer(c);
+                ready.push_back(c);
+            }
+            // One group commit covers every change made for this round of reads.
+            if (committer && !ready.empty() && !committer->commit()) {
+                stopOnCommitFailure(); // Nothing of this round is acknowledged.
+                return;
+            }
+            if (eventsDue)
+                for (auto& kv : clients)
+                    if (appendEvents(kv.second.get()) && find(ready.begin(), ready.end(), kv.second.get()) == ready.end())
+                        ready.push_back(kv.second.get());
+            // A closing connection is let go once everything that arrived before
+            // the client's EOF has been answered and sent.
+            for (Conn* c : ready)
+                if (!flushWithEvents(c) || (c->closing && c->out.empty() && !c->frameBuffered())) drop(c);
+        }
+    }
+
+    long long requestsServed() const { return served; }
+    long long connectionsAccepted() const { return accepted; }
+    long long systemCalls() const { return syscalls; }
+
+private:
+    TL& tl;
+    Committer* committer;
+    int ep, eventFd;
+    long long syscalls = 0; // On the request path: waits, accepts, reads and sends.
+    unordered_map<int, unique_ptr<Conn>> clients;
+    vector<unique_ptr<Conn>> fixed; // Listener and stop entries.
+    long long served = 0, accepted = 0;
+
+    void watch(Conn* c, uint32_t events) {
+        fixed.emplace_back(c);
+        epoll_event ev;
+        ev.events = events;
+        ev.data.ptr = c;
+        epoll_ctl(ep, EPOLL_CTL_ADD, c->fd, &ev);
+    }
+
+    void acceptAll(int listenFd, bool tcp) {
+        while (true) {
+            int fd = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            ++syscalls;
+            if (fd < 0) return; // EAGAIN: another loop took it, or nothing left.
+            if (tcp) {
+                int one = 1;
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            }
+            unique_ptr<Conn> c(new Conn(Conn::CLIENT, fd));
+            c->events = EPOLLIN | EPOLLRDHUP;
+            c->wakeFd = eventFd;
+            epoll_event ev;
+            ev.events = c->events;
+            ev.data.ptr = c.get();
+            epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev);
+            clients[fd] = move(c);
+            ++accepted;
+        }
+    }
+
+    void drop(Conn* c) {
+        epoll_ctl(ep, EPOLL_CTL_DEL, c->fd, nullptr);
+        close(c->fd);
+        clients.erase(c->fd);
+    }
+
+    // Reads whatever the client has sent. False once the client has closed its
+    // side or the connection failed.
+    bool readAll(Conn* c) {
+        if (c->out.size() - c->outOff > OUTPUT_LIMIT) return true;
+        while (true) {
+            size_t old = c->in.size();
+            c->in.resize(old + READ_CHUNK);
+            ssize_t r = read(c->fd, &c->in[old], READ_CHUNK);
+            ++syscalls;
+            c->in.resize(old + (r > 0 ? (size_t)r : 0));
+            if (r > 0) continue;
+            return r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+        }
+    }
+
+    void answer(Conn* c) {
+        if (!answerFrames(tl, c, 0, served)) shutdown(c->fd, SHUT_RD); // Reads then see EOF.
+    }
+
+    // Sends what is pending, then the events held back by OUTPUT_LIMIT if the
+    // backlog is under it now. False on a dead peer.
+    bool flushWithEvents(Conn* c) {
+        if (!flush(c)) return false;
+        return !appendEvents(c) || flush(c);
+    }
+
+    // Sends what is pending and adjusts the epoll interest. False on a dead peer.
+    // A closing connection only waits for writability, which also brings it back
+    // to answer the frames held back by OUTPUT_LIMIT.
+    bool flush(Conn* c) {
+        while (c->outOff < c->out.size()) {
+            ssize_t w = send(c->fd, c->out.data() + c->outOff, c->out.size() - c->outOff, MSG_NOSIGNAL);
+            ++syscalls;
+            if (w < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+                return false;
+            }
+            c->outOff += (size_t)w;
+        }
+        if (c->outOff == c->out.size()) {
+            c->out.clear();
+            c->outOff = 0;
+        }
+        size_t pending = c->out.size() - c->outOff;
+        uint32_t want = 0;
+        if (c->closing) want = EPOLLOUT;
+        else {
+            want = EPOLLRDHUP;
+            if (pending <= OUTPUT_LIMIT) want |= EPOLLIN;
+            if (pending > 0) want |= EPOLLOUT;
+        }
+        if (want != c->events) {
+            c->events = want;
+            epoll_event ev;
+            ev.events = want;
+            ev.data.ptr = c;
+            epoll_ctl(ep, EPOLL_CTL_MOD, c->fd, &ev);
+        }
+        return true;
+    }
+};
+
+// The same loop on an io_uring. Every in-flight operation's user_data is its
+// connection's address with the operation in the low bits.
+template <class TL>
+class UringLoop {
+public:
+    UringLoop(TL& tl, Committer* committer, const vector<Listener>& listeners)
+        : tl(tl), committer(committer), listeners(listeners) {}
+
+    ~UringLoop() {
+        for (auto& c : clients) close(c.first);
+        clients.clear(); // Their subscribers write to eventFd.
+        if (eventFd >= 0) close(eventFd);
+    }
+
+    void run() {
+        // Set up on the loop's own thread, which is the only one allowed to submit.
+        if (!ring.init(RING_ENTRIES) || !ring.provideBuffers(BUFFER_GROUP, BUFFERS, BUFFER_BYTES)) {
+            fallback.reset(new EventLoop<TL>(tl, committer, listeners));
+            fallback->run();
+            return;
+        }
+        for (const Listener& l : listeners) {
+            fixed.emplace_back(new RingConn(Conn::LISTENER, l.fd));
+            fixed.back()->tcp = l.tcp;
+            armAccept(fixed.back().get());
+        }
+        io_uring_sqe* s = ring.sqe();
+        s->opcode = IORING_OP_POLL_ADD;
+        s->fd = stopFd;
+        s->poll32_events = POLLIN;
+        s->user_data = STOP;
+        eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        armEvents();
+
+        vector<RingConn*> touched;
+        bool stopping = false;
+        while (!stopping) {
+            if (ring.submit(1) < 0 && errno != EBUSY) return;
+            touched.clear();
+            bool eventsDue = false;
+            ring.drain([&](const io_uring_cqe& cqe) {
+                unsigned op = (unsigned)(cqe.user_data & 7);
+                RingConn* c = (RingConn*)(uintptr_t)(cqe.user_data & ~(uint64_t)7);
+                if (op == STOP) stopping = true;
+                else if (op == EVENTS) eventsDue = true;
+                else if (op == ACCEPT) accepted(c, cqe);
+                else if (op == RECV) received(c, cqe);
+                else if (op == SEND) sent(c, cqe);
+                else return; // CANCEL: the cancelled receive reports by itself.
+                if (c && (op == RECV || op == SEND) && !c->touched) {
+                    c->touched = true;
+                    touched.push_back(c);
+                }
+            });
+            long long before = served;
+            for (RingConn* c : touched)
+                if (!answerFrames(tl, c, c->sending.size() - c->sendOff, served)) {
+                    shutdown(c->fd, SHUT_RD); // The receive then ends with EOF.
+                }
+            // One group commit covers every change made for this round of completions.
+            if (committer && served != before && !committer->commit()) {
+                stopOnCommitFailure(); // Nothing of this round is acknowledged.
+                return;
+            }
+            if (eventsDue) {
+                uint64_t n;
+                ssize_t r = read(eventFd, &n, sizeof(n));
+                (void)r;
+                armEvents();
+                for (auto& kv : clients) {
+                    RingConn* c = kv.second.get();
+                    if (appendEvents(c, c->sending.size() - c->sendOff) && !c->touched) {
+                        c->touched = true;
+                        touched.push_back(c);
+                    }
+                }
+            }
+            for (RingConn* c : touched) {
+                c->touched = false;
+                appendEvents(c, c->sending.size() - c->sendOff); // Those held back until a send completed.
+                advance(c);
+            }
+        }
+    }
+
+    long long requestsServed() const { return fallback ? fallback->requestsServed() : served; }
+    long long connectionsAccepted() const { return fallback ? fallback->connectionsAccepted() : acceptedCount; }
+    long long systemCalls() const { return fallback ? fallback->systemCalls() : (long long)ring.systemCalls(); }
+    bool usingRing() const { return !fallback; }
+
+private:
+    enum Op : uint64_t { RECV = 0, SEND = 1, ACCEPT = 2, STOP = 3, CANCEL = 4, EVENTS = 5 };
+    static const unsigned RING_ENTRIES = 4096, BUFFERS = 256, BUFFER_BYTES = 32 << 10;
+    static const uint16_t BUFFER_GROUP = 0;
+
+    struct RingConn : Conn {
+        using Conn::Conn;
+        string sending; // The buffer a send is in flight from; 'out' collects the next one.
+        size_t sendOff = 0;
+        bool receiving = false, sendBusy = false, cancelling = false;
+        bool failed = false; // Output can no longer be delivered.
+        bool touched = false;
+    };
+
+    TL& tl;
+    Committer* committer;
+    vector<Listener> listeners;
+    unordered_map<int, unique_ptr<RingConn>> clients;
+    vector<unique_ptr<RingConn>> fixed;
+    unique_ptr<EventLoop<TL>> fallback;
+    long long served = 0, acceptedCount = 0;
+    int eventFd = -1;
+    bool multishotAccept = true, multishotRecv = true; // Cleared on kernels without them.
+    uring::Ring ring; // Last, so it goes first and nothing it references is freed under it.
+
+    static uint64_t tag(RingConn* c, Op op) { return (uint64_t)(uintptr_t)c | op; }
+
+    void armAccept(RingConn* l) {
+        io_uring_sqe* s = ring.sqe();
+        s->opcode = IORING_OP_ACCEPT;
+        s->fd = l->fd;
+        s->accept_flags = SOCK_CLOEXEC;
+        if (multishotAccept) s->ioprio = IORING_ACCEPT_MULTISHOT;
+        s->user_data = tag(l, ACCEPT);
+    }
+
+    void armEvents() {
+        io_uring_sqe* s = ring.sqe();
+        s->opcode = IORING_OP_POLL_ADD;
+        s->fd = eventFd;
+        s->poll32_events = POLLIN;
+        s->user_data = EVENTS;
+    }
+
+    void armRecv(RingConn* c) {
+        io_uring_sqe* s = ring.sqe();
+        s->opcode = IORING_OP_RECV;
+        s->fd = c->fd;
+        s->flags = IOSQE_BUFFER_SELECT;
+        s->buf_group = BUFFER_GROUP;
+        if (multishotRecv) s->ioprio = IORING_RECV_MULTISHOT;
+        else s->len = BUFFER_BYTES;
+        s->user_data = tag(c, RECV);
+        c->receiving = true;
+    }
+
+    void armSend(RingConn* c) {
+        io_uring_sqe* s = ring.sqe();
+        s->opcode = IORING_OP_SEND;
+        s->fd = c->fd;
+        s->addr = (uint64_t)(uintptr_t)(c->sending.data() + c->sendOff);
+        s->len = (uint32_t)(c->sending.size() - c->sendOff);
+        s->msg_flags = MSG_NOSIGNAL;
+        s->user_data = tag(c, SEND);
+        c->sendBusy = true;
+    }
+
+    void cancelRecv(RingConn* c) {
+        if (!c->receiving || c->cancelling) return;
+        io_uring_sqe* s = ring.sqe();
+        s->opcode = IORING_OP_ASYNC_CANCEL;
+        s->addr = tag(c, RECV);
+        s->user_data = tag(c, CANCEL);
+        c->cancelling = true;
+    }
+
+    void accepted(RingConn* l, const io_uring_cqe& cqe) {
+        bool more = (cqe.flags & IORING_CQE_F_MORE) != 0;
+        if (cqe.res == -EINVAL && multishotAccept) {
+            multishotAccept = false;
+            more = false;
+        } else if (cqe.res >= 0) {
+            int fd = cqe.res;
+            if (l->tcp) {
+                int one = 1;
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            }
+            RingConn* c = new RingConn(Conn::CLIENT, fd);
+            c->wakeFd = eventFd;
+            clients[fd].reset(c);
+            ++acceptedCount;
+            armRecv(c);
+        }
+        if (!more) armAccept(l);
+    }
+
+    void received(RingConn* c, const io_uring_cqe& cqe) {
+        if (cqe.flags & IORING_CQE_F_BUFFER) {
+            uint16_t bid = (uint16_t)(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+            if (cqe.res > 0) c->in.append(ring.buffer(bid), (size_t)cqe.res);
+            ring.recycle(bid);
+        }
+        if (!(cqe.flags & IORING_CQE_F_MORE)) {
+            c->receiving = false;
+            c->cancelling = false;
+        }
+        if (cqe.res == 0) c->closing = true;
+        else if (cqe.res == -EINVAL && multishotRecv) multishotRecv = false; // Re-armed single-shot.
+        else if (cqe.res < 0 && cqe.res != -ENOBUFS && cqe.res != -ECANCELED) c->closing = true;
+    }
+
+    void sent(RingConn* c, const io_uring_cqe& cqe) {
+        c->sendBusy = false;
+        if (cqe.res < 0) {
+            c->failed = true;
+            return;
+        }
+        c->sendOff += (size_t)cqe.res;
+        if (c->sendOff == c->sending.size()) {
+            c->sending.clear();
+            c->sendOff = 0;
+        }
+    }
+
+    // Starts the next send, pauses or resumes receiving around OUTPUT_LIMIT, and
+    // closes the connection once nothing of it is in flight any more.
+    void advance(RingConn* c) {
+        if (c->failed) {
+            c->out.clear();
+            c->sending.clear();
+            c->sendOff = 0;
+        }
+        if (!c->sendBusy) {
+            if (c->sending.empty()) {
+                c->sending.swap(c->out);
+                c->sendOff = 0;
+            }
+            if (!c->sending.empty()) armSend(c);
+        }
+        size_t pending = c->sending.size() - c->sendOff + c->out.size();
+        if (c->failed || c->closing || pending > OUTPUT_LIMIT) cancelRecv(c);
+        else if (!c->receiving) armRecv(c);
+        if ((c->closing || c->failed) && !c->receiving && !c->sendBusy) {
+            int fd = c->fd;
+            close(fd);
+            clients.erase(fd);
+        }
+    }
+};
+
+int listenUnix(const string& path) {
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (fd < 0 || path.size() >= sizeof(addr.sun_path)) return -1;
+    strcpy(addr.sun_path, path.c_str());
+    unlink(path.c_str());
+    if (bind(fd, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, 1024) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int listenTcp(const string& host, int port) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)port);
+    if (inet_pton(AF_INET, host.c_str(), &addr.sin_addr) != 1 || bind(fd, (sockaddr*)&addr, sizeof(addr)) != 0 ||
+        listen(fd, 1024) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+struct Totals {
+    long long served = 0, accepted = 0, syscalls = 0;
+};
+
+// Runs 'threads' loops of type Loop until stopped and adds up their counters.
+template <class Loop, class TL>
+Totals runLoops(TL& tl, Committer* committer, const vector<Listener>& listeners, int threads) {
+    vector<unique_ptr<Loop>> loops;
+    for (int t = 0; t < threads; ++t) loops.emplace_back(new Loop(tl, committer, listeners));
+    vector<thread> workers;
+    for (auto& l : loops) workers.emplace_back([&l] { l->run(); });
+    for (thread& w : workers) w.join();
+    Totals t;
+    for (auto& l : loops) {
+        t.served += l->requestsServed();
+        t.accepted += l->connectionsAccepted();
+        t.syscalls += l->systemCalls();
+    }
+    return t;
+}
+
+int main(int argc, char** argv) {
+    string variant = "Song_S", unixPath, host = "127.0.0.1", walPath, io = "auto", httpUnix, namesPath;
+    int n = 0, m = 4, port = 0, httpPort = 0, threads = (int)max(1u, thread::hardware_concurrency());
+    wal::Durability walDurability = wal::GROUP;
+    int walIntervalUs = 1000;
+    int split = 0, partitions = 0, partition = -1, rebalanceMs = 0; // Cluster roles (lockCluster.h).
+    double rebalanceRatio = 1.5;
+    vector<string> peers;
+    repl::Options replication;
+    replication.index = -1;
+    auto parseList = [](const string& val, vector<string>& out) {
+        for (size_t at = 0; at <= val.size();) {
+            size_t comma = min(val.find(',', at), val.size());
+            out.push_back(val.substr(at, comma - at));
+            at = comma + 1;
+        }
+    };
+    for (int i = 1; i < argc; ++i) {
+        string key = argv[i];
+        if (i + 1 >= argc) {
+            cerr << "missing value for " << key << "\n";
+            return 1;
+        }
+        string val = argv[++i];
+        if (key == "--variant") variant = val;
+        else if (key == "--n") n = stoi(val);
+        else if (key == "--m") m = max(1, stoi(val));
+        else if (key == "--unix") unixPath = val;
+        else if (key == "--port") port = stoi(val);
+        else if (key == "--bind") host = val;
+        else if (key == "--threads") threads = max(1, stoi(val));
+        else if (key == "--wal") walPath = val;
+        else if (key == "--http-unix") httpUnix = val;
+        else if (key == "--http-port") httpPort = stoi(val);
+        else if (key == "--names") namesPath = val;
+        else if (key == "--io" && (val == "auto" || val == "uring" || val == "epoll")) io = val;
+        else if (key == "--wal-interval-us") walIntervalUs = stoi(val);
+        else if (key == "--split") split = stoi(val);
+        else if (key == "--partitions") partitions = stoi(val);
+        else if (key == "--partition") partition = stoi(val);
+        else if (key == "--rebalance-ms") rebalanceMs = stoi(val);
+        else if (key == "--rebalance-ratio") rebalanceRatio = stod(val);
+        else if (key == "--peers") parseList(val, peers);
+        else if (key == "--replicas") parseList(val, replication.peers);
+        else if (key == "--replica") replication.index = stoi(val);
+        else if (key == "--sync-replicas") replication.syncReplicas = stoi(val);
+        else if (key == "--repl-interval-us") replication.intervalUs = stoi(val);
+        else if (key == "--failover-ms") replication.failoverMs = max(1, stoi(val));
+        else if (key == "--max-staleness-ms") replication.maxStalenessMs = stoi(val);
+        else if (key != "--wal-durability" || !wal::parseDurability(val, walDurability)) {
+            cerr << "usage: " << argv[0] << " --n N [--m M] [--variant Song_S|Song_M|mulSongs]\n"
+                 << "  [--unix PATH] [--port PORT] [--bind ADDR] [--threads T] [--io auto|uring|epoll]\n"
+                 << "  [--wal PATH] [--wal-durability off|group|strict] [--wal-interval-us N]\n"
+                 << "  [--http-unix PATH] [--http-port PORT] [--names FILE]\n"
+                 << "  [--split D [--partitions P --partition I] [--peers PATH,PATH,...]\n"
+                 << "   [--rebalance-ms MS] [--rebalance-ratio R]]\n"
+                 << "  [--replicas PATH,PATH,... --replica I [--sync-replicas K] [--repl-interval-us N]\n"
+                 << "   [--failover-ms MS] [--max-staleness-ms MS]]\n";
+            return 1;
+        }
+    }
+    if (n <= 0 || (unixPath.empty() && port == 0)) {
+        cerr << "need --n and at least one of --unix / --port\n";
+        return 1;
+    }
+    bool replicated = !replication.peers.empty();
+    if (replicated && (replication.index < 0 || replication.index >= (int)replication.peers.size() ||
+                       split > 0 || !walPath.empty())) {
+        cerr << "with --replicas, give --replica (an index into the list), and no --split or --wal\n";
+        return 1;
+    }
+    bool clustered = split > 0;
+    bool http = !httpUnix.empty() || httpPort > 0;
+    if ((http || !namesPath.empty()) && (clustered || replicated)) {
+        cerr << "--http-unix, --http-port and --names serve a plain server, not a cluster role or replica\n";
+        return 1;
+    }
+    // One name per line; line i names node i.
+    status::NameIndex names;
+    if (!namesPath.empty()) {
+        ifstream in(namesPath);
+        vector<string> list;
+        for (string line; getline(in, line);) {
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            list.push_back(line);
+        }
+        if (!in.eof() || (int)list.size() > n) {
+            cerr << "cannot read " << namesPath << (in.eof() ? ": more names than --n nodes" : "") << "\n";
+            return 1;
+        }
+        names.build(list);
+    }
+    cluster::Layout layout;
+    if (clustered) {
+        string error;
+        if ((partition < 0 && peers.empty()) || (partition >= 0 && !peers.empty() && (int)peers.size() != partitions) ||
+            !walPath.empty()) {
+            cerr << "with --split, give --peers (coordinator) or --partition and --partitions (partition, where\n"
+                 << "--peers lists all partitions if given), and no --wal\n";
+            return 1;
+        }
+        if (!layout.init(n, m, split, partition >= 0 ? partitions : (int)peers.size(), error)) {
+            cerr << error << "\n";
+            return 1;
+        }
+        if (partition >= layout.partitions) {
+            cerr << "--partition must be below --partitions\n";
+            return 1;
+        }
+    }
+
+    vector<Listener> listeners;
+    if (!unixPath.empty()) {
+        int fd = listenUnix(unixPath);
+        if (fd < 0) {
+            cerr << "cannot listen on " << unixPath << "\n";
+            return 1;
+        }
+        listeners.push_back(Listener{fd, false});
+    }
+    if (port > 0) {
+        int fd = listenTcp(host, port);
+        if (fd < 0) {
+            cerr << "cannot listen on " << host << ":" << port << "\n";
+            return 1;
+        }
+        listeners.push_back(Listener{fd, true});
+    }
+
+    stopFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    replication.stopFd = stopFd; // A commit still waiting for followers gives up on shutdown.
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, onStopSignal);
+    signal(SIGTERM, onStopSignal);
+
+    bool useRing = io != "epoll" && uring::available();
+    if (io == "uring" && !useRing) cerr << "lockServer: io_uring is not available here, using epoll\n";
+
+    int status = 0;
+    // Serves 'tl' (a variant, or a cluster role built on one) until stopped.
+    auto serve = [&](auto& tl, Committer* committer) {
+        typedef typename std::remove_reference<decltype(tl)>::type TL;
+        return useRing ? runLoops<UringLoop<TL>>(tl, committer, listeners, threads)
+                       : runLoops<EventLoop<TL>>(tl, committer, listeners, threads);
+    };
+    auto report = [](const Totals& t) {
+        cerr << "lockServer: served " << t.served << " requests on " << t.accepted << " connections, "
+             << t.syscalls << " system calls";
+        if (t.served > 0) cerr << " (" << (double)t.syscalls / t.served << " per request)";
+        cerr << "\n";
+    };
+    const char* ioName = useRing ? "io_uring" : "epoll";
+
+    bool known = clustered ? withVariantType(variant, [&](auto* type) {
+        typedef typename std::remove_pointer<decltype(type)>::type TL;
+        if (partition >= 0) {
+            cluster::Partition<TL> part(layout, partition, peers);
+            cerr << "lockServer: " << variant << ", partition " << partition << " of " << layout.partitions << ", "
+                 << part.subtreeCount() << " subtrees, " << part.nodes() << " nodes, " << threads << " loops ("
+                 << ioName << ")\n";
+            report(serve(part, nullptr));
+            return;
+        }
+        cluster::Coordinator<TL> coord(layout);
+        string error;
+        if (!coord.connect(peers, error)) {
+            cerr << error << "\n";
+            status = 1;
+            return;
+        }
+        cerr << "lockServer: " << variant << ", coordinator of " << layout.partitions << " partitions, "
+             << layout.topEnd << " top nodes, " << threads << " loops (" << ioName << ")\n";
+        if (rebalanceMs > 0) coord.startRebalancer(rebalanceMs, rebalanceRatio);
+        report(serve(coord, nullptr));
+        if (rebalanceMs > 0) cerr << "lockServer: " << coord.migrations() << " subtree migrations\n";
+    }) : withVariant(variant, n, m, [&](auto& tl) {
+        typedef typename std::remove_reference<decltype(tl)>::type TL;
+        if (replicated) {
+            repl::Replica<TL> replica(tl, replication);
+            string error;
+            if (!replica.start(error)) {
+                cerr << error << "\n";
+                status = 1;
+                return;
+            }
+            cerr << "lockServer: " << variant << ", " << n << " nodes, replica " << replication.index << " of "
+                 << replication.peers.size() << ", " << threads << " loops (" << ioName << ")\n";
+            Totals t = serve(replica, replication.syncReplicas > 0 ? &replica : nullptr);
+            replica.stop();
+            report(t);
+            cerr << "lockServer: replica " << replication.index << " stopped as "
+                 << (replica.leader() ? "leader" : "follower") << " at LSN " << replica.lsn() << "\n";
+            return;
+        }
+        wal::Log log;
+        log.useIoUring(io != "epoll");
+        if (!walPath.empty()) {
+            wal::RecoveryResult rec;
+            string error;
+            if (!wal::recover(walPath, tl, rec, error) ||
+                !log.open(walPath, n, m, walDurability, walIntervalUs, rec.validBytes, rec.startLsn + rec.records,
+                          error)) {
+                cerr << error << "\n";
+                status = 1;
+                return;
+            }
+            if (rec.records > 0) cerr << "wal: recovered " << rec.records << " changes\n";
+        }
+        // The feed sits in front of the log and costs next to nothing while nobody watches.
+        feed::Hub hub(n, m);
+        if (!walPath.empty()) hub.next = &log;
+        tl.sink = &hub;
+        watchHub = &hub;
+        metrics::MetricsServer httpServer;
+        if (http) {
+            httpServer.addGauge("treelocker_nodes", "Nodes in the tree.", [n] { return (double)n; });
+            httpServer.addGauge("treelocker_watches", "Subtree watches across all connections.",
+                                [&hub] { return (double)hub.watches(); });
+            httpServer.addHandler("/lock-status", "application/json",
+                                  [&tl, &names](const string& body) { return status::answer(tl, names, body); });
+            if (!httpServer.start(httpUnix, httpPort)) cerr << "lockServer: HTTP endpoint not started\n";
+        }
+
+        cerr << "lockServer: " << variant << ", " << n << " nodes, " << threads << " loops (" << ioName << ")\n";
+        Totals t = serve(tl, log.strict() ? &log : nullptr);
+        httpServer.stop();
+        log.close();
+        report(t);
+    });
+    if (!known) {
+        cerr << "unknown variant " << variant << "\n";
+        return 1;
+    }
+    if (!unixPath.empty()) unlink(unixPath.c_str());
+    if (commitFailed) {
+        cerr << "lockServer: stopped without acknowledging changes that could not be committed\n";
+        status = 1;
+    }
+
+#if TREELOCKER_TELEMETRY
+    telemetry::report(cerr);
+#endif
+    return status;
+}
@@ -0,0 +1,180 @@
+#pragma once
+
+// Batched lock-status lookups, for list views that show a lock badge on every
+// visible row: one call answers a whole page of nodes.
+//
+// NameIndex maps node names to ids (an open-addressing table with FNV-1a, as in
+// the state file). resolve() works through the keys in groups. For each group it
+// hashes every key and prefetches its slot first. It then prefetches the
+// candidate names and compares them last. The cache misses of a group
+// therefore overlap instead of queuing up one key at a time. lookup() does the
+// same for lockedBy/descLocked: it prefetches a few nodes ahead of the one it
+// classifies.
+//
+// answer() is what the lock server's POST /lock-status runs: one key per line,
+// either a name or "#id", and a JSON array with one status per key, in order:
+//   [{"node":12,"state":"locked","uid":7},{"node":-1,"state":"unknown"},...]
+// "under" means an ancestor is locked (uid is its holder), "holds" means some
+// descendants are locked. Like readOp(), it reads without the variant's locks.
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "persistentState.h" // hashName.
+
+namespace status {
+
+enum State : uint8_t { UNKNOWN, FREE, LOCKED, UNDER, HOLDS };
+
+inline const char* stateName(State s) {
+    static const char* names[] = {"unknown", "free", "locked", "under", "holds"};
+    return names[s];
+}
+
+struct Status {
+    int32_t node;  // -1 for a key that names no node.
+    State state;
+    int32_t uid;   // Holder for LOCKED and UNDER, else 0.
+};
+
+const size_t GROUP = 16;         // Keys hashed and prefetched together.
+const size_t PREFETCH_AHEAD = 8; // Nodes lookup() runs ahead of itself.
+
+class NameIndex {
+public:
+    // Name i becomes node i. A repeated name maps to its last occurrence.
+    void build(const std::vector<std::string>& names) {
+        size_t capacity = 16;
+        while (capacity < names.size() * 2) capacity *= 2;
+        mask = capacity - 1;
+        slots.assign(capacity, Slot{0, 0});
+        offsets.assign(1, 0);
+        blob.clear();
+        for (size_t i = 0; i < names.size(); ++i) {
+            blob += names[i];
+            offsets.push_back(blob.size());
+            uint64_t h = pstate::hashName(names[i].data(), names[i].size());
+            uint64_t s = h & mask;
+            while (slots[s].id != 0 && name(slots[s].id - 1) != names[i]) s = (s + 1) & mask;
+            slots[s] = Slot{(uint32_t)i + 1, (uint32_t)(h >> 32)};
+        }
+    }
+
+    size_t size() const { return offsets.size() - 1; }
+
+    // Node ids for 'count' keys into 'ids': a name, or "#id" for a node of an
+    // n-node tree. -1 where neither resolves.
+    void resolve(const std::string_view* keys, size_t count, int n, int* ids) const {
+        uint64_t hashes[GROUP];
+        for (size_t at = 0; at < count; at += GROUP) {
+            size_t k = std::min(GROUP, count - at);
+            for (size_t i = 0; i < k; ++i) {
+                const std::string_view& key = keys[at + i];
+                hashes[i] = pstate::hashName(key.data(), key.size());
+                if (!slots.empty()) __builtin_prefetch(&slots[hashes[i] & mask]);
+            }
+            for (size_t i = 0; i < k && !slots.empty(); ++i) {
+                const Slot& s = slots[hashes[i] & mask];
+                if (s.id != 0) __builtin_prefetch(blob.data() + offsets[s.id - 1]);
+            }
+            for (size_t i = 0; i < k; ++i) ids[at + i] = find(keys[at + i], hashes[i], n);
+        }
+    }
+
+private:
+    struct Slot {
+        uint32_t id;  // Node id + 1, 0 = empty.
+        uint32_t tag; // High half of the hash, so most mismatches skip the blob.
+    };
+
+    std::vector<Slot> slots;
+    std::vector<uint64_t> offsets{0};
+    std::string blob;
+    uint64_t mask = 0;
+
+    std::string_view name(uint32_t id) const {
+        return std::string_view(blob.data() + offsets[id], offsets[id + 1] - offsets[id]);
+    }
+
+    int find(std::string_view key, uint64_t h, int n) const {
+        if (key.size() > 1 && key[0] == '#') {
+            int v = 0;
+            for (size_t i = 1; i < key.size(); ++i) {
+                if (key[i] < '0' || key[i] > '9' || v > (n - (key[i] - '0')) / 10) return -1;
+                v = v * 10 + (key[i] - '0');
+            }
+            return v < n ? v : -1;
+        }
+        if (slots.empty()) return -1;
+        for (uint64_t s = h & mask; slots[s].id != 0; s = (s + 1) & mask)
+            if (slots[s].tag == (uint32_t)(h >> 32) && name(slots[s].id - 1) == key) {
+                int v = (int)slots[s].id - 1;
+                return v < n ? v : -1;
+            }
+        return -1;
+    }
+};
+
+// Status of 'count' nodes (ids from resolve(); -1 gives UNKNOWN) into 'out'.
+template <class TL>
+void lookup(const TL& tl, const int* ids, size_t count, Status* out) {
+    for (size_t i = 0; i < count; ++i) {
+        if (i + PREFETCH_AHEAD < count && ids[i + PREFETCH_AHEAD] >= 0) {
+            __builtin_prefetch(&tl.lockedBy[ids[i + PREFETCH_AHEAD]]);
+            __builtin_prefetch(&tl.descLocked[ids[i + PREFETCH_AHEAD]]);
+        }
+        int v = ids[i];
+        if (v < 0) {
+            out[i] = Status{-1, UNKNOWN, 0};
+            continue;
+        }
+        int uid = tl.lockedBy[v];
+        if (uid != 0) {
+            out[i] = Status{v, LOCKED, uid};
+            continue;
+        }
+        out[i] = Status{v, FREE, 0};
+        for (int u = v; u > 0;) { // The top levels are shared by the whole page and stay cached.
+            u = (u - 1) / tl.m;
+            if ((uid = tl.lockedBy[u]) != 0) {
+                out[i] = Status{v, UNDER, uid};
+                break;
+            }
+        }
+        if (out[i].state == FREE && tl.descLocked[v] != 0) out[i].state = HOLDS;
+    }
+}
+
+// Answers a POST /lock-status body (see the top of this file).
+template <class TL>
+std::string answer(const TL& tl, const NameIndex& names, const std::string& body) {
+    thread_local std::vector<std::string_view> keys;
+    thread_local std::vector<int> ids;
+    thread_local std::vector<Status> out;
+    keys.clear();
+    for (size_t at = 0; at < body.size();) {
+        size_t end = std::min(body.find('\n', at), body.size());
+        size_t last = end;
+        while (last > at && (body[last - 1] == '\r' || body[last - 1] == ' ')) --last;
+        if (last > at) keys.push_back(std::string_view(body.data() + at, last - at));
+        at = end + 1;
+    }
+    ids.resize(keys.size());
+    out.resize(keys.size());
+    names.resolve(keys.data(), keys.size(), tl.n, ids.data());
+    lookup(tl, ids.data(), ids.size(), out.data());
+    std::string json = "[";
+    for (size_t i = 0; i < out.size(); ++i) {
+        if (i > 0) json += ",";
+        json += "{\"node\":" + std::to_string(out[i].node) + ",\"state\":\"" + stateName(out[i].state) + "\"";
+        if (out[i].uid != 0) json += ",\"uid\":" + std::to_string(out[i].uid);
+        json += "}";
+    }
+    json += "]\n";
+    return json;
+}
+
+} // namespace status
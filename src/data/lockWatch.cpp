@@ -0,0 +1,81 @@
+#include <iostream>
+#include <vector>
+#include <string>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <mutex>
+
+#include "lockClient.h"
+
+using namespace std;
+
+// Watches subtrees on a lockServer (changeFeed.h) and prints one line per event:
+//   node uid locked|unlocked|upgraded
+// as they arrive, until --seconds pass (0: until killed). The events are
+// coalesced on the server, so a node that flips several times between two
+// deliveries shows up once, in its latest state.
+//   ./lockWatch --unix /tmp/treelocker.sock --node 0 --seconds 10
+
+int main(int argc, char** argv) {
+    string unixPath, host = "127.0.0.1";
+    int port = 0;
+    double seconds = 0;
+    vector<int> nodes;
+    for (int i = 1; i < argc; ++i) {
+        string key = argv[i];
+        if (i + 1 >= argc) {
+            cerr << "missing value for " << key << "\n";
+            return 1;
+        }
+        string val = argv[++i];
+        if (key == "--unix") unixPath = val;
+        else if (key == "--port") port = stoi(val);
+        else if (key == "--host") host = val;
+        else if (key == "--node") nodes.push_back(stoi(val));
+        else if (key == "--seconds") seconds = stod(val);
+        else {
+            cerr << "usage: " << argv[0] << " (--unix PATH | --port PORT [--host ADDR]) --node V [--node V ...]\n"
+                 << "  [--seconds S]\n";
+            return 1;
+        }
+    }
+    if ((unixPath.empty() && port == 0) || nodes.empty()) {
+        cerr << "need --unix or --port, and at least one --node\n";
+        return 1;
+    }
+
+    static const char* kinds[] = {"?", "locked", "unlocked", "upgraded"};
+    mutex outMx;
+    atomic<long long> received{0};
+    client::Options opt;
+    opt.events = [&](const proto::Event& e) {
+        lock_guard<mutex> g(outMx);
+        cout << e.node << " " << e.uid << " " << kinds[e.kind <= 3 ? e.kind : 0] << "\n" << flush;
+        received++;
+    };
+    client::LockClient c(opt);
+    string error;
+    if (!(unixPath.empty() ? c.connectTcp(host, port, 1, error) : c.connectUnix(unixPath, 1, error))) {
+        cerr << error << "\n";
+        return 1;
+    }
+    for (int v : nodes) {
+        client::Result r = c.watch(v).get();
+        if (r != client::TRUE) {
+            cerr << "cannot watch node " << v << (r == client::BAD_REQUEST ? " (no such node, or no feed here)" : "")
+                 << "\n";
+            return 1;
+        }
+    }
+    auto start = chrono::steady_clock::now();
+    while (seconds <= 0 || chrono::steady_clock::now() - start < chrono::duration<double>(seconds)) {
+        this_thread::sleep_for(chrono::milliseconds(50));
+        if (c.isLocked(0).get() == client::LOST) {
+            cerr << "connection lost\n";
+            return 1;
+        }
+    }
+    cerr << received << " events\n";
+    return 0;
+}
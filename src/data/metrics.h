@@ -0,0 +1,297 @@
+#pragma once
+
+// Prometheus text-format metrics endpoint for the long-running engine.
+// Serves "GET /metrics" over HTTP/1.0 on a Unix domain socket and/or a loopback TCP
+// port from its own thread:
+//   curl --unix-socket /tmp/treelocker.sock http://localhost/metrics
+//   curl http://127.0.0.1:9464/metrics
+// Drivers can add other paths with addHandler(); the lock server answers
+// POST /lock-status that way (lockStatus.h).
+//
+// Op counters, failure reasons, latency histograms and per-level lock gauges come from
+// telemetry.h and are only present when the engine is built with TREELOCKER_TELEMETRY=1.
+// Anything else (queue depth, ...) is registered as a gauge callback by the driver.
+// Scraping sums the per-thread telemetry blocks with relaxed loads, so workers are
+// never blocked by a scrape.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <poll.h>
+#include <strings.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+
+#include "telemetry.h"
+
+namespace metrics {
+
+// Latency bucket bounds exposed to Prometheus, in nanoseconds. The internal histogram
+// is much finer; these are the cumulative "le" cut points.
+inline const std::vector<uint64_t>& latencyBucketsNs() {
+    static const std::vector<uint64_t> b = {100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000,
+                                            100000, 250000, 500000, 1000000, 10000000, 100000000};
+    return b;
+}
+
+// Number of samples whose bucket lies entirely at or below 'v'.
+inline uint64_t countAtOrBelow(const LatencyHistogram& h, uint64_t v) {
+    uint64_t c = 0;
+    for (int i = 0; i < LatencyHistogram::BUCKETS; ++i) {
+        if (LatencyHistogram::upperBound(i) > v) break;
+        c += h.counts[i];
+    }
+    return c;
+}
+
+// Renders the telemetry snapshot in exposition format.
+inline void writeTelemetry(std::ostream& out) {
+#if TREELOCKER_TELEMETRY
+    telemetry::Snapshot s = telemetry::snapshot();
+    out << "# HELP treelocker_ops_total Tree locker operations by type and outcome.\n";
+    out << "# TYPE treelocker_ops_total counter\n";
+    for (int k = 0; k < telemetry::OP_KINDS; ++k)
+        for (int o = 0; o < telemetry::OUTCOMES; ++o)
+            if (telemetry::outcomeApplies(k, o))
+                out << "treelocker_ops_total{op=\"" << telemetry::opName(k) << "\",outcome=\""
+                    << telemetry::outcomeName(o) << "\"} " << s.outcomes[k][o] << "\n";
+
+    out << "# HELP treelocker_op_latency_seconds Latency of tree locker operations.\n";
+    out << "# TYPE treelocker_op_latency_seconds histogram\n";
+    for (int k = 0; k < telemetry::OP_KINDS; ++k) {
+        const LatencyHistogram& h = s.latencyNs[k];
+        for (uint64_t le : latencyBucketsNs())
+            out << "treelocker_op_latency_seconds_bucket{op=\"" << telemetry::opName(k) << "\",le=\""
+                << le / 1e9 << "\"} " << countAtOrBelow(h, le) << "\n";
+        out << "treelocker_op_latency_seconds_bucket{op=\"" << telemetry::opName(k) << "\",le=\"+Inf\"} " << h.total << "\n";
+        out << "treelocker_op_latency_seconds_sum{op=\"" << telemetry::opName(k) << "\"} " << (double)(h.sum / 1e9) << "\n";
+        out << "treelocker_op_latency_seconds_count{op=\"" << telemetry::opName(k) << "\"} " << h.total << "\n";
+    }
+
+    out << "# HELP treelocker_locked_nodes Nodes currently locked.\n";
+    out << "# TYPE treelocker_locked_nodes gauge\n";
+    out << "treelocker_locked_nodes " << s.lockedNodes() << "\n";
+    out << "# HELP treelocker_locked_nodes_by_level Nodes currently locked, by tree depth.\n";
+    out << "# TYPE treelocker_locked_nodes_by_level gauge\n";
+    for (int d = 0; d < telemetry::MAX_LEVELS; ++d)
+        if (s.lockedByLevel[d] != 0) out << "treelocker_locked_nodes_by_level{level=\"" << d << "\"} " << s.lockedByLevel[d] << "\n";
+
+    out << "# HELP treelocker_upgrade_nodes_visited Nodes inspected per upgrade.\n";
+    out << "# TYPE treelocker_upgrade_nodes_visited summary\n";
+    for (double q : {0.5, 0.99})
+        out << "treelocker_upgrade_nodes_visited{quantile=\"" << q << "\"} " << s.upgradeVisited.percentile(q) << "\n";
+    out << "treelocker_upgrade_nodes_visited_sum " << (double)s.upgradeVisited.sum << "\n";
+    out << "treelocker_upgrade_nodes_visited_count " << s.upgradeVisited.total << "\n";
+#else
+    (void)out;
+#endif
+}
+
+class MetricsServer {
+public:
+    // Adds a gauge sampled on every scrape. Register before start().
+    void addGauge(const std::string& name, const std::string& help, std::function<double()> read) {
+        gauges.push_back(Gauge{name, help, std::move(read)});
+    }
+
+    // Answers requests for 'path' (any method; the body is read up to MAX_BODY) with
+    // what 'handle' returns for the request body. Register before start().
+    void addHandler(const std::string& path, const std::string& contentType,
+                    std::function<std::string(const std::string&)> handle) {
+        handlers.push_back(Handler{path, contentType, std::move(handle)});
+    }
+
+    // Listens on a Unix socket path (removed and recreated) and/or a loopback TCP port.
+    // Pass "" / 0 to skip either. Returns false if no listener could be opened.
+    bool start(const std::string& unixPath, int tcpPort) {
+        if (!unixPath.empty()) {
+            int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+            sockaddr_un addr;
+            memset(&addr, 0, sizeof(addr));
+            addr.sun_family = AF_UNIX;
+            strncpy(addr.sun_path, unixPath.c_str(), sizeof(addr.sun_path) - 1);
+            unlink(unixPath.c_str());
+            if (fd >= 0 && bind(fd, (sockaddr*)&addr, sizeof(addr)) == 0 && listen(fd, 16) == 0) {
+                listeners.push_back(fd);
+                this->unixPath = unixPath;
+            } else if (fd >= 0) {
+                perror("metrics: unix socket");
+                close(fd);
+            }
+        }
+        if (tcpPort > 0) {
+            int fd = socket(AF_INET, SOCK_STREAM, 0);
+            int one = 1;
+            if (fd >= 0) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+            sockaddr_in addr;
+            memset(&addr, 0, sizeof(addr));
+            addr.sin_family = AF_INET;
+            addr.sin_port = htons((uint16_t)tcpPort);
+            addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            if (fd >= 0 && bind(fd, (sockaddr*)&addr, sizeof(addr)) == 0 && listen(fd, 16) == 0) {
+                listeners.push_back(fd);
+            } else if (fd >= 0) {
+                perror("metrics: tcp socket");
+                close(fd);
+            }
+        }
+        if (listeners.empty()) return false;
+        running = true;
+        worker = std::thread([this] { loop(); });
+        return true;
+    }
+
+    void stop() {
+        if (!running.exchange(false)) return;
+        worker.join();
+        for (int fd : listeners) close(fd);
+        listeners.clear();
+        if (!unixPath.empty()) unlink(unixPath.c_str());
+    }
+
+    ~MetricsServer() { stop(); }
+
+    // Full exposition text, also handy for tests and one-off dumps.
+    std::string render() {
+        std::ostringstream out;
+        writeTelemetry(out);
+        for (const Gauge& g : gauges) {
+            out << "# HELP " << g.name << " " << g.help << "\n";
+            out << "# TYPE " << g.name << " gauge\n";
+            out << g.name << " " << g.read() << "\n";
+        }
+        return out.str();
+    }
+
+private:
+    struct Gauge {
+        std::string name, help;
+        std::function<double()> read;
+    };
+
+    struct Handler {
+        std::string path, contentType;
+        std::function<std::string(const std::string&)> handle;
+    };
+
+    static const size_t MAX_HEAD = 8 << 10, MAX_BODY = 1 << 20;
+    static const int REQUEST_MS = 2000; // Per connection from accept(), so a slow client cannot hold the thread.
+
+    std::vector<Gauge> gauges;
+    std::vector<Handler> handlers;
+    std::vector<int> listeners;
+    std::string unixPath;
+    std::atomic<bool> running{false};
+    std::thread worker;
+
+    void loop() {
+        std::vector<pollfd> pfds;
+        for (int fd : listeners) pfds.push_back(pollfd{fd, POLLIN, 0});
+        while (running.load()) {
+            if (poll(pfds.data(), pfds.size(), 200) <= 0) continue;
+            for (pollfd& p : pfds) {
+                if (!(p.revents & POLLIN)) continue;
+                int c = accept(p.fd, nullptr, nullptr);
+                if (c >= 0) serve(c);
+            }
+        }
+    }
+
+    // One request per connection; a path without a handler answers with the metrics page.
+    void serve(int c) {
+        std::chrono::steady_clock::time_point deadline =
+            std::chrono::steady_clock::now() + std::chrono::milliseconds(REQUEST_MS);
+        std::string req, body;
+        size_t headEnd = std::string::npos;
+        while (headEnd == std::string::npos && req.size() < MAX_HEAD && readSome(c, req, deadline))
+            headEnd = req.find("\r\n\r\n");
+        std::string path = requestPath(req);
+        const Handler* h = nullptr;
+        for (const Handler& each : handlers)
+            if (each.path == path) h = &each;
+        std::string status = "200 OK", type = "text/plain; version=0.0.4";
+        if (h && headEnd != std::string::npos) {
+            std::string header = req.substr(0, headEnd);
+            size_t length = contentLength(header);
+            body = req.substr(headEnd + 4);
+            if (body.size() < length && length <= MAX_BODY && strcasestr(header.c_str(), "100-continue")) {
+                static const char cont[] = "HTTP/1.1 100 Continue\r\n\r\n"; // curl asks for larger bodies.
+                ssize_t w = send(c, cont, sizeof(cont) - 1, MSG_NOSIGNAL);
+                (void)w;
+            }
+            bool complete = length <= MAX_BODY;
+            while (complete && body.size() < length) complete = readSome(c, body, deadline);
+            if (!complete) {
+                status = length > MAX_BODY ? "413 Payload Too Large" : "400 Bad Request";
+                body = length > MAX_BODY ? "request body over " + std::to_string(MAX_BODY) + " bytes\n"
+                                         : "request body shorter than its Content-Length\n";
+                type = "text/plain";
+            } else {
+                body = h->handle(body.substr(0, length));
+                type = h->contentType;
+            }
+        } else {
+            body = render();
+        }
+        std::string head = "HTTP/1.0 " + status + "\r\nContent-Type: " + type + "\r\nContent-Length: " +
+                           std::to_string(body.size()) + "\r\nConnection: close\r\n";
+        if (h) head += "Access-Control-Allow-Origin: *\r\n"; // Browser views served from another origin.
+        std::string all = head + "\r\n" + body;
+        long long left = msLeft(deadline);
+        timeval tv = {(time_t)(left / 1000), (suseconds_t)(left % 1000 * 1000)};
+        setsockopt(c, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)); // A client that does not read gets cut off too.
+        size_t off = 0;
+        while (off < all.size()) {
+            ssize_t w = send(c, all.data() + off, all.size() - off, MSG_NOSIGNAL);
+            if (w <= 0) break;
+            off += (size_t)w;
+        }
+        close(c);
+    }
+
+    // Milliseconds until 'deadline', at least 1 (SO_SNDTIMEO reads 0 as no limit).
+    static long long msLeft(std::chrono::steady_clock::time_point deadline) {
+        auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+        return std::max<long long>(1, left.count());
+    }
+
+    // Appends what 'c' has to 'to' before 'deadline'. False on EOF, error or timeout.
+    static bool readSome(int c, std::string& to, std::chrono::steady_clock::time_point deadline) {
+        char buf[4096];
+        pollfd p{c, POLLIN, 0};
+        if (std::chrono::steady_clock::now() >= deadline || poll(&p, 1, (int)msLeft(deadline)) <= 0) return false;
+        ssize_t r = read(c, buf, sizeof(buf));
+        if (r <= 0) return false;
+        to.append(buf, (size_t)r);
+        return true;
+    }
+
+    static std::string requestPath(const std::string& req) {
+        size_t from = req.find(' ');
+        if (from == std::string::npos) return "";
+        size_t to = req.find_first_of(" ?\r\n", from + 1);
+        return req.substr(from + 1, to == std::string::npos ? std::string::npos : to - from - 1);
+    }
+
+    static size_t contentLength(const std::string& head) {
+        for (size_t at = head.find("\r\n"); at != std::string::npos; at = head.find("\r\n", at + 2)) {
+            if (strncasecmp(head.c_str() + at + 2, "Content-Length:", 15) == 0)
+                return (size_t)strtoull(head.c_str() + at + 17, nullptr, 10);
+        }
+        return 0;
+    }
+};
+
+} // namespace metrics
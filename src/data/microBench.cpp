@@ -0,0 +1,250 @@
+#include <vector>
+#include <random>
+#include <algorithm>
+#include <mutex>
+#include <string>
+#include <utility>
+
+#include <benchmark/benchmark.h>
+
+#include "Song_S.h"
+#include "Song_M.h"
+#include "mulSongs.h"
+#include "bulkLoad.h"
+
+using namespace std;
+
+// Per-primitive microbenchmarks for the TreeLocker variants (Google Benchmark).
+// Every case takes three arguments: N (nodes), m (arity) and the locked fraction in
+// permille. The tree is pre-seeded with locks held by uid 1 on random leaves, so
+// ancestor walks see realistic descLocked counters and descendant scans have work.
+//
+//   g++ -std=c++17 -O2 -pthread microBench.cpp -lbenchmark -o microBench
+//   ./microBench --benchmark_filter=HasLockedAncestor
+
+namespace {
+
+const int SAMPLE_NODES = 4096; // Random targets cycled through by each benchmark loop.
+
+// Random leaves for uid 1 until 'permille' of all nodes are covered (or we run out
+// of leaves). Leaves never conflict with each other.
+vector<pair<int, int>> leafLocks(int n, int m, int permille) {
+    long long target = 1LL * n * permille / 1000;
+    int firstLeaf = (n - 2) / m + 1; // Nodes at or past this index have no children.
+    if (n <= 1) firstLeaf = 0;
+    vector<int> leaves;
+    for (int i = firstLeaf; i < n; ++i) leaves.push_back(i);
+    mt19937 rng(7);
+    shuffle(leaves.begin(), leaves.end(), rng);
+    vector<pair<int, int>> locks;
+    for (long long i = 0; i < target && i < (long long)leaves.size(); ++i) locks.emplace_back(leaves[i], 1);
+    return locks;
+}
+
+// Pre-seeds the tree with leafLocks() through the bulk loader.
+template <class TL>
+void seedLocks(TL& tl, int n, int m, int permille) {
+    string error;
+    bulk::load(tl, leafLocks(n, m, permille), error);
+}
+
+// Random leaves, i.e. the longest paths to the root.
+vector<int> sampleLeaves(int n, int m) {
+    int firstLeaf = n <= 1 ? 0 : (n - 2) / m + 1;
+    mt19937 rng(11);
+    uniform_int_distribution<int> pick(firstLeaf, n - 1);
+    vector<int> out(SAMPLE_NODES);
+    for (int& v : out) v = pick(rng);
+    return out;
+}
+
+// Ancestors two levels above random leaves that have locked descendants; falls back
+// to the root when nothing is locked.
+template <class TL>
+vector<int> sampleLockedSubtrees(TL& tl, int n, int m) {
+    vector<int> leaves = sampleLeaves(n, m);
+    vector<int> out;
+    for (int v : leaves) {
+        int u = v;
+        for (int k = 0; k < 2 && u > 0; ++k) u = (u - 1) / m;
+        if (tl.descLocked[u] > 0) out.push_back(u);
+    }
+    if (out.empty()) out.push_back(0);
+    return out;
+}
+
+void treeArgs(benchmark::internal::Benchmark* b) {
+    b->ArgNames({"N", "m", "locked_permille"});
+    b->ArgsProduct({{1 << 10, 1 << 16, 1 << 20}, {2, 4, 16}, {0, 10, 100}});
+}
+
+// ---- getPathToRoot ----
+
+template <class TL>
+void BM_GetPathToRoot(benchmark::State& state) {
+    int n = (int)state.range(0), m = (int)state.range(1);
+    TL tl(n, m);
+    seedLocks(tl, n, m, (int)state.range(2));
+    vector<int> targets = sampleLeaves(n, m);
+    size_t i = 0;
+    for (auto _ : state) {
+        vector<int> path = tl.getPathToRoot(targets[i++ & (SAMPLE_NODES - 1)]);
+        benchmark::DoNotOptimize(path.data());
+    }
+}
+BENCHMARK_TEMPLATE(BM_GetPathToRoot, song_s::TreeLocker)->Apply(treeArgs);
+BENCHMARK_TEMPLATE(BM_GetPathToRoot, song_m::TreeLocker)->Apply(treeArgs);
+
+// ---- acquireSet / acquireLocks (plus the matching release) ----
+
+void BM_AcquireSet_Song_S(benchmark::State& state) {
+    int n = (int)state.range(0), m = (int)state.range(1);
+    song_s::TreeLocker tl(n, m);
+    seedLocks(tl, n, m, (int)state.range(2));
+    vector<int> targets = sampleLeaves(n, m);
+    vector<vector<int>> paths;
+    for (int v : targets) paths.push_back(tl.getPathToRoot(v));
+    size_t i = 0;
+    for (auto _ : state) {
+        const vector<int>& p = paths[i++ & (SAMPLE_NODES - 1)];
+        tl.acquireSet(p);
+        tl.releaseSet(p);
+    }
+}
+BENCHMARK(BM_AcquireSet_Song_S)->Apply(treeArgs);
+
+void BM_AcquireLocks_Song_M(benchmark::State& state) {
+    int n = (int)state.range(0), m = (int)state.range(1);
+    song_m::TreeLocker tl(n, m);
+    seedLocks(tl, n, m, (int)state.range(2));
+    vector<int> targets = sampleLeaves(n, m);
+    vector<vector<int>> paths;
+    for (int v : targets) paths.push_back(tl.getPathToRoot(v));
+    size_t i = 0;
+    for (auto _ : state) {
+        vector<unique_lock<mutex>> locks;
+        tl.acquireLocks(paths[i++ & (SAMPLE_NODES - 1)], locks);
+    }
+}
+BENCHMARK(BM_AcquireLocks_Song_M)->Apply(treeArgs);
+
+// ---- hasLockedAncestor ----
+
+template <class TL>
+void BM_HasLockedAncestor(benchmark::State& state) {
+    int n = (int)state.range(0), m = (int)state.range(1);
+    TL tl(n, m);
+    seedLocks(tl, n, m, (int)state.range(2));
+    vector<int> targets = sampleLeaves(n, m);
+    size_t i = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(tl.hasLockedAncestor(targets[i++ & (SAMPLE_NODES - 1)]));
+    }
+}
+BENCHMARK_TEMPLATE(BM_HasLockedAncestor, song_s::TreeLocker)->Apply(treeArgs);
+BENCHMARK_TEMPLATE(BM_HasLockedAncestor, song_m::TreeLocker)->Apply(treeArgs);
+BENCHMARK_TEMPLATE(BM_HasLockedAncestor, mul_songs::TreeLocker)->Apply(treeArgs);
+
+// ---- addToAncestors / updateAncestorDescLockCount ----
+// Alternates +1 and -1 on the same leaf so the counters stay where the seed left them.
+
+template <class TL>
+void BM_AddToAncestors(benchmark::State& state) {
+    int n = (int)state.range(0), m = (int)state.range(1);
+    TL tl(n, m);
+    seedLocks(tl, n, m, (int)state.range(2));
+    vector<int> targets = sampleLeaves(n, m);
+    size_t i = 0;
+    for (auto _ : state) {
+        int v = targets[(i >> 1) & (SAMPLE_NODES - 1)];
+        tl.addToAncestors(v, (i & 1) ? -1 : 1);
+        ++i;
+    }
+    benchmark::ClobberMemory();
+}
+BENCHMARK_TEMPLATE(BM_AddToAncestors, song_s::TreeLocker)->Apply(treeArgs);
+BENCHMARK_TEMPLATE(BM_AddToAncestors, song_m::TreeLocker)->Apply(treeArgs);
+
+void BM_UpdateAncestorDescLockCount_mulSongs(benchmark::State& state) {
+    int n = (int)state.range(0), m = (int)state.range(1);
+    mul_songs::TreeLocker tl(n, m);
+    seedLocks(tl, n, m, (int)state.range(2));
+    vector<int> targets = sampleLeaves(n, m);
+    size_t i = 0;
+    for (auto _ : state) {
+        int v = targets[(i >> 1) & (SAMPLE_NODES - 1)];
+        tl.updateAncestorDescLockCount(v, (i & 1) ? -1 : 1);
+        ++i;
+    }
+    benchmark::ClobberMemory();
+}
+BENCHMARK(BM_UpdateAncestorDescLockCount_mulSongs)->Apply(treeArgs);
+
+// ---- getDescendants / collectLockedDescendants ----
+// Scans subtrees two levels above random leaves; all seeded locks belong to uid 1,
+// so the scan never short-circuits on a foreign lock.
+
+void BM_GetDescendants_Song_S(benchmark::State& state) {
+    int n = (int)state.range(0), m = (int)state.range(1);
+    song_s::TreeLocker tl(n, m);
+    seedLocks(tl, n, m, (int)state.range(2));
+    vector<int> targets = sampleLockedSubtrees(tl, n, m);
+    size_t i = 0;
+    vector<int> out;
+    for (auto _ : state) {
+        out.clear();
+        bool foreign = false;
+        tl.getDescendants(targets[i++ % targets.size()], 1, out, foreign);
+        benchmark::DoNotOptimize(out.data());
+    }
+}
+BENCHMARK(BM_GetDescendants_Song_S)->Apply(treeArgs);
+
+void BM_CollectLockedDescendants_Song_M(benchmark::State& state) {
+    int n = (int)state.range(0), m = (int)state.range(1);
+    song_m::TreeLocker tl(n, m);
+    seedLocks(tl, n, m, (int)state.range(2));
+    vector<int> targets = sampleLockedSubtrees(tl, n, m);
+    size_t i = 0;
+    vector<int> out;
+    for (auto _ : state) {
+        out.clear();
+        bool foreign = false;
+        tl.collectLockedDescendants(targets[i++ % targets.size()], 1, out, foreign);
+        benchmark::DoNotOptimize(out.data());
+    }
+}
+BENCHMARK(BM_CollectLockedDescendants_Song_M)->Apply(treeArgs);
+
+// ---- bulk::load ----
+// Whole-tree load of leaf locks; 'threads' is the fourth argument.
+
+void BM_BulkLoad(benchmark::State& state) {
+    int n = (int)state.range(0), m = (int)state.range(1), threads = (int)state.range(3);
+    mul_songs::TreeLocker tl(n, m);
+    vector<pair<int, int>> locks = leafLocks(n, m, (int)state.range(2));
+    string error;
+    for (auto _ : state) benchmark::DoNotOptimize(bulk::load(tl, locks, error, threads));
+    state.SetItemsProcessed(state.iterations() * (int64_t)locks.size());
+}
+BENCHMARK(BM_BulkLoad)
+    ->ArgNames({"N", "m", "locked_permille", "threads"})
+    ->ArgsProduct({{1 << 20, 1 << 24}, {2, 4, 16}, {100, 600}, {1, 4}})
+    ->Unit(benchmark::kMillisecond);
+
+// ---- SpinLock::lock / unlock (uncontended, and contended when run with ->Threads) ----
+
+template <class Lock>
+void BM_SpinLockPair(benchmark::State& state) {
+    static Lock lk;
+    for (auto _ : state) {
+        lk.lock();
+        lk.unlock();
+    }
+}
+BENCHMARK_TEMPLATE(BM_SpinLockPair, song_s::SpinLock)->ThreadRange(1, 4);
+BENCHMARK_TEMPLATE(BM_SpinLockPair, mul_songs::SpinLock)->ThreadRange(1, 4);
+
+} // namespace
+
+BENCHMARK_MAIN();
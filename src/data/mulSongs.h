@@ -0,0 +1,289 @@
+#pragma once
+
+#include <vector>
+#include <stack>
+#include <cstddef>
+#include <atomic>
+
+#include "telemetry.h"
+#include "contention.h"
+#include "changeSink.h"
+
+// Global-spinlock variant of the m-ary tree locker, plus the producer/consumer
+// queue its driver uses to hand parsed queries to the worker thread.
+namespace mul_songs {
+
+// --- Thread Safety Primitives ---
+
+// A SpinLock implementation using GCC/Clang compiler intrinsics.
+// This is a low-level lock that repeatedly checks if it can acquire the lock.
+// It's used here because the prompt forbids using standard libraries like <mutex>.
+struct SpinLock {
+    // 'volatile' tells the compiler that this value can change unexpectedly
+    // by another thread. This prevents the compiler from making optimizations
+    // (like caching the value in a register) that might break the lock's logic.
+    volatile int lock_flag;
+
+    // Constructor: Initializes the lock as 'unlocked' (0).
+    SpinLock() : lock_flag(0) {}
+
+    // Acquires the lock. This is a "blocking" call, but it busy-waits.
+    void lock() {
+        // '__sync_lock_test_and_set' is a compiler built-in function that performs
+        // an atomic "test-and-set" operation.
+        // 1. It atomically sets the value of 'lock_flag' to 1.
+        // 2. It returns the *previous* value of 'lock_flag'.
+        // The loop continues ("spins") as long as the previous value was 1,
+        // which means another thread already held the lock.
+        while (__sync_lock_test_and_set(&lock_flag, 1)) {
+            // This is a busy-wait loop. The thread does nothing but check the lock
+            // repeatedly, consuming CPU cycles. This is efficient for very short
+            // lock durations but inefficient if locks are held for a long time.
+        }
+    }
+
+    // Single attempt; true if we now own the lock.
+    bool tryLock() {
+        return !__sync_lock_test_and_set(&lock_flag, 1);
+    }
+
+    // Same as lock(), but returns how many attempts failed before it succeeded.
+    // Used by the contention profiler.
+    unsigned long lockCounting() {
+        unsigned long spins = 0;
+        while (__sync_lock_test_and_set(&lock_flag, 1)) ++spins;
+        return spins;
+    }
+
+    // Releases the lock.
+    void unlock() {
+        // '__sync_lock_release' is a compiler built-in that atomically sets
+        // the lock_flag to 0. It also acts as a memory barrier, ensuring that all
+        // memory writes made by this thread *before* calling unlock() are visible
+        // to other threads *after* they acquire the lock.
+        __sync_lock_release(&lock_flag);
+    }
+};
+
+// --- Query Data Structure ---
+
+// A simple struct to hold the data for a single query.
+// This makes it easy to pass all the necessary information through the queue.
+struct Query {
+    int op;           // The operation type (1: lock, 2: unlock, 3: upgrade).
+    int node_id;      // The integer ID of the node to operate on.
+    int uid;          // The user ID performing the operation.
+    bool is_sentinel = false; // A special flag to signal the end of the query stream.
+};
+
+// --- Custom Thread-Safe Queue ---
+
+// A queue that can be safely accessed by multiple threads (one producer, one consumer).
+// It uses our SpinLock to ensure that only one thread can modify the queue at a time.
+class ThreadSafeQueue {
+private: // Encapsulation: internal data is private.
+    std::vector<Query> data; // The underlying storage for the queue, a dynamic array.
+    size_t head = 0;    // An index pointing to the front of the queue. We don't remove elements, just move the head.
+    SpinLock spinlock;  // The lock to protect access to 'data' and 'head'.
+    std::atomic<size_t> depth{0}; // Pending items, readable by monitoring without taking 'spinlock'.
+
+public:
+    // Pushes a new query to the back of the queue.
+    void push(const Query& q) {
+        spinlock.lock();   // Acquire the lock to prevent other threads from interfering.
+        data.push_back(q); // Add the new query to the end of the vector.
+        depth.store(data.size() - head, std::memory_order_relaxed);
+        spinlock.unlock(); // Release the lock so other threads can use the queue.
+    }
+
+    // Tries to pop a query from the front of the queue.
+    bool pop(Query& q) {
+        spinlock.lock();   // Acquire the lock to get exclusive access.
+        // Check if there are any unread items in the queue (if the head hasn't caught up to the end).
+        if (head < data.size()) {
+            q = data[head];    // Copy the query from the front.
+            head++;            // Move the head forward to the next item. This is faster than erasing.
+            depth.store(data.size() - head, std::memory_order_relaxed);
+            spinlock.unlock(); // Release the lock.
+            return true;       // Return true to indicate a query was successfully popped.
+        }
+        spinlock.unlock(); // Release the lock if the queue was empty.
+        return false;      // Return false to indicate the queue is currently empty.
+    }
+
+    // Number of queued items not yet popped. Never blocks the producer or consumer.
+    size_t size() const {
+        return depth.load(std::memory_order_relaxed);
+    }
+};
+
+// --- Tree Locking Mechanism (Thread-Safe) ---
+
+// This struct manages the state of the tree and all locking operations.
+// It is designed to be thread-safe by using a single SpinLock to protect all its data.
+struct TreeLocker {
+    int n, m;                 // n: number of nodes, m: number of children per node.
+    std::vector<int> parent;       // Stores the parent of each node. Index is node ID, value is parent's ID.
+    std::vector<int> lockedBy;     // Stores the UID of the user who locked a node (0 if unlocked).
+    std::vector<int> descLocked;   // A count of how many *directly* locked descendants each node has.
+    SpinLock spinlock;        // A lock to protect all the vectors above from concurrent access.
+    TL_CONTENTION_MEMBER;     // Per-tree lock statistics, only with TREELOCKER_CONTENTION=1.
+    ChangeSink* sink = nullptr; // Optional observer of successful changes (WAL, replication, ...).
+
+    // Constructor: Initializes the tree structure.
+    TreeLocker(int n_, int m_) : n(n_), m(m_) {
+        // Resize and initialize all vectors.
+        parent.assign(n, -1);     // All nodes start with no parent (-1), except the root.
+        lockedBy.assign(n, 0);    // All nodes start unlocked (locked by UID 0).
+        descLocked.assign(n, 0);  // All nodes start with zero locked descendants.
+
+        // Pre-calculates the parent of every node based on its index in the m-ary tree.
+        // The root is node 0. Node i's parent is at index (i-1)/m.
+        for (int i = 1; i < n; ++i) {
+            parent[i] = (i - 1) / m;
+        }
+        TL_CONTENTION_INIT(n, m); // Node -1 in the profiler stands for this tree-wide spinlock.
+    }
+
+    // Helper function to check if any ancestor of a node is locked.
+    // This must be called only after acquiring the spinlock to ensure consistent reads.
+    bool hasLockedAncestor(int v) {
+        int p = parent[v]; // Start with the immediate parent.
+        while (p != -1) {  // Loop until we reach the root's parent (-1).
+            if (lockedBy[p] != 0) return true; // If an ancestor is locked, return true.
+            p = parent[p]; // Move up to the next ancestor.
+        }
+        return false; // No locked ancestors were found.
+    }
+
+    // Helper function to update the locked-descendant count for all ancestors.
+    // 'delta' is +1 for locking and -1 for unlocking.
+    // This must be called only after acquiring the spinlock.
+    void updateAncestorDescLockCount(int v, int delta) {
+        int p = parent[v]; // Start with the immediate parent.
+        while (p != -1) {  // Loop up to the root.
+            descLocked[p] += delta; // Increment or decrement the ancestor's count.
+            p = parent[p]; // Move to the next ancestor.
+        }
+    }
+
+    // Tries to lock a node for a given user. Returns true on success, false on failure.
+    bool lockNode(int v, int uid) {
+        TL_OP_BEGIN(OP_LOCK, v, uid);
+        TL_SPIN_LOCK(spinlock, -1); // Lock to ensure exclusive access to the tree's state.
+
+        // A node can be locked only if all three conditions are met:
+        // 1. It is not already locked by someone else.
+        // 2. It has no locked ancestors (locking an ancestor locks the whole subtree).
+        // 3. It has no locked descendants (a parent cannot be locked if a child is).
+        if (lockedBy[v] != 0 || hasLockedAncestor(v) || descLocked[v] != 0) {
+            TL_OP_OUTCOME(telemetry::lockFailure(lockedBy[v], descLocked[v]));
+            spinlock.unlock(); // If conditions fail, release the lock.
+            return false;      // Report failure.
+        }
+
+        // If conditions are met, perform the lock operation.
+        lockedBy[v] = uid; // Mark the node as locked by the user.
+        updateAncestorDescLockCount(v, 1); // Increment the locked-descendant count for all its ancestors.
+        TL_LOCK_DELTA(v, m, 1);
+        if (sink) sink->onLock(v, uid); // Still under the lock, so the sink sees changes in order.
+        spinlock.unlock(); // Release the lock.
+        return true;       // Report success.
+    }
+
+    // Tries to unlock a node for a given user. Returns true on success, false on failure.
+    bool unlockNode(int v, int uid) {
+        TL_OP_BEGIN(OP_UNLOCK, v, uid);
+        TL_SPIN_LOCK(spinlock, -1); // Lock for exclusive access.
+
+        // A node can only be unlocked if it was locked by the *same* user.
+        if (lockedBy[v] != uid) {
+            TL_OP_OUTCOME(telemetry::unlockFailure(lockedBy[v]));
+            spinlock.unlock(); // If not locked by this user, release the lock.
+            return false;      // Report failure.
+        }
+
+        // If condition is met, perform the unlock.
+        lockedBy[v] = 0; // Mark the node as unlocked.
+        updateAncestorDescLockCount(v, -1); // Decrement the locked-descendant count for all ancestors.
+        TL_LOCK_DELTA(v, m, -1);
+        if (sink) sink->onUnlock(v, uid);
+        spinlock.unlock(); // Release the lock.
+        return true;       // Report success.
+    }
+
+    // Tries to upgrade a lock on a node for a given user. Returns true on success, false on failure.
+    bool upgradeNode(int v, int uid) {
+        TL_OP_BEGIN(OP_UPGRADE, v, uid);
+        TL_SPIN_LOCK(spinlock, -1); // Lock for exclusive access, as this is a complex operation.
+
+        // Upgrade is possible only if:
+        // 1. The node itself is currently unlocked.
+        // 2. It has no locked ancestors.
+        // 3. It has at least one locked descendant (otherwise, there's nothing to upgrade).
+        if (lockedBy[v] != 0 || hasLockedAncestor(v) || descLocked[v] == 0) {
+            TL_OP_OUTCOME(telemetry::upgradeFailure(lockedBy[v], descLocked[v]));
+            spinlock.unlock(); // If checks fail, release the lock.
+            return false;      // Report failure.
+        }
+
+        std::vector<int> descendantsToUnlock; // To store a list of descendants that need to be unlocked.
+        std::stack<int> nodesToVisit;         // Use a stack for a Depth-First Search (DFS) of the subtree.
+        nodesToVisit.push(v);            // Start the search from the current node 'v'.
+        bool canUpgrade = true;          // A flag to track if the upgrade is permissible.
+
+        // Traverse the descendants to check if they are all locked by the same user 'uid'.
+        // This is a "check-only" phase; no changes are made yet.
+        while (!nodesToVisit.empty()) {
+            int u = nodesToVisit.top(); // Get the next node to check from the stack.
+            nodesToVisit.pop();         // Remove it from the stack.
+            // Calculate the index of the first child of node 'u'.
+            long long firstChild = 1LL * u * m + 1;
+            // Iterate through all possible children of 'u'.
+            for (long long j = 0; j < m; ++j) {
+                long long childIndex = firstChild + j; // Calculate the child's index.
+                if (childIndex >= n) break; // Stop if the child index is out of bounds.
+                int w = static_cast<int>(childIndex); // Convert to int for vector access.
+                TL_VISIT(1);
+
+                if (lockedBy[w] != 0) { // If this child is directly locked...
+                    // ...check if it's locked by a *different* user.
+                    if (lockedBy[w] != uid) {
+                        canUpgrade = false; // If so, the upgrade is not possible.
+                        break;              // Stop checking children.
+                    }
+                    // If locked by the correct user, add it to the list of nodes to unlock later.
+                    descendantsToUnlock.push_back(w);
+                } else if (descLocked[w] > 0) {
+                    // If the child is not locked but has locked descendants, we need to search its subtree.
+                    nodesToVisit.push(w);
+                }
+            }
+            if (!canUpgrade) break; // If we found a violation, exit the main DFS loop.
+        }
+
+        // If the check phase failed, abort the entire operation without making changes.
+        if (!canUpgrade) {
+            TL_OP_FAIL(FOREIGN_DESCENDANT);
+            spinlock.unlock(); // Release the lock.
+            return false;      // Report failure.
+        }
+
+        // If the check passed, proceed to the "modify" phase.
+        // First, unlock all the descendants that were identified.
+        for (int u : descendantsToUnlock) {
+            lockedBy[u] = 0; // Unlock the descendant node.
+            updateAncestorDescLockCount(u, -1); // Update ancestor counts for this unlock operation.
+            TL_LOCK_DELTA(u, m, -1);
+        }
+        // Second, lock the current node itself.
+        lockedBy[v] = uid; // Lock node 'v' for the user.
+        updateAncestorDescLockCount(v, 1); // Update ancestor counts for this lock operation.
+        TL_LOCK_DELTA(v, m, 1);
+        if (sink) sink->onUpgrade(v, uid, descendantsToUnlock);
+        spinlock.unlock(); // Finally, release the lock.
+        return true;       // Report success.
+    }
+};
+
+} // namespace mul_songs
@@ -0,0 +1,141 @@
+#pragma once
+
+// Hardware performance counters around the drivers' phases (load / execute / output).
+// Build with -DTREELOCKER_PERF=1 to enable; otherwise the TL_PERF_* macros are no-ops.
+//
+// Uses perf_event_open directly, counting user-space cycles, instructions, LLC misses
+// and branch misses for this process and every thread it starts afterwards
+// (inherit = 1, so mulSongs' worker thread is included). Counters the kernel refuses
+// (containers, perf_event_paranoid, missing PMU) are reported as "n/a" instead of
+// failing the run; wall time is always reported. Values are scaled by
+// time_enabled / time_running when the PMU had to multiplex.
+
+#ifndef TREELOCKER_PERF
+#define TREELOCKER_PERF 0
+#endif
+
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <ostream>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+namespace perf {
+
+enum { CYCLES = 0, INSTRUCTIONS, LLC_MISSES, BRANCH_MISSES, EVENTS };
+
+inline const char* eventName(int e) {
+    static const char* names[] = {"cycles", "instructions", "llc_misses", "branch_misses"};
+    return names[e];
+}
+
+struct PhaseResult {
+    std::string name;
+    double seconds = 0;
+    uint64_t value[EVENTS] = {};
+    bool valid[EVENTS] = {};
+};
+
+class PhaseCounters {
+public:
+    PhaseCounters() {
+        static const uint64_t configs[EVENTS] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+                                                 PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+        for (int e = 0; e < EVENTS; ++e) {
+            perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = configs[e];
+            attr.disabled = 1;
+            attr.inherit = 1;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+            fds[e] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        }
+    }
+
+    ~PhaseCounters() {
+        for (int e = 0; e < EVENTS; ++e)
+            if (fds[e] >= 0) close(fds[e]);
+    }
+
+    bool anyAvailable() const {
+        for (int e = 0; e < EVENTS; ++e)
+            if (fds[e] >= 0) return true;
+        return false;
+    }
+
+    void begin(const std::string& name) {
+        current = PhaseResult();
+        current.name = name;
+        for (int e = 0; e < EVENTS; ++e) {
+            if (fds[e] < 0) continue;
+            ioctl(fds[e], PERF_EVENT_IOC_RESET, 0);
+            ioctl(fds[e], PERF_EVENT_IOC_ENABLE, 0);
+        }
+        start = std::chrono::steady_clock::now();
+    }
+
+    void end() {
+        for (int e = 0; e < EVENTS; ++e)
+            if (fds[e] >= 0) ioctl(fds[e], PERF_EVENT_IOC_DISABLE, 0);
+        current.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        for (int e = 0; e < EVENTS; ++e) {
+            if (fds[e] < 0) continue;
+            uint64_t buf[3]; // value, time_enabled, time_running
+            if (read(fds[e], buf, sizeof(buf)) != (ssize_t)sizeof(buf) || buf[2] == 0) continue;
+            current.value[e] = buf[2] < buf[1] ? (uint64_t)((double)buf[0] * buf[1] / buf[2]) : buf[0];
+            current.valid[e] = true;
+        }
+        phases.push_back(current);
+    }
+
+    // One line per phase with totals and per-query averages ('queries' may be 0).
+    void report(std::ostream& out, long long queries) const {
+        out << "# perf counters" << (anyAvailable() ? "" : " (unavailable: wall time only)") << "\n";
+        out << "phase,seconds";
+        for (int e = 0; e < EVENTS; ++e) out << "," << eventName(e) << "," << eventName(e) << "_per_query";
+        out << ",ipc\n";
+        for (const PhaseResult& p : phases) {
+            out << p.name << "," << p.seconds;
+            for (int e = 0; e < EVENTS; ++e) {
+                if (!p.valid[e]) {
+                    out << ",n/a,n/a";
+                    continue;
+                }
+                out << "," << p.value[e] << "," << (queries > 0 ? (double)p.value[e] / queries : 0.0);
+            }
+            if (p.valid[CYCLES] && p.valid[INSTRUCTIONS] && p.value[CYCLES] > 0)
+                out << "," << (double)p.value[INSTRUCTIONS] / p.value[CYCLES] << "\n";
+            else
+                out << ",n/a\n";
+        }
+    }
+
+private:
+    int fds[EVENTS];
+    PhaseResult current;
+    std::vector<PhaseResult> phases;
+    std::chrono::steady_clock::time_point start;
+};
+
+} // namespace perf
+
+#if TREELOCKER_PERF
+#define TL_PERF_INIT() perf::PhaseCounters tlPerf_
+#define TL_PERF_BEGIN(name) tlPerf_.begin(name)
+#define TL_PERF_END() tlPerf_.end()
+#define TL_PERF_REPORT(out, queries) tlPerf_.report((out), (queries))
+#else
+#define TL_PERF_INIT() ((void)0)
+#define TL_PERF_BEGIN(name) ((void)0)
+#define TL_PERF_END() ((void)0)
+#define TL_PERF_REPORT(out, queries) ((void)0)
+#endif
@@ -0,0 +1,283 @@
+#pragma once
+
+// Memory-mapped persistent TreeLocker state, so a restart does not rebuild the
+// name map or lose the locks.
+//
+// The file holds a versioned header, lockedBy[n], descLocked[n] and a read-only
+// name index (open-addressing hash table over a names blob). The state file is a
+// ChangeSink: with 'tl.sink = &state' every successful change is written through
+// into the mapping from inside the operation's critical section. Ancestor counters
+// are updated with atomic adds because variants with per-node locks report changes
+// on disjoint subtrees concurrently.
+//
+// The header carries a 'clean' flag that is cleared while the file is in use and
+// set by close() after msync. On restart a clean file is trusted and served at
+// once; the full consistency check (descLocked recomputed from lockedBy, every
+// name resolving to its node) then runs on a background thread, and a failed check
+// leaves the file marked unclean for the next restart. A file that was
+// not closed cleanly has descLocked rebuilt from lockedBy before serving, since a
+// crash can interrupt the ancestor updates of one change.
+//
+// Layout (all sections 64-byte aligned):
+//   Header | lockedBy int32[n] | descLocked int32[n] | nameOffsets uint64[n+1]
+//   | slots uint32[capacity] (id + 1, 0 = empty) | names blob
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "changeSink.h"
+#include "bulkLoad.h"  // countDescendants.
+
+namespace pstate {
+
+const uint32_t VERSION = 1;
+
+struct Header {
+    char magic[8];        // "TLSTATE1"
+    uint32_t version;
+    int32_t n, m;
+    uint32_t clean;       // 1 once close() has synced everything.
+    uint64_t capacity;    // Hash slots, a power of two.
+    uint64_t namesBytes;
+    uint64_t lockedByOff, descLockedOff, offsetsOff, slotsOff, namesOff, fileBytes;
+};
+
+inline uint64_t align64(uint64_t x) { return (x + 63) & ~63ull; }
+
+inline uint64_t hashName(const char* s, size_t len) {
+    uint64_t h = 1469598103934665603ull; // FNV-1a
+    for (size_t i = 0; i < len; ++i) h = (h ^ (uint8_t)s[i]) * 1099511628211ull;
+    return h;
+}
+
+class StateFile : public ChangeSink {
+public:
+    ~StateFile() { close(); }
+
+    // Creates 'path' for a fresh tree with every node unlocked.
+    bool create(const std::string& path, int n, int m, const std::vector<std::string>& names, std::string& error) {
+        Header h;
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, "TLSTATE1", 8);
+        h.version = VERSION;
+        h.n = n;
+        h.m = m;
+        h.capacity = 16;
+        while (h.capacity < 2 * (uint64_t)n) h.capacity <<= 1;
+        for (const std::string& s : names) h.namesBytes += s.size();
+        h.lockedByOff = align64(sizeof(Header));
+        h.descLockedOff = align64(h.lockedByOff + 4ull * n);
+        h.offsetsOff = align64(h.descLockedOff + 4ull * n);
+        h.slotsOff = align64(h.offsetsOff + 8ull * (n + 1));
+        h.namesOff = align64(h.slotsOff + 4ull * h.capacity);
+        h.fileBytes = align64(h.namesOff + h.namesBytes);
+
+        std::string tmp = path + ".tmp";
+        int fd = ::open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0 || ftruncate(fd, (off_t)h.fileBytes) != 0) {
+            error = "cannot create " + tmp;
+            if (fd >= 0) ::close(fd);
+            return false;
+        }
+        char* base = (char*)mmap(nullptr, h.fileBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (base == MAP_FAILED) {
+            error = "cannot map " + tmp;
+            return false;
+        }
+        memcpy(base, &h, sizeof(h)); // The arrays start zeroed: everything unlocked.
+        uint64_t* offsets = (uint64_t*)(base + h.offsetsOff);
+        uint32_t* slots = (uint32_t*)(base + h.slotsOff);
+        char* blob = base + h.namesOff;
+        uint64_t off = 0;
+        for (int i = 0; i < n; ++i) {
+            offsets[i] = off;
+            memcpy(blob + off, names[i].data(), names[i].size());
+            off += names[i].size();
+            // A repeated name maps to its last occurrence, as in the drivers' unordered_map.
+            uint64_t s = hashName(names[i].data(), names[i].size()) & (h.capacity - 1);
+            while (slots[s] != 0 && names[slots[s] - 1] != names[i]) s = (s + 1) & (h.capacity - 1);
+            slots[s] = (uint32_t)i + 1;
+        }
+        offsets[n] = off;
+        ((Header*)base)->clean = 1;
+        msync(base, h.fileBytes, MS_SYNC);
+        munmap(base, h.fileBytes);
+        // Publish the finished file in one step, so a crash never leaves half an index.
+        if (rename(tmp.c_str(), path.c_str()) != 0) {
+            error = "cannot rename " + tmp;
+            return false;
+        }
+        return open(path, error);
+    }
+
+    // Maps an existing state file. Afterwards wasClean() says whether descLocked
+    // can be trusted as is.
+    bool open(const std::string& path, std::string& error) {
+        int fd = ::open(path.c_str(), O_RDWR);
+        if (fd < 0) {
+            error = "cannot open " + path;
+            return false;
+        }
+        struct stat st;
+        Header h;
+        if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(h) || pread(fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h) ||
+            memcmp(h.magic, "TLSTATE1", 8) != 0 || h.version != VERSION || h.fileBytes != (uint64_t)st.st_size) {
+            error = path + ": not a state file of version " + std::to_string(VERSION);
+            ::close(fd);
+            return false;
+        }
+        base = (char*)mmap(nullptr, h.fileBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (base == MAP_FAILED) {
+            base = nullptr;
+            error = "cannot map " + path;
+            return false;
+        }
+        bytes = h.fileBytes;
+        header = (Header*)base;
+        clean = header->clean == 1;
+        header->clean = 0; // In use from now on; only close() marks it clean again.
+        msync(base, 4096, MS_SYNC);
+        return true;
+    }
+
+    int n() const { return header->n; }
+    int m() const { return header->m; }
+    bool wasClean() const { return clean; }
+    int32_t* lockedBy() { return (int32_t*)(base + header->lockedByOff); }
+    int32_t* descLocked() { return (int32_t*)(base + header->descLockedOff); }
+
+    // Whether node 'i' is stored under the name 's'.
+    bool nameIs(int i, const std::string& s) const {
+        const uint64_t* offsets = (const uint64_t*)(base + header->offsetsOff);
+        return offsets[i + 1] - offsets[i] == s.size() && memcmp(base + header->namesOff + offsets[i], s.data(), s.size()) == 0;
+    }
+
+    // Node id for a name, or -1. Reads only the mapping; no per-restart index build.
+    int lookup(const char* s, size_t len) const {
+        const uint64_t* offsets = (const uint64_t*)(base + header->offsetsOff);
+        const uint32_t* slots = (const uint32_t*)(base + header->slotsOff);
+        const char* blob = base + header->namesOff;
+        uint64_t mask = header->capacity - 1;
+        for (uint64_t i = hashName(s, len) & mask; slots[i] != 0; i = (i + 1) & mask) {
+            uint32_t id = slots[i] - 1;
+            if (offsets[id + 1] - offsets[id] == len && memcmp(blob + offsets[id], s, len) == 0) return (int)id;
+        }
+        return -1;
+    }
+
+    // Loads the mapped state into a freshly built TreeLocker of the same shape,
+    // rebuilding descLocked first if the last run did not close the file.
+    template <class TL>
+    void loadInto(TL& tl) {
+        int nn = n();
+        if (!clean) bulk::countDescendants(lockedBy(), descLocked(), nn, m());
+        tl.lockedBy.assign(lockedBy(), lockedBy() + nn);
+        tl.descLocked.assign(descLocked(), descLocked() + nn);
+    }
+
+    // Starts the full consistency check on a copy of the state as loaded. 'done'
+    // receives the verdict and a description of the first problem found.
+    template <class Done>
+    void checkInBackground(Done done) {
+        std::vector<int32_t> locked(lockedBy(), lockedBy() + n()), desc(descLocked(), descLocked() + n());
+        checker = std::thread([this, locked, desc, done]() mutable {
+            std::string problem = verify(locked, desc);
+            if (cancelCheck) return;
+            if (!problem.empty()) checkFailed = true; // Next restart rebuilds instead of trusting it.
+            done(problem.empty(), problem);
+        });
+    }
+
+    void onLock(int v, int uid) override {
+        lockedBy()[v] = uid;
+        addToAncestors(v, 1);
+    }
+
+    void onUnlock(int v, int) override {
+        lockedBy()[v] = 0;
+        addToAncestors(v, -1);
+    }
+
+    void onUpgrade(int v, int uid, const std::vector<int>& unlocked) override {
+        for (int u : unlocked) {
+            lockedBy()[u] = 0;
+            addToAncestors(u, -1);
+        }
+        lockedBy()[v] = uid;
+        addToAncestors(v, 1);
+    }
+
+    // Syncs the mapping and marks the file clean. Writers must have stopped. A
+    // consistency check still running is abandoned without a verdict.
+    void close() {
+        cancelCheck = true;
+        if (checker.joinable()) checker.join();
+        if (!base) return;
+        msync(base, bytes, MS_SYNC);
+        header->clean = checkFailed ? 0 : 1;
+        msync(base, 4096, MS_SYNC);
+        munmap(base, bytes);
+        base = nullptr;
+    }
+
+    // Unmaps a file that was opened but is not going to be used (it does not
+    // match the input), with its clean flag as found, so it is left as it was.
+    void abandon() {
+        if (!base) return;
+        header->clean = clean ? 1 : 0;
+        msync(base, 4096, MS_SYNC);
+        munmap(base, bytes);
+        base = nullptr;
+    }
+
+private:
+    char* base = nullptr;
+    uint64_t bytes = 0;
+    Header* header = nullptr;
+    bool clean = false;
+    std::thread checker;
+    std::atomic<bool> cancelCheck{false}, checkFailed{false};
+
+    void addToAncestors(int v, int delta) {
+        int32_t* desc = descLocked();
+        int mm = m();
+        while (v > 0) {
+            v = (v - 1) / mm;
+            __atomic_fetch_add(&desc[v], delta, __ATOMIC_RELAXED);
+        }
+    }
+
+    std::string verify(const std::vector<int32_t>& locked, const std::vector<int32_t>& desc) const {
+        int nn = n();
+        std::vector<int32_t> expect(nn);
+        bulk::countDescendants(locked.data(), expect.data(), nn, m());
+        for (int i = 0; i < nn; ++i)
+            if (expect[i] != desc[i])
+                return "descLocked[" + std::to_string(i) + "] is " + std::to_string(desc[i]) + ", expected " +
+                       std::to_string(expect[i]);
+        const uint64_t* offsets = (const uint64_t*)(base + header->offsetsOff);
+        const char* blob = base + header->namesOff;
+        for (int i = 0; i < nn && !cancelCheck; ++i) {
+            if (offsets[i + 1] < offsets[i] || offsets[i + 1] > header->namesBytes)
+                return "name " + std::to_string(i) + " lies outside the names blob";
+            uint64_t len = offsets[i + 1] - offsets[i];
+            int id = lookup(blob + offsets[i], len);
+            if (id < i || offsets[id + 1] - offsets[id] != len || memcmp(blob + offsets[id], blob + offsets[i], len) != 0)
+                return "name of node " + std::to_string(i) + " does not resolve";
+        }
+        return "";
+    }
+};
+
+} // namespace pstate
@@ -0,0 +1,140 @@
+#include <iostream>
+#include <vector>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <chrono>
+
+#include "captureLog.h"
+#include "latencyHistogram.h"
+#include "variants.h"
+
+using namespace std;
+
+// Replays a capture log (mulSongs / loadDriver --capture) against any TreeLocker
+// variant, to reproduce a recorded incident offline and compare fixes on the exact
+// same traffic:
+//   ./replay --log incident.tlcap --variant Song_S --threads 4 --mode paced --speed 1
+//
+// --mode fast   issue every op as soon as the previous one on its thread returns;
+//               latency is service time.
+// --mode paced  issue every op at its recorded arrival time (scaled by 1/--speed);
+//               latency is measured from that intended time, as in loadDriver, so
+//               a stall shows up as queueing on the ops behind it.
+//
+// Recorded thread t is replayed on thread t % --threads, keeping each recorded
+// thread's order. A log captured by a single thread is dealt round-robin instead,
+// so --threads still adds concurrency.
+
+typedef chrono::steady_clock Clock;
+
+struct ReplayResult {
+    double seconds = 0;
+    long long ops = 0, succeeded = 0;
+    uint64_t maxBehindNs = 0; // Paced mode: worst lateness when an op was issued.
+    LatencyHistogram hist;
+};
+
+template <class TL>
+ReplayResult replay(TL& tl, const vector<vector<capture::Entry>>& perThread, bool paced, double speed) {
+    int threads = (int)perThread.size();
+    vector<LatencyHistogram> hist(threads);
+    vector<long long> succeeded(threads, 0);
+    vector<uint64_t> behind(threads, 0);
+
+    Clock::time_point start = Clock::now() + chrono::milliseconds(10);
+    auto worker = [&](int t) {
+        LatencyHistogram& h = hist[t];
+        Clock::time_point now = Clock::now();
+        while (now < start) now = Clock::now();
+        for (const capture::Entry& e : perThread[t]) {
+            Clock::time_point from = Clock::now();
+            if (paced) {
+                Clock::time_point intended = start + chrono::nanoseconds((long long)(e.tsNs / speed));
+                while (from < intended) from = Clock::now();
+                behind[t] = max(behind[t], (uint64_t)chrono::duration_cast<chrono::nanoseconds>(from - intended).count());
+                from = intended;
+            }
+            if (applyOp(tl, e.op, e.node, e.uid)) ++succeeded[t];
+            h.record((uint64_t)chrono::duration_cast<chrono::nanoseconds>(Clock::now() - from).count());
+        }
+    };
+
+    vector<thread> pool;
+    for (int t = 0; t < threads; ++t) pool.emplace_back(worker, t);
+    for (auto& th : pool) th.join();
+
+    ReplayResult r;
+    r.seconds = chrono::duration<double>(Clock::now() - start).count();
+    for (int t = 0; t < threads; ++t) {
+        r.hist.merge(hist[t]);
+        r.ops += (long long)perThread[t].size();
+        r.succeeded += succeeded[t];
+        r.maxBehindNs = max(r.maxBehindNs, behind[t]);
+    }
+    return r;
+}
+
+int main(int argc, char** argv) {
+    string logPath, variant = "Song_M", mode = "fast";
+    int threads = 1;
+    double speed = 1.0;
+    for (int i = 1; i < argc; ++i) {
+        string key = argv[i];
+        if (i + 1 >= argc) {
+            cerr << "missing value for " << key << "\n";
+            return 1;
+        }
+        string val = argv[++i];
+        if (key == "--log") logPath = val;
+        else if (key == "--variant") variant = val;
+        else if (key == "--threads") threads = max(1, stoi(val));
+        else if (key == "--mode") mode = val;
+        else if (key == "--speed") speed = stod(val);
+        else {
+            logPath.clear();
+            break;
+        }
+    }
+    if (logPath.empty() || (mode != "fast" && mode != "paced") || speed <= 0) {
+        cerr << "usage: " << argv[0] << " --log PATH [--variant Song_S|Song_M|mulSongs] [--threads T]\n"
+             << "  [--mode fast|paced] [--speed X]\n";
+        return 1;
+    }
+
+    capture::Header h;
+    vector<capture::Entry> entries;
+    string error;
+    if (!capture::readLog(logPath, h, entries, error)) {
+        cerr << error << "\n";
+        return 1;
+    }
+
+    uint32_t maxTid = 0;
+    for (const capture::Entry& e : entries) maxTid = max(maxTid, e.tid);
+    vector<vector<capture::Entry>> perThread(threads);
+    for (size_t i = 0; i < entries.size(); ++i) {
+        const capture::Entry& e = entries[i];
+        if (e.node < 0 || e.node >= h.n) {
+            cerr << logPath << ": node " << e.node << " outside the recorded " << h.n << "-node tree\n";
+            return 1;
+        }
+        perThread[maxTid == 0 ? i % threads : e.tid % threads].push_back(e);
+    }
+
+    ReplayResult r;
+    bool known = withVariant(variant, h.n, h.m, [&](auto& tl) { r = replay(tl, perThread, mode == "paced", speed); });
+    if (!known) {
+        cerr << "unknown variant " << variant << "\n";
+        return 1;
+    }
+
+    double recorded = entries.empty() ? 0 : entries.back().tsNs / 1e9;
+    cout << "variant,threads,mode,speed,ops,succeeded,recorded_seconds,replay_seconds,ops_per_sec,"
+            "p50_ns,p99_ns,p999_ns,max_ns,max_behind_ns\n";
+    cout << variant << "," << threads << "," << mode << "," << speed << "," << r.ops << "," << r.succeeded << ","
+         << recorded << "," << r.seconds << "," << (r.seconds > 0 ? r.ops / r.seconds : 0) << ","
+         << r.hist.percentile(0.50) << "," << r.hist.percentile(0.99) << "," << r.hist.percentile(0.999) << ","
+         << r.hist.max() << "," << r.maxBehindNs << "\n";
+    return 0;
+}
@@ -0,0 +1,566 @@
+#pragma once
+
+// Leader/follower replication of the lock state, for read scaling and failover.
+//
+// Every replica is a lockServer with a full TreeLocker of its own and a
+// replication socket (--replicas lists them all, in index order; --replica picks
+// this one). One replica leads and takes the changes. Its ChangeSink encodes every
+// successful change as a WAL record (wal::encode, numbered by LSN) under a short
+// mutex, from inside the op's critical section, so the record order is a valid
+// serial order. A replication thread sends what has accumulated to every follower
+// as one batch each --repl-interval-us, or at once when a committer is waiting.
+// Followers apply the batches in order and acknowledge the LSN they reached. A
+// follower that joins first gets a snapshot: the (node, uid) pairs locked as of
+// some LSN, from a map the sink keeps up to date. It skips batch records below
+// that LSN.
+//
+// Followers answer the reads (ops 4-6) from their own copy and refuse changes with
+// NOT_LEADER. Batches double as heartbeats, so each one stamps the follower's state
+// as current when it arrives: a follower answers reads only while its last batch
+// is at most --max-staleness-ms old, and STALE after that. With --sync-replicas K
+// the leader's loops hold back acknowledgements until min(K, replicas - 1)
+// followers have applied the changes, so an acknowledged change survives the loss
+// of the leader. While fewer followers are attached, acknowledgements wait for
+// more to join.
+//
+// A follower that hears nothing for --failover-ms, or loses the connection, holds
+// an election. It probes every replica socket and follows one that answers as
+// leader. Failing that, the live replica with the highest applied LSN (lowest
+// index on ties) promotes itself, and the others find it on their next probe,
+// 100 ms later. Replicas start the same way, so the first one up leads and the
+// later ones, including a restarted former leader, join as followers. State lives
+// in memory only; a replica that restarts catches up through a snapshot. There are
+// no terms: a leader that stalls for longer than --failover-ms without exiting can
+// come back next to its successor. This is meant for processes on one host that
+// fail by exiting. Clients find the leader by trying the replicas' own sockets
+// until a change is not refused with NOT_LEADER.
+//
+//   R=--replicas /tmp/r0.repl,/tmp/r1.repl,/tmp/r2.repl
+//   ./lockServer --n 1000000 --m 4 $R --replica 0 --sync-replicas 1 --unix /tmp/r0.sock
+//   ./lockServer --n 1000000 --m 4 $R --replica 1 --sync-replicas 1 --unix /tmp/r1.sock
+//   ./lockServer --n 1000000 --m 4 $R --replica 2 --sync-replicas 1 --unix /tmp/r2.sock
+//
+// Messages on a replication socket: uint8 type | uint32 payload length | payload.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "variants.h"
+#include "lockProtocol.h"
+#include "lockClient.h"
+#include "wal.h"
+
+namespace repl {
+
+enum MessageType : uint8_t {
+    LEADER = 'L',   // Answer to a connection from the leader; a snapshot and batches follow.
+    FOLLOWER = 'F', // Answer from any other replica: uint64 applied LSN, then EOF.
+    SNAPSHOT = 'S', // uint64 LSN | uint32 count | count x (uint32 node, int32 uid)
+    BATCH = 'B',    // uint64 LSN of the first record | WAL records. Empty: a heartbeat.
+    ACK = 'A',      // Follower to leader: uint64 LSN applied.
+};
+
+inline void putU64(std::string& out, uint64_t v) {
+    proto::putU32(out, (uint32_t)v);
+    proto::putU32(out, (uint32_t)(v >> 32));
+}
+
+inline uint64_t getU64(const char* p) { return proto::getU32(p) | (uint64_t)proto::getU32(p + 4) << 32; }
+
+inline void putMessage(std::string& out, uint8_t type, const std::string& payload) {
+    out.push_back((char)type);
+    proto::putU32(out, (uint32_t)payload.size());
+    out += payload;
+}
+
+// Takes one complete message off the front of 'buf', if there is one.
+inline bool takeMessage(std::string& buf, uint8_t& type, std::string& payload) {
+    if (buf.size() < 5) return false;
+    size_t len = proto::getU32(buf.data() + 1);
+    if (buf.size() < 5 + len) return false;
+    type = (uint8_t)buf[0];
+    payload.assign(buf, 5, len);
+    buf.erase(0, 5 + len);
+    return true;
+}
+
+// Reads until 'buf' holds a complete message. False on EOF, error, or 'timeoutMs'
+// without any data.
+inline bool readMessage(int fd, std::string& buf, uint8_t& type, std::string& payload, int timeoutMs) {
+    char chunk[64 << 10];
+    while (!takeMessage(buf, type, payload)) {
+        pollfd p = {fd, POLLIN, 0};
+        int r = poll(&p, 1, timeoutMs);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return false;
+        ssize_t got = recv(fd, chunk, sizeof(chunk), 0);
+        if (got <= 0) return false;
+        buf.append(chunk, (size_t)got);
+    }
+    return true;
+}
+
+inline bool sendAll(int fd, const std::string& data) {
+    for (size_t off = 0; off < data.size();) {
+        ssize_t w = send(fd, data.data() + off, data.size() - off, MSG_NOSIGNAL);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return false;
+        off += (size_t)w;
+    }
+    return true;
+}
+
+struct Options {
+    std::vector<std::string> peers; // Replication sockets of all replicas, in index order.
+    int index = 0;                  // This replica.
+    int syncReplicas = 0;           // Followers that must apply a change before it is acknowledged.
+    int intervalUs = 1000;          // Batch and heartbeat interval.
+    int failoverMs = 1000;          // Silence after which a follower gives up on its leader.
+    int maxStalenessMs = 100;       // Followers refuse reads when their last batch is older.
+    int stopFd = -1;                // Optional: readable once the server shuts down; ends commit() waits.
+};
+
+template <class TL>
+class Replica : public ChangeSink, public Committer {
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    // 'tl' must be fresh, with no sink; the replica attaches itself on promotion.
+    Replica(TL& tl, const Options& o) : tl(tl), opt(o) {}
+    Replica(const Replica&) = delete;
+    Replica& operator=(const Replica&) = delete;
+    ~Replica() { stop(); }
+
+    // Listens on this replica's socket and starts following, or leading.
+    bool start(std::string& error) {
+        const std::string& path = opt.peers[opt.index];
+        unlink(path.c_str());
+        listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+        if (listenFd < 0 || bind(listenFd, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(listenFd, 64) != 0) {
+            error = "cannot listen on " + path;
+            return false;
+        }
+        kickFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        lastHeard = Clock::now() - std::chrono::hours(1); // Nothing to read from yet.
+        running = true;
+        server = std::thread([this] { serveReplicas(); });
+        follower = std::thread([this] { followLeaders(); });
+        return true;
+    }
+
+    void stop() {
+        if (!running.exchange(false)) return;
+        kick();
+        {
+            std::lock_guard<std::mutex> g(fdMx);
+            if (leaderFd >= 0) shutdown(leaderFd, SHUT_RDWR);
+        }
+        {
+            std::lock_guard<std::mutex> g(mx);
+            acked.notify_all();
+        }
+        server.join();
+        follower.join();
+        close(listenFd);
+        close(kickFd);
+        unlink(opt.peers[opt.index].c_str());
+    }
+
+    bool leader() const { return leading.load(std::memory_order_acquire); }
+
+    // LSN of the next change: appended on the leader, applied on a follower.
+    uint64_t lsn() {
+        std::lock_guard<std::mutex> g(mx);
+        return leader() ? appended : applied.load();
+    }
+
+    uint8_t serve(const proto::Request& q) {
+        if (q.op < 1 || q.op > 6 || q.node >= (uint32_t)tl.n || (q.uid == 0 && q.op != 4 && q.op != 5))
+            return proto::BAD_REQUEST;
+        int v = (int)q.node;
+        if (leader())
+            return (q.op <= 3 ? applyOp(tl, q.op, v, q.uid) : readOp(tl, q.op, v, q.uid)) ? proto::TRUE
+                                                                                            : proto::FALSE;
+        if (q.op <= 3) return proto::NOT_LEADER;
+        std::shared_lock<std::shared_mutex> g(stateMx);
+        if (Clock::now() - lastHeard > std::chrono::milliseconds(opt.maxStalenessMs)) return proto::STALE;
+        return readOp(tl, q.op, v, q.uid) ? proto::TRUE : proto::FALSE;
+    }
+
+    void onLock(int v, int uid) override {
+        const std::string& rec = encode(wal::LOCK, v, uid, nullptr);
+        std::lock_guard<std::mutex> g(mx);
+        append(rec);
+        held[v] = uid;
+    }
+
+    void onUnlock(int v, int uid) override {
+        const std::string& rec = encode(wal::UNLOCK, v, uid, nullptr);
+        std::lock_guard<std::mutex> g(mx);
+        append(rec);
+        held.erase(v);
+    }
+
+    void onUpgrade(int v, int uid, const std::vector<int>& unlocked) override {
+        const std::string& rec = encode(wal::UPGRADE, v, uid, &unlocked);
+        std::lock_guard<std::mutex> g(mx);
+        append(rec);
+        for (int u : unlocked) held.erase(u);
+        held[v] = uid;
+    }
+
+    // Blocks until min(--sync-replicas, replicas - 1) followers have applied every
+    // change appended so far, waiting for followers to attach if too few are. A
+    // no-op without --sync-replicas and on followers. False if the replica stops
+    // first.
+    bool commit() override {
+        if (opt.syncReplicas <= 0 || !leader()) return true;
+        std::unique_lock<std::mutex> g(mx);
+        uint64_t target = appended;
+        if (synced() >= target) return true;
+        urgent = true;
+        kick();
+        acked.wait(g, [&] { return synced() >= target || !running || stopping; });
+        return synced() >= target;
+    }
+
+private:
+    // A follower, seen from the leader's replication thread.
+    struct Link {
+        int fd;
+        std::string in;
+        uint64_t acked;
+        Clock::time_point heard;
+    };
+
+    TL& tl;
+    Options opt;
+    int listenFd = -1, kickFd = -1;
+    std::atomic<bool> running{false}, leading{false};
+    std::thread server, follower;
+
+    std::mutex mx; // Guards the leader's fields below.
+    std::condition_variable acked;
+    std::string active;                 // Encoded records not yet sent.
+    uint64_t appended = 0, sentLsn = 0; // LSNs: next to assign, first in 'active'.
+    std::unordered_map<int, int> held;  // Locked node -> uid, as of 'appended'.
+    std::vector<uint64_t> ackedLsns;    // Per follower, refreshed by the replication thread.
+    bool urgent = false;
+    bool stopping = false;              // The server is shutting down: commit() stops waiting.
+
+    std::shared_mutex stateMx;          // Follower: applying (exclusive) against reads (shared).
+    std::atomic<uint64_t> applied{0};   // Follower: LSN of the next record to apply.
+    Clock::time_point lastHeard;        // Follower: arrival of the last batch.
+    std::mutex fdMx;
+    int leaderFd = -1;                  // Follower: connection to the leader, for stop().
+
+    void kick() {
+        uint64_t one = 1;
+        ssize_t w = write(kickFd, &one, sizeof(one));
+        (void)w;
+    }
+
+    static const std::string& encode(int type, int v, int uid, const std::vector<int>* unlocked) {
+        thread_local std::string rec; // Encoded before taking the lock, reusing its capacity.
+        rec.clear();
+        wal::encode(rec, type, v, uid, unlocked);
+        return rec;
+    }
+
+    void append(const std::string& rec) {
+        active += rec;
+        ++appended;
+        if (active.size() >= (4u << 20)) { // Do not let a burst grow unbounded.
+            urgent = true;
+            kick();
+        }
+    }
+
+    // The LSN below which the required number of followers have everything; 0
+    // while fewer than that are attached. Caller holds mx.
+    uint64_t synced() const {
+        size_t k = std::min<size_t>((size_t)opt.syncReplicas, opt.peers.size() - 1);
+        if (k == 0) return appended;
+        if (ackedLsns.size() < k) return 0;
+        std::vector<uint64_t> lsns = ackedLsns;
+        std::nth_element(lsns.begin(), lsns.begin() + (k - 1), lsns.end(), std::greater<uint64_t>());
+        return lsns[k - 1];
+    }
+
+    // The replication thread: answers probes and, while leading, feeds followers.
+    void serveReplicas() {
+        std::vector<Link> links;
+        bool stopSeen = false;
+        std::string batch, msg, payload;
+        Clock::time_point nextBatch = Clock::now();
+        std::chrono::microseconds interval(std::max(1, opt.intervalUs));
+        char chunk[4096];
+        while (running) {
+            std::vector<pollfd> p = {{listenFd, POLLIN, 0}, {kickFd, POLLIN, 0}};
+            for (Link& l : links) p.push_back(pollfd{l.fd, POLLIN, 0});
+            p.push_back(pollfd{stopSeen ? -1 : opt.stopFd, POLLIN, 0}); // Ignored while -1.
+            auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(nextBatch - Clock::now()).count();
+            if (poll(p.data(), p.size(), (int)std::max<long long>(0, std::min<long long>(wait + 1, 100))) < 0 &&
+                errno != EINTR)
+                break;
+            if (p[1].revents & POLLIN) {
+                uint64_t n;
+                ssize_t r = read(kickFd, &n, sizeof(n));
+                (void)r;
+            }
+            if (p.back().revents & POLLIN) stopSeen = true; // Left unread: the loops watch it too.
+            if (p[0].revents & POLLIN) {
+                int fd = accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+                if (fd >= 0) welcome(fd, links);
+            }
+            Clock::time_point now = Clock::now();
+            for (size_t i = 0; i < links.size(); ++i) {
+                Link& l = links[i];
+                if (!(p[i + 2].revents & (POLLIN | POLLHUP | POLLERR)) || l.fd < 0) continue;
+                ssize_t r = recv(l.fd, chunk, sizeof(chunk), MSG_DONTWAIT);
+                if (r <= 0) {
+                    if (r == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) drop(l);
+                    continue;
+                }
+                l.in.append(chunk, (size_t)r);
+                uint8_t type;
+                while (takeMessage(l.in, type, payload))
+                    if (type == ACK && payload.size() == 8) {
+                        l.acked = getU64(payload.data());
+                        l.heard = now;
+                    }
+            }
+
+            if (leader()) {
+                bool send = now >= nextBatch;
+                uint64_t first = 0;
+                {
+                    std::lock_guard<std::mutex> g(mx);
+                    send = send || urgent;
+                    if (send) {
+                        batch.swap(active);
+                        active.clear();
+                        first = sentLsn;
+                        sentLsn = appended;
+                        urgent = false;
+                    }
+                }
+                if (send) {
+                    payload.clear();
+                    putU64(payload, first);
+                    payload += batch;
+                    msg.clear();
+                    putMessage(msg, BATCH, payload);
+                    for (Link& l : links)
+                        if (l.fd >= 0 && !sendAll(l.fd, msg)) drop(l);
+                    nextBatch = now + interval;
+                }
+            }
+
+            for (Link& l : links)
+                if (l.fd >= 0 && now - l.heard > std::chrono::milliseconds(opt.failoverMs)) drop(l);
+            links.erase(std::remove_if(links.begin(), links.end(), [](const Link& l) { return l.fd < 0; }),
+                        links.end());
+            std::lock_guard<std::mutex> g(mx);
+            ackedLsns.clear();
+            for (Link& l : links) ackedLsns.push_back(l.acked);
+            stopping = stopSeen;
+            acked.notify_all();
+        }
+        for (Link& l : links) drop(l);
+    }
+
+    void drop(Link& l) {
+        close(l.fd);
+        l.fd = -1;
+    }
+
+    // Answers a new connection: as leader, with a snapshot, keeping it as a follower.
+    void welcome(int fd, std::vector<Link>& links) {
+        timeval tv = {opt.failoverMs / 1000, (opt.failoverMs % 1000) * 1000};
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)); // A stuck follower is dropped.
+        std::string msg, payload;
+        uint64_t lsn = 0;
+        {
+            std::lock_guard<std::mutex> g(mx);
+            if (leader()) {
+                lsn = appended;
+                putU64(payload, lsn);
+                proto::putU32(payload, (uint32_t)held.size());
+                for (auto& h : held) {
+                    proto::putU32(payload, (uint32_t)h.first);
+                    proto::putU32(payload, (uint32_t)h.second);
+                }
+            }
+        }
+        if (payload.empty()) {
+            putU64(payload, applied.load());
+            putMessage(msg, FOLLOWER, payload);
+            sendAll(fd, msg);
+            close(fd);
+            return;
+        }
+        putMessage(msg, LEADER, std::string());
+        putMessage(msg, SNAPSHOT, payload);
+        if (!sendAll(fd, msg)) {
+            close(fd);
+            return;
+        }
+        links.push_back(Link{fd, std::string(), lsn, Clock::now()});
+    }
+
+    // The follower thread: finds the leader and applies what it sends, until
+    // this replica is promoted or stopped.
+    void followLeaders() {
+        while (running && !leader()) {
+            std::string buf;
+            int fd = -1;
+            if (!elect(fd, buf)) {
+                for (int i = 0; i < 10 && running; ++i) std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                continue;
+            }
+            if (fd >= 0) followLeader(fd, buf);
+        }
+    }
+
+    // Probes every peer. True with 'fd' connected if one of them leads, or with
+    // fd -1 after promoting this replica. False if another one should promote.
+    bool elect(int& fd, std::string& buf) {
+        uint64_t mine = applied.load();
+        bool best = true;
+        for (int i = 0; i < (int)opt.peers.size() && running; ++i) {
+            if (i == opt.index) continue;
+            int c = client::connectUnix(opt.peers[i]);
+            if (c < 0) continue;
+            uint8_t type;
+            std::string payload;
+            buf.clear();
+            if (readMessage(c, buf, type, payload, opt.failoverMs)) {
+                if (type == LEADER) {
+                    fd = c;
+                    return true;
+                }
+                if (type == FOLLOWER && payload.size() == 8) {
+                    uint64_t theirs = getU64(payload.data());
+                    if (theirs > mine || (theirs == mine && i < opt.index)) best = false;
+                }
+            }
+            close(c);
+        }
+        if (!best || !running) return false;
+        promote();
+        fd = -1;
+        return true;
+    }
+
+    void followLeader(int fd, std::string& buf) {
+        {
+            std::lock_guard<std::mutex> g(fdMx);
+            if (!running) {
+                close(fd);
+                return;
+            }
+            leaderFd = fd;
+        }
+        std::string payload, ack;
+        uint8_t type;
+        while (running && readMessage(fd, buf, type, payload, opt.failoverMs)) {
+            bool ok = type == SNAPSHOT ? applySnapshot(payload) : type == BATCH && applyBatch(payload);
+            if (!ok) {
+                std::cerr << "replica " << opt.index << ": leader sent a change that does not apply, resyncing\n";
+                break;
+            }
+            ack.clear();
+            payload.clear();
+            putU64(payload, applied.load());
+            putMessage(ack, ACK, payload);
+            if (!sendAll(fd, ack)) break;
+        }
+        {
+            std::lock_guard<std::mutex> g(fdMx);
+            close(fd);
+            leaderFd = -1;
+        }
+        if (running) std::cerr << "replica " << opt.index << ": lost the leader at LSN " << applied.load() << "\n";
+    }
+
+    bool applySnapshot(const std::string& payload) {
+        if (payload.size() < 12) return false;
+        uint32_t count = proto::getU32(payload.data() + 8);
+        if (payload.size() != 12 + 8 * (size_t)count) return false;
+        std::unique_lock<std::shared_mutex> g(stateMx);
+        for (int v = 0; v < tl.n; ++v)
+            if (tl.lockedBy[v] != 0) tl.unlockNode(v, tl.lockedBy[v]);
+        // The pairs were locked at the same time, so no one is below another and
+        // any order applies.
+        for (const char* p = payload.data() + 12; p < payload.data() + payload.size(); p += 8) {
+            uint32_t v = proto::getU32(p);
+            if (v >= (uint32_t)tl.n || !tl.lockNode((int)v, (int32_t)proto::getU32(p + 4))) return false;
+        }
+        applied = getU64(payload.data());
+        lastHeard = Clock::now();
+        return true;
+    }
+
+    bool applyBatch(const std::string& payload) {
+        if (payload.size() < 8) return false;
+        uint64_t lsn = getU64(payload.data());
+        const char* p = payload.data() + 8;
+        const char* end = payload.data() + payload.size();
+        wal::Record rec;
+        std::unique_lock<std::shared_mutex> g(stateMx);
+        for (; p < end; ++lsn) {
+            if (!wal::decode(p, end, rec)) return false;
+            if (lsn < applied) continue; // Already in the snapshot.
+            if (lsn > applied || rec.v < 0 || rec.v >= tl.n) return false;
+            bool ok = rec.type == wal::LOCK     ? tl.lockNode(rec.v, rec.uid)
+                      : rec.type == wal::UNLOCK ? tl.unlockNode(rec.v, rec.uid)
+                                                : tl.upgradeNode(rec.v, rec.uid);
+            if (!ok) return false;
+            applied = lsn + 1;
+        }
+        lastHeard = Clock::now();
+        return true;
+    }
+
+    // Takes over: later changes continue the LSN sequence this replica applied.
+    void promote() {
+        std::unique_lock<std::shared_mutex> g(stateMx);
+        std::lock_guard<std::mutex> l(mx);
+        held.clear();
+        for (int v = 0; v < tl.n; ++v)
+            if (tl.lockedBy[v] != 0) held[v] = tl.lockedBy[v];
+        appended = sentLsn = applied.load();
+        active.clear();
+        tl.sink = this;
+        leading.store(true, std::memory_order_release);
+        std::cerr << "replica " << opt.index << ": leading at LSN " << appended << "\n";
+    }
+};
+
+// The lock server's per-request hook (lockServer.cpp).
+template <class TL>
+uint8_t serveRequest(Replica<TL>& r, const proto::Request& q) {
+    return r.serve(q);
+}
+
+} // namespace repl
@@ -0,0 +1,197 @@
+#include <iostream>
+#include <vector>
+#include <string>
+#include <deque>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+#include "workload.h"
+#include "latencyHistogram.h"
+#include "lockProtocol.h"
+#include "lockClient.h"
+
+using namespace std;
+
+// Closed-loop load generator for lockServer.
+// Opens --connections sockets, spread over --threads threads, and keeps --depth
+// frames of --batch requests in flight on each one. Each response frame triggers
+// the next request frame. The ops come from the shared workload generator, so
+// --n and --m must match the server's tree. Reports throughput and the round-trip
+// time of whole frames:
+//   ./serverLoad --unix /tmp/treelocker.sock --n 1000000 --m 4 --connections 64 --depth 8 --batch 32
+
+typedef chrono::steady_clock Clock;
+
+struct Target {
+    string unixPath, host = "127.0.0.1";
+    int port = 0;
+};
+
+int connectTo(const Target& t) {
+    return t.unixPath.empty() ? client::connectTcp(t.host, t.port) : client::connectUnix(t.unixPath);
+}
+
+struct ThreadResult {
+    long long requests = 0, successes = 0, badRequests = 0;
+    LatencyHistogram rtt;
+    bool failed = false;
+};
+
+struct Client {
+    int fd;
+    string in;
+    deque<Clock::time_point> sent; // Send times of the frames in flight.
+};
+
+// Drives 'fds' until 'end', then drains what is still in flight.
+void runThread(vector<int> fds, const vector<WorkloadOp>& ops, int depth, int batch, Clock::time_point end,
+               ThreadResult& res) {
+    vector<Client> clients;
+    for (int fd : fds) clients.push_back(Client{fd, string(), deque<Clock::time_point>()});
+    size_t next = 0;
+    string frame;
+    auto send = [&](Client& c) {
+        frame.clear();
+        size_t at = proto::beginFrame(frame);
+        for (int i = 0; i < batch; ++i) {
+            const WorkloadOp& o = ops[next++ % ops.size()];
+            proto::putRequest(frame, proto::Request{(uint32_t)i, (uint8_t)o.op, (uint32_t)o.node, o.uid});
+        }
+        proto::endFrame(frame, at);
+        c.sent.push_back(Clock::now());
+        for (size_t off = 0; off < frame.size();) {
+            ssize_t w = write(c.fd, frame.data() + off, frame.size() - off);
+            if (w <= 0) return false;
+            off += (size_t)w;
+        }
+        return true;
+    };
+    for (Client& c : clients)
+        for (int d = 0; d < depth; ++d)
+            if (!send(c)) res.failed = true;
+
+    vector<pollfd> pfds(clients.size());
+    char buf[64 << 10];
+    size_t inFlight = clients.size() * depth;
+    while (inFlight > 0 && !res.failed) {
+        for (size_t i = 0; i < clients.size(); ++i) pfds[i] = pollfd{clients[i].fd, POLLIN, 0};
+        if (poll(pfds.data(), pfds.size(), 1000) <= 0) {
+            res.failed = true; // The server stopped answering.
+            break;
+        }
+        bool sending = Clock::now() < end;
+        for (size_t i = 0; i < clients.size(); ++i) {
+            if (!(pfds[i].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+            Client& c = clients[i];
+            ssize_t r = read(c.fd, buf, sizeof(buf));
+            if (r <= 0) {
+                res.failed = true;
+                break;
+            }
+            c.in.append(buf, (size_t)r);
+            size_t off = 0;
+            long long len;
+            while ((len = proto::frameBody(c.in.data() + off, c.in.size() - off, proto::RESPONSE_BYTES)) > 0) {
+                Clock::time_point now = Clock::now();
+                res.rtt.record((uint64_t)chrono::duration_cast<chrono::nanoseconds>(now - c.sent.front()).count());
+                c.sent.pop_front();
+                for (const char* p = c.in.data() + off + 4; p < c.in.data() + off + 4 + len; p += proto::RESPONSE_BYTES) {
+                    uint8_t result = proto::getResponse(p).result;
+                    ++res.requests;
+                    res.successes += result == proto::TRUE;
+                    res.badRequests += result == proto::BAD_REQUEST;
+                }
+                off += 4 + (size_t)len;
+                --inFlight;
+                if (sending) {
+                    if (!send(c)) res.failed = true;
+                    ++inFlight;
+                }
+            }
+            if (len < 0) res.failed = true;
+            c.in.erase(0, off);
+        }
+    }
+    for (Client& c : clients) close(c.fd);
+}
+
+int main(int argc, char** argv) {
+    WorkloadConfig cfg;
+    Target target;
+    int connections = 64, threads = 0, depth = 8, batch = 32;
+    double seconds = 5;
+    for (int i = 1; i < argc; ++i) {
+        string key = argv[i];
+        if (i + 1 >= argc) {
+            cerr << "missing value for " << key << "\n";
+            return 1;
+        }
+        string val = argv[++i];
+        if (key == "--unix") target.unixPath = val;
+        else if (key == "--port") target.port = stoi(val);
+        else if (key == "--host") target.host = val;
+        else if (key == "--connections") connections = max(1, stoi(val));
+        else if (key == "--threads") threads = max(1, stoi(val));
+        else if (key == "--depth") depth = max(1, stoi(val));
+        else if (key == "--batch") batch = max(1, min(stoi(val), (int)(proto::MAX_FRAME / proto::REQUEST_BYTES)));
+        else if (key == "--seconds") seconds = stod(val);
+        else if (!parseWorkloadFlag(cfg, key, val)) {
+            cerr << "usage: " << argv[0] << " (--unix PATH | --port PORT [--host ADDR]) [--connections C]\n"
+                 << "  [--threads T] [--depth D] [--batch B] [--seconds S]\n" << workloadFlagsUsage();
+            return 1;
+        }
+    }
+    if (target.unixPath.empty() && target.port == 0) {
+        cerr << "need --unix or --port\n";
+        return 1;
+    }
+    if (threads == 0) threads = (int)min<unsigned>(connections, max(1u, thread::hardware_concurrency()));
+    threads = min(threads, connections);
+
+    vector<vector<int>> fds(threads);
+    for (int c = 0; c < connections; ++c) {
+        int fd = connectTo(target);
+        if (fd < 0) {
+            cerr << "cannot connect\n";
+            return 1;
+        }
+        fds[c % threads].push_back(fd);
+    }
+    vector<vector<WorkloadOp>> ops(threads);
+    for (int t = 0; t < threads; ++t) {
+        WorkloadConfig c = cfg;
+        c.seed = cfg.seed + t;
+        ops[t] = WorkloadGenerator(c).generate();
+    }
+
+    vector<ThreadResult> results(threads);
+    vector<thread> pool;
+    Clock::time_point start = Clock::now();
+    Clock::time_point end = start + chrono::duration_cast<Clock::duration>(chrono::duration<double>(seconds));
+    for (int t = 0; t < threads; ++t)
+        pool.emplace_back(runThread, fds[t], cref(ops[t]), depth, batch, end, ref(results[t]));
+    for (thread& th : pool) th.join();
+    double elapsed = chrono::duration<double>(Clock::now() - start).count();
+
+    ThreadResult all;
+    for (const ThreadResult& r : results) {
+        all.requests += r.requests;
+        all.successes += r.successes;
+        all.badRequests += r.badRequests;
+        all.rtt.merge(r.rtt);
+        all.failed = all.failed || r.failed;
+    }
+    cout << "connections,depth,batch,requests,seconds,ops_per_sec,success_rate,bad_requests,frame_p50_ns,"
+            "frame_p99_ns,frame_p999_ns\n"
+         << connections << "," << depth << "," << batch << "," << all.requests << "," << elapsed << ","
+         << all.requests / elapsed << "," << (all.requests ? (double)all.successes / all.requests : 0) << ","
+         << all.badRequests << "," << all.rtt.percentile(0.50) << "," << all.rtt.percentile(0.99) << ","
+         << all.rtt.percentile(0.999) << "\n";
+    if (all.failed) cerr << "some connections failed\n";
+    return all.failed ? 1 : 0;
+}
@@ -0,0 +1,441 @@
+#pragma once
+
+// Shared-memory TreeLocker: one tree in a POSIX shared-memory segment that every
+// process on the host maps and calls directly, without a server round trip.
+//
+// The segment holds plain data at fixed offsets and no pointers, so each process
+// may map it at a different address:
+//   Header | Slot[MAX_PROCESSES] | lockedBy int32[n] | descLocked int32[n]
+//   | owner uint32[n] (slot + 1 of the process that took the node's lock)
+// Every op runs under one lock word in the header: a process-shared atomic that
+// holds the slot + 1 of its holder, used the way mul_songs uses its spinlock.
+// Per-node words as in Song_S would not add concurrency, since every op there
+// locks the path up to the shared root.
+//
+// Robustness. A process attaches by claiming a slot with its pid and start time
+// (from /proc/PID/stat, so a recycled pid does not pass for the process that
+// died). Tree locks belong to the process that took them and live as long as it:
+//  - A waiter that has spun on the lock word for a while checks that the holder is
+//    alive. If it is not, the waiter takes the word over and repairs the tree. The
+//    dead op may have stopped halfway, so its process's locks are dropped and
+//    descLocked is rebuilt from lockedBy.
+//  - reap() frees the slots of dead processes and the tree locks they held. It runs
+//    on attach and detach, and from an op that fails, at most every
+//    REAP_INTERVAL_MS host-wide, because a dead process's lock may be the cause.
+// detach() releases this process's tree locks too.
+//
+//   shm_tree::TreeLocker tl;
+//   std::string error;
+//   if (!tl.attach("/treelocker", 1000000, 4, error)) ... // Creates the segment if missing.
+//   tl.lockNode(v, uid);
+//   tl.detach();
+//   shm_tree::TreeLocker::remove("/treelocker");         // Once no process needs it.
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <new>
+#include <stack>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "changeSink.h"
+
+namespace shm_tree {
+
+const uint32_t VERSION = 2;
+const int MAX_PROCESSES = 256;
+const int REAP_INTERVAL_MS = 100;
+const int PID_BITS = 22; // pid_max is at most 2^22; the start time takes the bits above.
+const unsigned SPINS_BEFORE_YIELD = 64;
+const unsigned YIELDS_BEFORE_CHECK = 256; // Between liveness checks of the lock word's holder.
+
+static_assert(std::atomic<uint32_t>::is_always_lock_free && std::atomic<int32_t>::is_always_lock_free &&
+                  std::atomic<uint64_t>::is_always_lock_free,
+              "shared-memory atomics must be lock-free to work across processes");
+
+struct Header {
+    char magic[8]; // "TLSHMEM1"
+    uint32_t version;
+    int32_t n, m;
+    std::atomic<uint32_t> ready;       // Set by the creator once everything below is initialised.
+    std::atomic<uint32_t> lock;        // 0 free, else slot + 1 of the holder.
+    std::atomic<uint64_t> lastReapNs;  // CLOCK_MONOTONIC, which every process shares.
+    std::atomic<uint64_t> recoveries;  // Lock words taken over from a dead holder.
+    std::atomic<uint64_t> reaped;      // Dead processes cleaned up after.
+    uint64_t slotsOff, lockedByOff, descLockedOff, ownerOff, bytes;
+};
+
+// One word per slot, so claiming one is a single CAS that a process cannot die
+// halfway through: the pid in the low PID_BITS, the process's start time (clock
+// ticks since boot) above them, 0 while free.
+struct Slot {
+    std::atomic<uint64_t> process{0};
+};
+
+inline uint64_t slotWord(int pid, uint64_t startTime) { return startTime << PID_BITS | (uint64_t)pid; }
+
+inline uint64_t align64(uint64_t x) { return (x + 63) & ~63ull; }
+
+inline uint64_t monotonicNs() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// Start time of 'pid' (field 22 of /proc/PID/stat), or 0 if it is gone or a zombie.
+inline uint64_t processStartTime(int pid) {
+    char path[32], buf[512];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return 0;
+    ssize_t r = read(fd, buf, sizeof(buf) - 1);
+    ::close(fd);
+    if (r <= 0) return 0;
+    buf[r] = 0;
+    const char* p = strrchr(buf, ')'); // The command name may contain spaces.
+    if (!p || p[1] != ' ' || p[2] == 'Z' || p[2] == 'X') return 0;
+    p += 2; // Field 3, the state.
+    for (int field = 3; field < 22 && p; ++field) {
+        p = strchr(p, ' ');
+        if (p) ++p;
+    }
+    return p ? strtoull(p, nullptr, 10) : 0;
+}
+
+struct TreeLocker {
+    int n = 0, m = 0;
+    int32_t* lockedBy = nullptr;   // In the segment; 0 means unlocked.
+    int32_t* descLocked = nullptr; // Locked descendants of each node.
+    ChangeSink* sink = nullptr;    // This process's observer of its own successful changes.
+
+    TreeLocker() = default;
+    TreeLocker(const TreeLocker&) = delete;
+    TreeLocker& operator=(const TreeLocker&) = delete;
+    ~TreeLocker() { detach(); }
+
+    // Maps segment 'name' ("/something"), creating it for an n-node m-ary tree if it
+    // does not exist. An existing segment must be for the same tree (n <= 0 accepts
+    // any). False with 'error' if it is not, or if no slot is free.
+    bool attach(const std::string& name, int n_, int m_, std::string& error) {
+        detach();
+        int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+        bool created = fd >= 0;
+        if (!created && errno == EEXIST) fd = shm_open(name.c_str(), O_RDWR | O_CLOEXEC, 0);
+        if (fd < 0) {
+            error = "cannot open shared memory " + name;
+            return false;
+        }
+        bool ok = created ? create(fd, n_, m_, error) : open(fd, name, n_, m_, error);
+        ::close(fd);
+        if (!ok) {
+            if (created) shm_unlink(name.c_str());
+            unmap();
+            return false;
+        }
+        if (!claimSlot()) {
+            error = name + ": all " + std::to_string(MAX_PROCESSES) + " process slots are taken";
+            unmap();
+            return false;
+        }
+        reap();
+        return true;
+    }
+
+    // Releases this process's tree locks and its slot, and unmaps the segment.
+    void detach() {
+        if (!h) return;
+        if (slot >= 0) {
+            acquire();
+            uint32_t me = (uint32_t)slot + 1;
+            for (int v = 0; v < n; ++v)
+                if (owner[v] == me) {
+                    if (lockedBy[v] != 0) addToAncestors(v, -1);
+                    lockedBy[v] = 0;
+                    owner[v] = 0;
+                }
+            reapLocked();
+            release();
+            slots[slot].process.store(0, std::memory_order_release);
+            slot = -1;
+        }
+        unmap();
+    }
+
+    // Removes the segment's name; processes that have it mapped keep using it.
+    static void remove(const std::string& name) { shm_unlink(name.c_str()); }
+
+    bool attached() const { return h != nullptr; }
+    uint64_t recoveries() const { return h->recoveries.load(); }
+    uint64_t reapedProcesses() const { return h->reaped.load(); }
+
+    // Cleans up after processes that died; returns how many there were.
+    int reap() {
+        h->lastReapNs.store(monotonicNs(), std::memory_order_relaxed);
+        acquire();
+        int dead = reapLocked();
+        release();
+        return dead;
+    }
+
+    bool lockNode(int v, int uid) {
+        for (bool retry = true;; retry = false) {
+            acquire();
+            if (lockedBy[v] != 0 || hasLockedAncestor(v) || descLocked[v] != 0) {
+                release();
+                if (retry && reapDue() && reap() > 0) continue;
+                return false;
+            }
+            owner[v] = (uint32_t)slot + 1; // Before lockedBy, so a crash here leaves the lock reapable.
+            lockedBy[v] = uid;
+            addToAncestors(v, 1);
+            if (sink) sink->onLock(v, uid);
+            release();
+            return true;
+        }
+    }
+
+    bool unlockNode(int v, int uid) {
+        acquire();
+        if (lockedBy[v] != uid) {
+            release();
+            return false;
+        }
+        lockedBy[v] = 0;
+        owner[v] = 0;
+        addToAncestors(v, -1);
+        if (sink) sink->onUnlock(v, uid);
+        release();
+        return true;
+    }
+
+    bool upgradeNode(int v, int uid) {
+        for (bool retry = true;; retry = false) {
+            acquire();
+            std::vector<int> toUnlock;
+            if (lockedBy[v] != 0 || hasLockedAncestor(v) || descLocked[v] == 0 || !ownDescendants(v, uid, toUnlock)) {
+                release();
+                if (retry && reapDue() && reap() > 0) continue;
+                return false;
+            }
+            for (int u : toUnlock) {
+                lockedBy[u] = 0;
+                owner[u] = 0;
+                addToAncestors(u, -1);
+            }
+            owner[v] = (uint32_t)slot + 1;
+            lockedBy[v] = uid;
+            addToAncestors(v, 1);
+            if (sink) sink->onUpgrade(v, uid, toUnlock);
+            release();
+            return true;
+        }
+    }
+
+private:
+    Header* h = nullptr;
+    Slot* slots = nullptr;
+    uint32_t* owner = nullptr;
+    int slot = -1;
+
+    static void layout(Header& hd, int n) {
+        hd.slotsOff = align64(sizeof(Header));
+        hd.lockedByOff = align64(hd.slotsOff + sizeof(Slot) * MAX_PROCESSES);
+        hd.descLockedOff = align64(hd.lockedByOff + 4ull * n);
+        hd.ownerOff = align64(hd.descLockedOff + 4ull * n);
+        hd.bytes = align64(hd.ownerOff + 4ull * n);
+    }
+
+    bool map(int fd, uint64_t bytes, std::string& error) {
+        void* p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED) {
+            error = "cannot map shared memory";
+            return false;
+        }
+        h = (Header*)p;
+        return true;
+    }
+
+    void bind() {
+        char* base = (char*)h;
+        n = h->n;
+        m = h->m;
+        slots = (Slot*)(base + h->slotsOff);
+        lockedBy = (int32_t*)(base + h->lockedByOff);
+        descLocked = (int32_t*)(base + h->descLockedOff);
+        owner = (uint32_t*)(base + h->ownerOff);
+    }
+
+    void unmap() {
+        if (h) munmap(h, h->bytes ? h->bytes : sizeof(Header));
+        h = nullptr;
+        slots = nullptr;
+        lockedBy = descLocked = nullptr;
+        owner = nullptr;
+    }
+
+    // The segment starts out zeroed, which is every node unlocked and every slot free.
+    bool create(int fd, int n_, int m_, std::string& error) {
+        if (n_ <= 0 || m_ <= 0) {
+            error = "a new shared tree needs n and m";
+            return false;
+        }
+        Header hd;
+        layout(hd, n_);
+        if (ftruncate(fd, (off_t)hd.bytes) != 0 || !map(fd, hd.bytes, error)) {
+            if (error.empty()) error = "cannot size shared memory";
+            return false;
+        }
+        new (h) Header();
+        memcpy(h->magic, "TLSHMEM1", 8);
+        h->version = VERSION;
+        h->n = n_;
+        h->m = m_;
+        layout(*h, n_);
+        Slot* s = (Slot*)((char*)h + h->slotsOff);
+        for (int i = 0; i < MAX_PROCESSES; ++i) new (&s[i]) Slot();
+        bind();
+        h->ready.store(1, std::memory_order_release);
+        return true;
+    }
+
+    // Waits (up to two seconds) for the creator to finish, then checks the tree.
+    bool open(int fd, const std::string& name, int n_, int m_, std::string& error) {
+        struct stat st;
+        for (int i = 0; i < 2000 && (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(Header)); ++i) usleep(1000);
+        if (st.st_size < (off_t)sizeof(Header) || !map(fd, sizeof(Header), error)) {
+            if (error.empty()) error = name + ": not initialised";
+            return false;
+        }
+        for (int i = 0; i < 2000 && !h->ready.load(std::memory_order_acquire); ++i) usleep(1000);
+        if (!h->ready.load(std::memory_order_acquire) || memcmp(h->magic, "TLSHMEM1", 8) != 0 ||
+            h->version != VERSION) {
+            error = name + ": not a shared tree of this version";
+            return false;
+        }
+        if ((n_ > 0 && (h->n != n_ || h->m != m_)) || (uint64_t)st.st_size < h->bytes) {
+            error = name + ": holds a different tree (n " + std::to_string(h->n) + ", m " + std::to_string(h->m) + ")";
+            return false;
+        }
+        uint64_t bytes = h->bytes;
+        munmap(h, sizeof(Header));
+        h = nullptr;
+        if (!map(fd, bytes, error)) return false;
+        bind();
+        return true;
+    }
+
+    bool claimSlot() {
+        int pid = (int)getpid();
+        uint64_t word = slotWord(pid, processStartTime(pid));
+        for (int i = 0; i < MAX_PROCESSES; ++i) {
+            uint64_t expect = 0;
+            if (!slots[i].process.compare_exchange_strong(expect, word, std::memory_order_acq_rel)) continue;
+            slot = i;
+            return true;
+        }
+        return false;
+    }
+
+    bool alive(int s) const {
+        uint64_t word = slots[s].process.load(std::memory_order_acquire);
+        if (word == 0) return false;
+        int pid = (int)(word & ((1u << PID_BITS) - 1));
+        if (kill(pid, 0) != 0 && errno == ESRCH) return false;
+        return slotWord(pid, processStartTime(pid)) == word;
+    }
+
+    void acquire() {
+        uint32_t me = (uint32_t)slot + 1;
+        for (unsigned spins = 1;; ++spins) {
+            uint32_t holder = h->lock.load(std::memory_order_relaxed);
+            if (holder == 0 && h->lock.compare_exchange_weak(holder, me, std::memory_order_acquire)) return;
+            if (spins % SPINS_BEFORE_YIELD != 0) continue;
+            if (holder != 0 && spins % (SPINS_BEFORE_YIELD * YIELDS_BEFORE_CHECK) == 0 && !alive((int)holder - 1) &&
+                h->lock.compare_exchange_strong(holder, me, std::memory_order_acquire)) {
+                h->recoveries.fetch_add(1, std::memory_order_relaxed);
+                reapLocked(); // Drops the dead holder's locks and rebuilds descLocked.
+                return;
+            }
+            sched_yield();
+        }
+    }
+
+    void release() { h->lock.store(0, std::memory_order_release); }
+
+    bool reapDue() {
+        uint64_t now = monotonicNs(), last = h->lastReapNs.load(std::memory_order_relaxed);
+        return now - last >= REAP_INTERVAL_MS * 1000000ull &&
+               h->lastReapNs.compare_exchange_strong(last, now, std::memory_order_relaxed);
+    }
+
+    // Under the lock word: releases the tree locks of dead processes, rebuilds
+    // descLocked (an op of theirs may have stopped halfway) and frees their slots.
+    int reapLocked() {
+        std::vector<char> dead(MAX_PROCESSES + 1, 0);
+        int count = 0;
+        for (int s = 0; s < MAX_PROCESSES; ++s)
+            if (slots[s].process.load(std::memory_order_acquire) != 0 && s != slot && !alive(s)) {
+                dead[s + 1] = 1;
+                ++count;
+            }
+        if (count == 0) return 0;
+        for (int v = 0; v < n; ++v)
+            if (owner[v] != 0 && (owner[v] > (uint32_t)MAX_PROCESSES || dead[owner[v]])) {
+                lockedBy[v] = 0;
+                owner[v] = 0;
+            }
+        for (int v = 0; v < n; ++v) descLocked[v] = 0;
+        for (int v = n - 1; v > 0; --v) descLocked[(v - 1) / m] += descLocked[v] + (lockedBy[v] != 0);
+        for (int s = 0; s < MAX_PROCESSES; ++s)
+            if (dead[s + 1]) slots[s].process.store(0, std::memory_order_release);
+        h->reaped.fetch_add((uint64_t)count, std::memory_order_relaxed);
+        return count;
+    }
+
+    bool hasLockedAncestor(int v) const {
+        while (v > 0) {
+            v = (v - 1) / m;
+            if (lockedBy[v] != 0) return true;
+        }
+        return false;
+    }
+
+    void addToAncestors(int v, int delta) {
+        while (v > 0) {
+            v = (v - 1) / m;
+            descLocked[v] += delta;
+        }
+    }
+
+    // Collects the locked descendants of 'v'; false if one is not uid's.
+    bool ownDescendants(int v, int uid, std::vector<int>& out) const {
+        std::stack<int> st;
+        st.push(v);
+        while (!st.empty()) {
+            int u = st.top();
+            st.pop();
+            for (long long c = 1LL * u * m + 1; c <= 1LL * u * m + m && c < n; ++c) {
+                int w = (int)c;
+                if (lockedBy[w] != 0) {
+                    if (lockedBy[w] != uid) return false;
+                    out.push_back(w);
+                } else if (descLocked[w] > 0) {
+                    st.push(w);
+                }
+            }
+        }
+        return true;
+    }
+};
+
+} // namespace shm_tree
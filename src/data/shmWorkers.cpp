@@ -0,0 +1,134 @@
+#include <iostream>
+#include <vector>
+#include <string>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <csignal>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "workload.h"
+#include "sharedTree.h"
+#include "verify.h"
+
+using namespace std;
+
+// Several processes sharing one tree through shared memory (sharedTree.h).
+// Forks --procs workers that each attach to the segment and run their share of a
+// generated workload directly against it until --seconds pass. With --kill-ms the
+// parent SIGKILLs a random worker every that many milliseconds, at whatever point
+// it has reached (inside an op, holding the lock word, holding tree locks), and
+// forks a replacement, so the survivors have to recover. At the end the parent
+// attaches, reaps what the dead left behind and checks that the tree verifies and
+// is empty, since every surviving worker released its locks on detach.
+//   ./shmWorkers --procs 4 --seconds 5 --n 1000000 --m 4 --kill-ms 20
+
+typedef chrono::steady_clock Clock;
+
+struct Shared {
+    atomic<long long> ops{0}, successes{0};
+};
+
+void runWorker(const string& name, const WorkloadConfig& cfg, uint64_t seed, Clock::time_point end, Shared& out) {
+    shm_tree::TreeLocker tl;
+    string error;
+    if (!tl.attach(name, cfg.n, cfg.m, error)) {
+        cerr << error << "\n";
+        _exit(1);
+    }
+    WorkloadConfig w = cfg;
+    w.seed = seed;
+    w.q = min<long long>(cfg.q, 200000);
+    vector<WorkloadOp> ops = WorkloadGenerator(w).generate();
+    long long done = 0, ok = 0;
+    for (size_t i = 0; Clock::now() < end; ++i) {
+        const WorkloadOp& o = ops[i % ops.size()];
+        ok += o.op == 1 ? tl.lockNode(o.node, o.uid) : o.op == 2 ? tl.unlockNode(o.node, o.uid)
+                                                                 : tl.upgradeNode(o.node, o.uid);
+        if (++done % 1024 == 0) { // Published in chunks; a killed worker's last chunk is lost.
+            out.ops += 1024;
+            out.successes += ok;
+            ok = 0;
+        }
+    }
+    out.ops += done % 1024;
+    out.successes += ok;
+    tl.detach();
+    _exit(0);
+}
+
+int main(int argc, char** argv) {
+    WorkloadConfig cfg;
+    string name = "/treelocker-shmWorkers";
+    int procs = 4, killMs = 0;
+    double seconds = 5;
+    for (int i = 1; i < argc; ++i) {
+        string key = argv[i];
+        if (i + 1 >= argc) {
+            cerr << "missing value for " << key << "\n";
+            return 1;
+        }
+        string val = argv[++i];
+        if (key == "--procs") procs = max(1, stoi(val));
+        else if (key == "--seconds") seconds = stod(val);
+        else if (key == "--kill-ms") killMs = max(0, stoi(val));
+        else if (key == "--name") name = val;
+        else if (!parseWorkloadFlag(cfg, key, val)) {
+            cerr << "usage: " << argv[0] << " [--procs P] [--seconds S] [--kill-ms MS] [--name /SEGMENT]\n"
+                 << workloadFlagsUsage();
+            return 1;
+        }
+    }
+
+    shm_tree::TreeLocker::remove(name);
+    void* mem = mmap(nullptr, sizeof(Shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    Shared& shared = *new (mem) Shared();
+    Clock::time_point start = Clock::now();
+    Clock::time_point end = start + chrono::duration_cast<Clock::duration>(chrono::duration<double>(seconds));
+    uint64_t seeds = cfg.seed;
+    auto spawn = [&] {
+        uint64_t seed = seeds++;
+        pid_t pid = fork();
+        if (pid == 0) runWorker(name, cfg, seed, end, shared);
+        return pid;
+    };
+    vector<pid_t> workers;
+    for (int p = 0; p < procs; ++p) workers.push_back(spawn());
+
+    long long kills = 0;
+    mt19937 rng((unsigned)cfg.seed);
+    while (killMs > 0 && Clock::now() + chrono::milliseconds(killMs) < end) {
+        this_thread::sleep_for(chrono::milliseconds(killMs));
+        size_t victim = rng() % workers.size();
+        kill(workers[victim], SIGKILL);
+        waitpid(workers[victim], nullptr, 0);
+        workers[victim] = spawn();
+        ++kills;
+    }
+    int failed = 0;
+    for (pid_t pid : workers) {
+        int status = 0;
+        waitpid(pid, &status, 0);
+        failed += !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+    }
+    double elapsed = chrono::duration<double>(Clock::now() - start).count();
+
+    shm_tree::TreeLocker tl;
+    string error;
+    if (!tl.attach(name, cfg.n, cfg.m, error)) {
+        cerr << error << "\n";
+        return 1;
+    }
+    verify::Result r = verify::check(tl.lockedBy, tl.descLocked, tl.n, tl.m);
+    long long held = 0;
+    for (int v = 0; v < tl.n; ++v) held += tl.lockedBy[v] != 0;
+    cout << "procs,seconds,ops,ops_per_sec,success_rate,kills,lock_word_recoveries,processes_reaped,locks_left,verify\n"
+         << procs << "," << elapsed << "," << shared.ops << "," << shared.ops / elapsed << ","
+         << (shared.ops ? (double)shared.successes / shared.ops : 0) << "," << kills << "," << tl.recoveries() << ","
+         << tl.reapedProcesses() << "," << held << "," << r.describe() << "\n";
+    tl.detach();
+    shm_tree::TreeLocker::remove(name);
+    return r.ok() && held == 0 && failed == 0 ? 0 : 1;
+}
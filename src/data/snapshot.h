@@ -0,0 +1,349 @@
+#pragma once
+
+// Fork-based copy-on-write snapshots of TreeLocker state, and WAL checkpoints
+// built on them.
+//
+// Checkpointer::begin() is called where no change is in flight (for mulSongs,
+// on the worker between two queries). It asks the write-ahead log to rotate,
+// which fixes the rotation LSN without waiting for the flusher, then fork()s:
+// the child sees the tree exactly as of that LSN, encodes and writes it, and
+// exits, while the parent goes straight back to serving and only pays
+// copy-on-write faults for the pages it dirties meanwhile. Once the child has
+// exited successfully and the flusher has set the old segment aside, that
+// segment is deleted.
+//
+// File: Header, then a body of
+//   per uid, ascending: zigzag uid, varint count, node ids delta-encoded
+//   (ascending, first delta from 0)
+//   optionally the name table: per node, varint length and the bytes
+// Only locked nodes are stored; grouping them by uid keeps each user's nodes
+// together so a loader can build a per-uid index directly. descLocked is not
+// stored: load() rebuilds it in one O(n) pass, which is cheaper than reading it.
+// The body is covered by a crc32 in the header.
+//
+// Recovery (restore()) loads the snapshot, then replays the set-aside segment
+// left by a checkpoint that did not finish and the current log, skipping the
+// records below the snapshot's LSN.
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "captureLog.h"      // putVarint / getVarint / zigzag.
+#include "wal.h"             // crc32, recover, Log::requestRotate.
+#include "bulkLoad.h"        // countDescendants.
+
+namespace snapshot {
+
+const uint32_t VERSION = 1;
+
+enum Flags { HAS_NAMES = 1 };
+
+struct Header {
+    char magic[8];       // "TLSNAP01"
+    uint32_t version;
+    int32_t n, m;
+    uint32_t flags;
+    uint64_t lsn;        // WAL position the state corresponds to.
+    uint64_t locked;     // Locked nodes.
+    uint64_t uids;       // Distinct owners.
+    uint64_t bodyBytes;
+    uint32_t bodyCrc;
+    uint32_t reserved;
+};
+
+struct Info {
+    uint64_t lsn = 0, locked = 0, uids = 0;
+    bool hasNames = false;
+};
+
+// Encodes the state of 'tl' as of WAL position 'lsn'. 'names' may be null.
+template <class TL>
+std::string encode(const TL& tl, uint64_t lsn, const std::vector<std::string>* names) {
+    std::vector<std::pair<int, int>> owned; // (uid, node), node ascending within a uid.
+    for (int i = 0; i < tl.n; ++i)
+        if (tl.lockedBy[i] != 0) owned.emplace_back(tl.lockedBy[i], i);
+    std::stable_sort(owned.begin(), owned.end(),
+                     [](const std::pair<int, int>& a, const std::pair<int, int>& b) { return a.first < b.first; });
+
+    Header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, "TLSNAP01", 8);
+    h.version = VERSION;
+    h.n = tl.n;
+    h.m = tl.m;
+    h.flags = names ? HAS_NAMES : 0;
+    h.lsn = lsn;
+    h.locked = owned.size();
+
+    std::string out(sizeof(h), '\0');
+    for (size_t i = 0; i < owned.size();) {
+        size_t j = i;
+        while (j < owned.size() && owned[j].first == owned[i].first) ++j;
+        capture::putVarint(out, capture::zigzag(owned[i].first));
+        capture::putVarint(out, j - i);
+        int prev = 0;
+        for (size_t k = i; k < j; ++k) {
+            capture::putVarint(out, (uint32_t)(owned[k].second - prev));
+            prev = owned[k].second;
+        }
+        ++h.uids;
+        i = j;
+    }
+    if (names) {
+        for (const std::string& s : *names) {
+            capture::putVarint(out, s.size());
+            out += s;
+        }
+    }
+    h.bodyBytes = out.size() - sizeof(h);
+    h.bodyCrc = wal::crc32(out.data() + sizeof(h), h.bodyBytes);
+    memcpy(&out[0], &h, sizeof(h));
+    return out;
+}
+
+// Writes 'bytes' to 'path' through a temporary file, so a reader only ever sees
+// a complete snapshot.
+inline bool writeFile(const std::string& path, const std::string& bytes) {
+    std::string tmp = path + ".tmp";
+    int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return false;
+    size_t off = 0;
+    while (off < bytes.size()) {
+        ssize_t w = write(fd, bytes.data() + off, bytes.size() - off);
+        if (w <= 0) break;
+        off += (size_t)w;
+    }
+    bool ok = off == bytes.size() && fsync(fd) == 0;
+    ::close(fd);
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+        unlink(tmp.c_str());
+        return false;
+    }
+    wal::syncDirectory(path);
+    return true;
+}
+
+// Loads the snapshot at 'path' into a freshly built 'tl' of the same shape.
+// 'names', if given, receives the name table (empty if the snapshot has none).
+// Returns false with 'error' set on a missing, corrupt or mismatched file.
+template <class TL>
+bool load(const std::string& path, TL& tl, Info& info, std::vector<std::string>* names, std::string& error) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        error = "cannot open " + path;
+        return false;
+    }
+    std::string data;
+    char buf[1 << 16];
+    ssize_t r;
+    while ((r = read(fd, buf, sizeof(buf))) > 0) data.append(buf, (size_t)r);
+    ::close(fd);
+
+    Header h;
+    if (data.size() < sizeof(h) || memcmp(data.data(), "TLSNAP01", 8) != 0) {
+        error = path + ": not a snapshot";
+        return false;
+    }
+    memcpy(&h, data.data(), sizeof(h));
+    if (h.version != VERSION || h.n != tl.n || h.m != tl.m) {
+        error = path + ": snapshot was written for a different tree or version";
+        return false;
+    }
+    if (h.bodyBytes != data.size() - sizeof(h) || wal::crc32(data.data() + sizeof(h), h.bodyBytes) != h.bodyCrc) {
+        error = path + ": snapshot is truncated or corrupt";
+        return false;
+    }
+
+    const char* p = data.data() + sizeof(h);
+    const char* end = data.data() + data.size();
+    std::fill(tl.lockedBy.begin(), tl.lockedBy.end(), 0);
+    uint64_t seen = 0;
+    for (uint64_t g = 0; g < h.uids; ++g) {
+        uint64_t uid, count, delta;
+        if (!capture::getVarint(p, end, uid) || !capture::getVarint(p, end, count) || count == 0 ||
+            capture::unzigzag(uid) == 0) {
+            error = path + ": bad owner group";
+            return false;
+        }
+        int64_t v = 0;
+        for (uint64_t k = 0; k < count; ++k) {
+            if (!capture::getVarint(p, end, delta) || (k > 0 && delta == 0) || (v += (int64_t)delta) >= tl.n ||
+                tl.lockedBy[v] != 0) {
+                error = path + ": bad node list for uid " + std::to_string(capture::unzigzag(uid));
+                return false;
+            }
+            tl.lockedBy[v] = (int)capture::unzigzag(uid);
+        }
+        seen += count;
+    }
+    if (seen != h.locked) {
+        error = path + ": locked-node count does not match";
+        return false;
+    }
+    if (names) names->clear();
+    if (h.flags & HAS_NAMES) {
+        if (names) names->reserve(tl.n);
+        for (int i = 0; i < tl.n; ++i) {
+            uint64_t len;
+            if (!capture::getVarint(p, end, len) || len > (uint64_t)(end - p)) {
+                error = path + ": truncated name table";
+                return false;
+            }
+            if (names) names->emplace_back(p, (size_t)len);
+            p += len;
+        }
+    }
+
+    bulk::countDescendants(tl.lockedBy.data(), tl.descLocked.data(), tl.n, tl.m);
+    // A lock under another lock would break every later answer.
+    int nested = bulk::firstNestedLock(tl.lockedBy.data(), tl.descLocked.data(), tl.n);
+    if (nested >= 0) {
+        error = path + ": node " + std::to_string(nested) + " is locked together with a descendant";
+        return false;
+    }
+    info.lsn = h.lsn;
+    info.locked = h.locked;
+    info.uids = h.uids;
+    info.hasNames = (h.flags & HAS_NAMES) != 0;
+    return true;
+}
+
+// Where a checkpoint sets the log aside until its snapshot is safely written.
+inline std::string asidePath(const std::string& walPath) { return walPath + ".ckpt"; }
+
+// Rebuilds 'tl' from the snapshot at 'snapPath' (if there is one) and the log at
+// 'walPath' (if given), including a segment set aside by an unfinished
+// checkpoint. 'current' describes the current log file for wal::Log::open(),
+// and 'nextLsn' is where logging continues.
+template <class TL>
+bool restore(const std::string& snapPath, const std::string& walPath, TL& tl, Info& info,
+             std::vector<std::string>* names, wal::RecoveryResult& current, uint64_t& nextLsn, std::string& error) {
+    info = Info();
+    if (names) names->clear();
+    struct stat st;
+    if (stat(snapPath.c_str(), &st) == 0 && !load(snapPath, tl, info, names, error)) return false;
+    nextLsn = info.lsn;
+    current = wal::RecoveryResult();
+    if (walPath.empty()) return true;
+    std::string aside = asidePath(walPath);
+    if (stat(aside.c_str(), &st) == 0) {
+        wal::RecoveryResult old;
+        if (!wal::recover(aside, tl, old, error, nextLsn)) return false;
+        nextLsn = std::max(nextLsn, old.startLsn + old.skipped + old.records);
+    }
+    if (!wal::recover(walPath, tl, current, error, nextLsn)) return false;
+    if (current.validBytes > 0) nextLsn = std::max(nextLsn, current.startLsn + current.skipped + current.records);
+    return true;
+}
+
+// Runs at most one snapshot child at a time.
+class Forker {
+public:
+    enum Status { IDLE, RUNNING, SUCCEEDED, FAILED };
+
+    ~Forker() { poll(true); }
+
+    // Forks; the child runs write() and exits with its verdict, without running
+    // destructors or atexit handlers (the parent's threads do not exist there).
+    // Returns false if a child is still running or fork() failed.
+    template <class Write>
+    bool start(Write write) {
+        if (child > 0) return false;
+        pid_t pid = fork();
+        if (pid < 0) return false;
+        if (pid == 0) _exit(write() ? 0 : 1);
+        child = pid;
+        return true;
+    }
+
+    // Reaps the child if it has exited (or waits for it with 'wait').
+    Status poll(bool wait = false) {
+        if (child <= 0) return IDLE;
+        int status = 0;
+        pid_t r = waitpid(child, &status, wait ? 0 : WNOHANG);
+        if (r == 0) return RUNNING;
+        child = -1;
+        return r > 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0 ? SUCCEEDED : FAILED;
+    }
+
+private:
+    pid_t child = -1;
+};
+
+// Periodic snapshot plus WAL truncation.
+class Checkpointer {
+public:
+    // 'log' may be null for snapshots without a write-ahead log, and 'names' for
+    // snapshots without a name table. The child reads 'names' from its copy of
+    // the address space, so it must outlive the checkpointer.
+    void configure(const std::string& snapPath, wal::Log* log, const std::string& walPath,
+                   const std::vector<std::string>* names) {
+        this->snapPath = snapPath;
+        this->log = log;
+        this->walPath = walPath;
+        this->names = names;
+    }
+
+    bool enabled() const { return !snapPath.empty(); }
+
+    // Starts a snapshot of 'tl'. No change may be in flight: the snapshot's LSN
+    // is taken from the log here. Returns false if the previous snapshot or log
+    // rotation is still in progress or the checkpoint could not start.
+    template <class TL>
+    bool begin(const TL& tl) {
+        if (poll() == Forker::RUNNING || (log && log->rotating())) return false;
+        uint64_t lsn = 0;
+        if (log) {
+            // A segment left by a failed checkpoint is kept; the current file then
+            // simply keeps growing until a snapshot covers both.
+            struct stat st;
+            if (stat(asidePath(walPath).c_str(), &st) != 0) {
+                // The flusher does the I/O; the query thread only learns where
+                // the new segment will start. If the rotation fails, the current
+                // file keeps the records below 'lsn' and recovery skips them.
+                lsn = log->requestRotate(asidePath(walPath));
+            } else {
+                lsn = log->nextLsn();
+            }
+        }
+        bool started = forker.start([&] { return writeFile(snapPath, encode(tl, lsn, names)); });
+        if (started) ++taken;
+        return started;
+    }
+
+    // Reaps a finished snapshot; a successful one makes the set-aside log
+    // segment redundant once its rotation has finished. With 'wait', waits for
+    // both.
+    Forker::Status poll(bool wait = false) {
+        Forker::Status s = forker.poll(wait);
+        if (s == Forker::SUCCEEDED && log) covered = true;
+        if (s == Forker::FAILED) ++failed;
+        if (covered && wait) log->waitRotation();
+        if (covered && !log->rotating()) {
+            unlink(asidePath(walPath).c_str());
+            covered = false;
+        }
+        return s;
+    }
+
+    uint64_t snapshotsTaken() const { return taken; }
+    uint64_t snapshotsFailed() const { return failed; }
+
+private:
+    std::string snapPath, walPath;
+    wal::Log* log = nullptr;
+    const std::vector<std::string>* names = nullptr;
+    Forker forker;
+    bool covered = false; // The last snapshot succeeded; its aside segment is still to go.
+    uint64_t taken = 0, failed = 0;
+};
+
+} // namespace snapshot
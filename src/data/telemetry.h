@@ -0,0 +1,262 @@
+#pragma once
+
+// Per-operation telemetry for the TreeLocker variants.
+// Build with -DTREELOCKER_TELEMETRY=1 to enable; otherwise the telemetry half of every
+// TL_* macro below expands to nothing and none of this code is compiled into the lock
+// paths. The TL_OP_* macros also drive the flight recorder (flightRecorder.h).
+//
+// Each thread owns a cache-line aligned TelemetryThreadStats block, so recording is
+// a relaxed load/store on memory no other thread writes. Readers (report(), the
+// metrics exporter) sum the blocks with relaxed loads and never block a worker.
+
+#ifndef TREELOCKER_TELEMETRY
+#define TREELOCKER_TELEMETRY 0
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+#include "latencyHistogram.h"
+#include "flightRecorder.h"
+
+namespace telemetry {
+
+enum OpKind { OP_LOCK = 0, OP_UNLOCK, OP_UPGRADE, OP_KINDS };
+
+const int MAX_LEVELS = 64; // Deeper nodes are folded into the last level slot.
+
+enum Outcome {
+    OK = 0,
+    SELF_LOCKED,          // lock/upgrade: the target node is already locked.
+    ANCESTOR_LOCKED,      // lock/upgrade: some ancestor holds a lock.
+    DESCENDANT_LOCKED,    // lock: some descendant holds a lock.
+    NO_LOCKED_DESCENDANT, // upgrade: nothing below the node to upgrade from.
+    FOREIGN_DESCENDANT,   // upgrade: a descendant is locked by another uid.
+    NOT_LOCKED,           // unlock: the node is not locked at all.
+    WRONG_OWNER,          // unlock: the node is locked by another uid.
+    OUTCOMES
+};
+
+inline const char* opName(int k) {
+    static const char* names[] = {"lock", "unlock", "upgrade"};
+    return names[k];
+}
+
+inline const char* outcomeName(int o) {
+    static const char* names[] = {"ok", "self_locked", "ancestor_locked", "descendant_locked",
+                                  "no_locked_descendant", "foreign_descendant", "not_locked", "wrong_owner"};
+    return names[o];
+}
+
+// Whether operation 'k' can ever end with outcome 'o' (used to keep exports compact).
+inline bool outcomeApplies(int k, int o) {
+    if (o == OK) return true;
+    if (k == OP_LOCK) return o == SELF_LOCKED || o == ANCESTOR_LOCKED || o == DESCENDANT_LOCKED;
+    if (k == OP_UNLOCK) return o == NOT_LOCKED || o == WRONG_OWNER;
+    return o == SELF_LOCKED || o == ANCESTOR_LOCKED || o == NO_LOCKED_DESCENDANT || o == FOREIGN_DESCENDANT;
+}
+
+// Why a failed lock/upgrade failed, from the same state its guard condition read.
+// Self-locked wins over the counters; an ancestor is blamed only when neither the
+// node nor its subtree explains the failure.
+inline Outcome lockFailure(int lockedBy, int descLocked) {
+    return lockedBy != 0 ? SELF_LOCKED : descLocked != 0 ? DESCENDANT_LOCKED : ANCESTOR_LOCKED;
+}
+
+inline Outcome upgradeFailure(int lockedBy, int descLocked) {
+    return lockedBy != 0 ? SELF_LOCKED : descLocked == 0 ? NO_LOCKED_DESCENDANT : ANCESTOR_LOCKED;
+}
+
+inline Outcome unlockFailure(int lockedBy) {
+    return lockedBy == 0 ? NOT_LOCKED : WRONG_OWNER;
+}
+
+// Relaxed single-writer counter: the owning thread bumps it without a locked
+// instruction, readers on other threads still see a torn-free value.
+struct Counter {
+    std::atomic<uint64_t> v{0};
+    void add(uint64_t d) { v.store(v.load(std::memory_order_relaxed) + d, std::memory_order_relaxed); }
+    uint64_t get() const { return v.load(std::memory_order_relaxed); }
+};
+
+// Single-writer version of LatencyHistogram with the same bucket layout.
+struct AtomicHistogram {
+    std::unique_ptr<Counter[]> counts;
+    Counter sum, maxValue;
+
+    AtomicHistogram() : counts(new Counter[LatencyHistogram::BUCKETS]) {}
+
+    void record(uint64_t v) {
+        counts[LatencyHistogram::indexOf(v)].add(1);
+        sum.add(v);
+        if (v > maxValue.get()) maxValue.v.store(v, std::memory_order_relaxed);
+    }
+
+    // Adds this histogram into a plain one, one sample per bucket at its lower bound.
+    void mergeInto(LatencyHistogram& h) const {
+        uint64_t total = 0;
+        for (int i = 0; i < LatencyHistogram::BUCKETS; ++i) {
+            uint64_t c = counts[i].get();
+            if (c == 0) continue;
+            h.counts[i] += c;
+            h.minValue = std::min(h.minValue, LatencyHistogram::lowerBound(i));
+            total += c;
+        }
+        h.total += total;
+        h.sum += sum.get();
+        h.maxValue = std::max(h.maxValue, maxValue.get());
+    }
+};
+
+struct alignas(64) TelemetryThreadStats {
+    Counter outcomes[OP_KINDS][OUTCOMES];
+    AtomicHistogram latencyNs[OP_KINDS];
+    AtomicHistogram upgradeVisited;  // Nodes inspected by one upgrade's descendant scan(s).
+    uint64_t visitScratch = 0;       // Running visit count, only touched by the owner.
+    // Net locks taken minus released by this thread, per tree level. Deltas are stored
+    // as two's complement, so summing every thread's slot yields the live count.
+    Counter lockedByLevel[MAX_LEVELS];
+};
+
+// Owns every thread's block. Blocks outlive their threads so totals stay complete.
+struct Registry {
+    std::mutex mx;
+    std::vector<std::unique_ptr<TelemetryThreadStats>> threads;
+
+    static Registry& get() {
+        static Registry r;
+        return r;
+    }
+
+    TelemetryThreadStats* add() {
+        std::lock_guard<std::mutex> g(mx);
+        threads.emplace_back(new TelemetryThreadStats());
+        return threads.back().get();
+    }
+
+    template <class F>
+    void forEach(F&& f) {
+        std::lock_guard<std::mutex> g(mx); // Only guards the list; workers never take it after registering.
+        for (auto& t : threads) f(*t);
+    }
+};
+
+inline TelemetryThreadStats& local() {
+    thread_local TelemetryThreadStats* s = Registry::get().add();
+    return *s;
+}
+
+// Aggregated view over all threads.
+struct Snapshot {
+    uint64_t outcomes[OP_KINDS][OUTCOMES] = {};
+    LatencyHistogram latencyNs[OP_KINDS];
+    LatencyHistogram upgradeVisited;
+    int64_t lockedByLevel[MAX_LEVELS] = {};
+
+    int64_t lockedNodes() const {
+        int64_t s = 0;
+        for (int d = 0; d < MAX_LEVELS; ++d) s += lockedByLevel[d];
+        return s;
+    }
+
+    uint64_t calls(int k) const {
+        uint64_t s = 0;
+        for (int o = 0; o < OUTCOMES; ++o) s += outcomes[k][o];
+        return s;
+    }
+};
+
+inline Snapshot snapshot() {
+    Snapshot s;
+    Registry::get().forEach([&](TelemetryThreadStats& t) {
+        for (int k = 0; k < OP_KINDS; ++k) {
+            for (int o = 0; o < OUTCOMES; ++o) s.outcomes[k][o] += t.outcomes[k][o].get();
+            t.latencyNs[k].mergeInto(s.latencyNs[k]);
+        }
+        t.upgradeVisited.mergeInto(s.upgradeVisited);
+        for (int d = 0; d < MAX_LEVELS; ++d) s.lockedByLevel[d] += (int64_t)t.lockedByLevel[d].get();
+    });
+    return s;
+}
+
+inline void report(std::ostream& out) {
+    Snapshot s = snapshot();
+    out << "# telemetry\n";
+    for (int k = 0; k < OP_KINDS; ++k) {
+        const LatencyHistogram& h = s.latencyNs[k];
+        out << opName(k) << ": calls=" << s.calls(k);
+        for (int o = 0; o < OUTCOMES; ++o) {
+            if (s.outcomes[k][o]) out << " " << outcomeName(o) << "=" << s.outcomes[k][o];
+        }
+        out << " p50=" << h.percentile(0.5) << "ns p99=" << h.percentile(0.99) << "ns p999="
+            << h.percentile(0.999) << "ns max=" << h.max() << "ns\n";
+    }
+    const LatencyHistogram& v = s.upgradeVisited;
+    out << "upgrade_nodes_visited: mean=" << v.mean() << " p50=" << v.percentile(0.5)
+        << " p99=" << v.percentile(0.99) << " max=" << v.max() << "\n";
+}
+
+// Records that node 'v' of an m-ary tree was locked (+1) or released (-1).
+inline void lockDelta(int v, int m, int delta) {
+    int depth = 0;
+    while (v > 0) {
+        v = (v - 1) / m;
+        ++depth;
+    }
+    local().lockedByLevel[depth < MAX_LEVELS ? depth : MAX_LEVELS - 1].add((uint64_t)(int64_t)delta);
+}
+
+// Times one lock/unlock/upgrade call and files its outcome when it goes out of scope.
+struct OpScope {
+    TelemetryThreadStats& t;
+    int kind;
+    int outcome = OK;
+    uint64_t visitStart;
+    std::chrono::steady_clock::time_point start;
+
+    explicit OpScope(int k) : t(local()), kind(k), visitStart(t.visitScratch), start(std::chrono::steady_clock::now()) {}
+
+    ~OpScope() {
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        t.outcomes[kind][outcome].add(1);
+        t.latencyNs[kind].record((uint64_t)ns);
+        if (kind == OP_UPGRADE) t.upgradeVisited.record(t.visitScratch - visitStart);
+    }
+};
+
+} // namespace telemetry
+
+// TL_OP_* feed both the telemetry counters and the flight recorder; each half
+// compiles away independently.
+#if TREELOCKER_TELEMETRY
+#define TL_TELEMETRY_SCOPE(kind) telemetry::OpScope tlOpScope_(telemetry::kind)
+#define TL_TELEMETRY_SET(o) (tlOpScope_.outcome = (o))
+#define TL_VISIT(k) (telemetry::local().visitScratch += (k))
+#define TL_LOCK_DELTA(v, m, delta) telemetry::lockDelta((v), (m), (delta))
+#else
+#define TL_TELEMETRY_SCOPE(kind) ((void)0)
+#define TL_TELEMETRY_SET(o) ((void)0)
+#define TL_VISIT(k) ((void)0)
+#define TL_LOCK_DELTA(v, m, delta) ((void)0)
+#endif
+
+#define TL_OP_BEGIN(kind, v, uid) \
+    TL_TELEMETRY_SCOPE(kind);     \
+    TL_FLIGHT_SCOPE(telemetry::kind, (v), (uid))
+#define TL_OP_FAIL(o) (TL_TELEMETRY_SET(telemetry::o), TL_FLIGHT_SET(telemetry::o))
+#if TREELOCKER_TELEMETRY || TREELOCKER_FLIGHT
+#define TL_OP_OUTCOME(expr)            \
+    do {                               \
+        int tlOutcome_ = (expr);       \
+        TL_TELEMETRY_SET(tlOutcome_);  \
+        TL_FLIGHT_SET(tlOutcome_);     \
+    } while (0)
+#else
+#define TL_OP_OUTCOME(expr) ((void)0)
+#endif
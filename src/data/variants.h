@@ -0,0 +1,73 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "Song_S.h"
+#include "Song_M.h"
+#include "mulSongs.h"
+
+// Registry of the TreeLocker variants, so tools can pick one by name at runtime
+// and still call it through a template (no virtual dispatch on the hot path).
+//   Song_S   - per-node spinlocks
+//   Song_M   - per-node mutexes
+//   mulSongs - one global spinlock
+
+inline const std::vector<std::string>& variantNames() {
+    static const std::vector<std::string> names = {"Song_S", "Song_M", "mulSongs"};
+    return names;
+}
+
+// Builds the named variant for an n-node m-ary tree and hands it to 'f'.
+// Returns false if the name is unknown.
+template <class F>
+bool withVariant(const std::string& name, int n, int m, F&& f) {
+    if (name == "Song_S") {
+        song_s::TreeLocker tl(n, m);
+        f(tl);
+    } else if (name == "Song_M") {
+        song_m::TreeLocker tl(n, m);
+        f(tl);
+    } else if (name == "mulSongs") {
+        mul_songs::TreeLocker tl(n, m);
+        f(tl);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Hands 'f' a null pointer of the named variant's type, for callers that build
+// their own instances (several per process, other sizes). False if unknown.
+template <class F>
+bool withVariantType(const std::string& name, F&& f) {
+    if (name == "Song_S") f((song_s::TreeLocker*)nullptr);
+    else if (name == "Song_M") f((song_m::TreeLocker*)nullptr);
+    else if (name == "mulSongs") f((mul_songs::TreeLocker*)nullptr);
+    else return false;
+    return true;
+}
+
+// Dispatches one op code (1 lock, 2 unlock, 3 upgrade) to any variant.
+template <class TL>
+inline bool applyOp(TL& tl, int op, int v, int uid) {
+    if (op == 1) return tl.lockNode(v, uid);
+    if (op == 2) return tl.unlockNode(v, uid);
+    if (op == 3) return tl.upgradeNode(v, uid);
+    return false;
+}
+
+// Answers a read (4 isLocked, 5 canLock, 6 holds) from lockedBy and descLocked
+// without taking the variant's locks. Under concurrent changes the answer reflects
+// some recent state; callers that need a stable view hold writers off themselves.
+template <class TL>
+inline bool readOp(const TL& tl, int op, int v, int uid) {
+    if (op == 4) return tl.lockedBy[v] != 0;
+    if (op == 6) return tl.lockedBy[v] == uid;
+    if (op != 5 || tl.lockedBy[v] != 0 || tl.descLocked[v] != 0) return false;
+    for (int u = v; u > 0;) {
+        u = (u - 1) / tl.m;
+        if (tl.lockedBy[u] != 0) return false;
+    }
+    return true;
+}
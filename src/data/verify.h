@@ -0,0 +1,132 @@
+#pragma once
+
+// Invariant verifier for lockedBy and descLocked.
+//
+// A drifted descLocked counter makes locks on its subtree fail forever without
+// any other symptom, so changes to addToAncestors or upgradeNode should be run
+// against this. It checks, for every node p:
+//   descLocked[p] == sum over children c of (descLocked[c] + (lockedBy[c] != 0))
+//   lockedBy[p] == 0 || descLocked[p] == 0
+// The first condition only looks at p and its children, but holding at every
+// node it proves by induction from the leaves that every count equals the true
+// number of locked descendants. Given that, the second condition says no locked
+// node has a locked descendant, i.e. none has a locked ancestor. Every node is
+// independent, so the pass splits into equal chunks across threads with no
+// scratch array and no level ordering.
+//
+// check() is stop-the-world: the caller makes sure no operation is in flight.
+// Background runs the same check in a fork()ed child against its copy-on-write
+// image of the tree, so the caller only pauses for the fork.
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+
+#include "snapshot.h" // Forker.
+
+namespace verify {
+
+struct Result {
+    uint64_t nodes = 0;
+    uint64_t badCounts = 0;   // Nodes whose descLocked disagrees with their children.
+    uint64_t nestedLocks = 0; // Locked nodes with a locked descendant.
+    int64_t firstBadCount = -1, firstNestedLock = -1;
+
+    bool ok() const { return badCounts == 0 && nestedLocks == 0; }
+
+    std::string describe() const {
+        if (ok()) return std::to_string(nodes) + " nodes consistent";
+        std::string s;
+        if (badCounts > 0)
+            s += std::to_string(badCounts) + " descLocked counts wrong (first at node " +
+                 std::to_string(firstBadCount) + ")";
+        if (nestedLocks > 0)
+            s += std::string(s.empty() ? "" : "; ") + std::to_string(nestedLocks) +
+                 " locks under another lock (first at node " + std::to_string(firstNestedLock) + ")";
+        return s;
+    }
+};
+
+// Checks [lo, hi) into 'r'.
+inline void checkRange(const int32_t* lockedBy, const int32_t* descLocked, int n, int m, long long lo, long long hi,
+                       Result& r) {
+    for (long long p = lo; p < hi; ++p) {
+        long long c = p * m + 1, end = std::min<long long>(c + m, n);
+        int64_t sum = 0;
+        for (; c < end; ++c) sum += descLocked[c] + (lockedBy[c] != 0);
+        if (sum != descLocked[p] && r.badCounts++ == 0) r.firstBadCount = p;
+        if (lockedBy[p] != 0 && descLocked[p] != 0 && r.nestedLocks++ == 0) r.firstNestedLock = p;
+    }
+}
+
+// Verifies the whole tree with the given number of threads (0 = one per
+// hardware thread).
+inline Result check(const int32_t* lockedBy, const int32_t* descLocked, int n, int m, int threads = 0) {
+    if (threads <= 0) threads = (int)std::max(1u, std::thread::hardware_concurrency());
+    threads = (int)std::min<long long>(threads, std::max(1, n / 4096));
+    std::vector<Result> parts(threads);
+    std::vector<std::thread> workers;
+    long long chunk = ((long long)n + threads - 1) / threads;
+    for (int t = 1; t < threads; ++t)
+        workers.emplace_back(checkRange, lockedBy, descLocked, n, m, t * chunk, std::min<long long>((t + 1) * chunk, n),
+                             std::ref(parts[t]));
+    checkRange(lockedBy, descLocked, n, m, 0, std::min<long long>(chunk, n), parts[0]);
+    for (std::thread& w : workers) w.join();
+
+    Result r; // Chunks are in index order, so the first one reporting a node has the smallest.
+    r.nodes = n < 0 ? 0 : (uint64_t)n;
+    for (const Result& p : parts) {
+        if (r.badCounts == 0) r.firstBadCount = p.firstBadCount;
+        if (r.nestedLocks == 0) r.firstNestedLock = p.firstNestedLock;
+        r.badCounts += p.badCounts;
+        r.nestedLocks += p.nestedLocks;
+    }
+    return r;
+}
+
+template <class TL>
+Result check(const TL& tl, int threads = 0) {
+    return check(tl.lockedBy.data(), tl.descLocked.data(), tl.n, tl.m, threads);
+}
+
+// Runs check() in a forked child, one at a time. A failing child writes the
+// description to stderr itself; the parent learns the verdict from poll().
+class Background {
+public:
+    // Starts a check of 'tl' as it is now. No operation may be in flight, as for
+    // check(). Returns false if the previous check is still running.
+    template <class TL>
+    bool start(const TL& tl, int threads = 0) {
+        if (poll() == snapshot::Forker::RUNNING) return false;
+        bool started = forker.start([&] {
+            Result r = check(tl, threads);
+            if (!r.ok()) {
+                std::string line = "verify: " + r.describe() + "\n";
+                ssize_t w = write(2, line.data(), line.size());
+                (void)w;
+            }
+            return r.ok();
+        });
+        if (started) ++runs;
+        return started;
+    }
+
+    snapshot::Forker::Status poll(bool wait = false) {
+        snapshot::Forker::Status s = forker.poll(wait);
+        if (s == snapshot::Forker::FAILED) ++failures;
+        return s;
+    }
+
+    uint64_t checksRun() const { return runs; }
+    uint64_t checksFailed() const { return failures; }
+
+private:
+    snapshot::Forker forker;
+    uint64_t runs = 0, failures = 0;
+};
+
+} // namespace verify
@@ -0,0 +1,515 @@
+#pragma once
+
+// Write-ahead log of successful TreeLocker state changes, with group commit.
+//
+// The log is a ChangeSink: attach it with 'tl.sink = &wal' and every successful
+// lock, unlock and upgrade is encoded under a short mutex into an in-memory
+// buffer, from inside the operation's critical section, so log order is a valid
+// serial order. A background thread hands the buffer to the kernel and
+// fdatasync()s it once per group-commit interval, so the fsync cost is shared by
+// every change in the batch instead of paid per operation.
+//
+// Durability:
+//   off     written every interval, never fsynced (survives a process crash only)
+//   group   fsynced every interval; a machine crash loses at most one interval
+//   strict  like group, and callers hold back acknowledgements until commit()
+//           returns, so nothing acknowledged is ever lost
+//
+// File: Header, then records of
+//   varint payload length, payload, crc32(payload) little endian
+// with payload = type byte (1 lock, 2 unlock, 3 upgrade), varint node,
+// zigzag uid and, for upgrades, varint count plus the delta-encoded sorted list of
+// descendants the upgrade unlocked. Recovery replays records through the normal
+// TreeLocker operations and stops at the first torn or corrupt record; open()
+// then truncates that tail before appending.
+//
+// Checkpoints (snapshot.h) rotate the log: requestRotate() fixes the LSN at
+// once, and the flusher then renames the current file aside and starts a fresh
+// one whose header carries the LSN of its first record, so recovery can start
+// from a snapshot and skip what it already covers.
+//
+// A write or fsync that fails (ENOSPC, EIO, ...) puts the log in a failed state:
+// the torn batch is cut off again where possible, nothing more is written, and
+// commit() returns false, so no change past the last durable one is acknowledged.
+//
+// Where io_uring is available the flusher submits each batch's write and the
+// fdatasync linked behind it with a single system call on a ring of its own
+// (ioUring.h), falling back to write() + fdatasync() otherwise.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "changeSink.h"
+#include "captureLog.h" // putVarint / getVarint / zigzag.
+#include "ioUring.h"
+
+namespace wal {
+
+const uint32_t VERSION = 1;
+
+enum Type { LOCK = 1, UNLOCK = 2, UPGRADE = 3 };
+
+enum Durability { OFF, GROUP, STRICT };
+
+inline bool parseDurability(const std::string& s, Durability& d) {
+    if (s == "off") d = OFF;
+    else if (s == "group") d = GROUP;
+    else if (s == "strict") d = STRICT;
+    else return false;
+    return true;
+}
+
+struct Header {
+    char magic[8];     // "TLWALOG1"
+    uint32_t version;
+    int32_t n, m;      // Tree shape; recovery refuses a log for a different tree.
+    uint32_t reserved;
+    uint64_t startLsn; // LSN of the first record, non-zero once the log was checkpointed.
+};
+
+struct Record {
+    int type, v, uid;
+    std::vector<int> unlocked; // Upgrades only.
+};
+
+inline uint32_t crc32(const char* p, size_t len) {
+    static uint32_t table[256];
+    static bool ready = [] {
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k) c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            table[i] = c;
+        }
+        return true;
+    }();
+    (void)ready;
+    uint32_t c = 0xffffffffu;
+    for (size_t i = 0; i < len; ++i) c = table[(c ^ (uint8_t)p[i]) & 0xff] ^ (c >> 8);
+    return c ^ 0xffffffffu;
+}
+
+inline void encode(std::string& out, int type, int v, int uid, const std::vector<int>* unlocked) {
+    thread_local std::string payload;
+    payload.clear();
+    payload.push_back((char)type);
+    capture::putVarint(payload, (uint32_t)v);
+    capture::putVarint(payload, capture::zigzag(uid));
+    if (unlocked) {
+        std::vector<int> sorted = *unlocked;
+        std::sort(sorted.begin(), sorted.end());
+        capture::putVarint(payload, sorted.size());
+        int prev = 0;
+        for (int u : sorted) {
+            capture::putVarint(payload, (uint32_t)(u - prev));
+            prev = u;
+        }
+    }
+    capture::putVarint(out, payload.size());
+    out += payload;
+    uint32_t crc = crc32(payload.data(), payload.size());
+    for (int i = 0; i < 4; ++i) out.push_back((char)(crc >> (8 * i)));
+}
+
+// Decodes the record at 'p'. Returns false (leaving 'p' alone) on a torn or
+// corrupt record.
+inline bool decode(const char*& p, const char* end, Record& r) {
+    const char* q = p;
+    uint64_t len;
+    if (!capture::getVarint(q, end, len) || len + 4 > (uint64_t)(end - q) || len == 0) return false;
+    const char* payload = q;
+    const char* payloadEnd = q + len;
+    uint32_t crc = 0;
+    for (int i = 0; i < 4; ++i) crc |= (uint32_t)(uint8_t)payloadEnd[i] << (8 * i);
+    if (crc != crc32(payload, len)) return false;
+
+    r.type = (uint8_t)*q++;
+    uint64_t v, uid;
+    if (!capture::getVarint(q, payloadEnd, v) || !capture::getVarint(q, payloadEnd, uid)) return false;
+    r.v = (int)v;
+    r.uid = (int)capture::unzigzag(uid);
+    r.unlocked.clear();
+    if (r.type == UPGRADE) {
+        uint64_t count, delta;
+        if (!capture::getVarint(q, payloadEnd, count)) return false;
+        int prev = 0;
+        for (uint64_t i = 0; i < count; ++i) {
+            if (!capture::getVarint(q, payloadEnd, delta)) return false;
+            prev += (int)delta;
+            r.unlocked.push_back(prev);
+        }
+    } else if (r.type != LOCK && r.type != UNLOCK) {
+        return false;
+    }
+    p = payloadEnd + 4;
+    return true;
+}
+
+// Makes a rename or create in the directory holding 'path' durable.
+inline void syncDirectory(const std::string& path) {
+    size_t slash = path.rfind('/');
+    std::string dir = slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+    int dfd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (dfd < 0) return;
+    fsync(dfd);
+    ::close(dfd);
+}
+
+struct RecoveryResult {
+    uint64_t records = 0;   // Records applied.
+    uint64_t skipped = 0;   // Intact records below 'fromLsn', already covered by a snapshot.
+    uint64_t validBytes = 0; // File prefix holding intact records (including the header).
+    uint64_t startLsn = 0;
+    bool tornTail = false;  // Bytes after the last intact record were dropped.
+};
+
+// Replays the log at 'path' into 'tl' (whose sink must be unset), which holds the
+// state as of 'fromLsn': a fresh tree for 0, or a loaded snapshot. A missing file
+// is an empty log. Returns false with 'error' set if the log belongs to another
+// tree, starts after 'fromLsn', or a record does not apply, which means the log
+// and the tree disagree and continuing would serve wrong answers.
+template <class TL>
+bool recover(const std::string& path, TL& tl, RecoveryResult& res, std::string& error, uint64_t fromLsn = 0) {
+    res = RecoveryResult();
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) return true;
+    std::string data;
+    char buf[1 << 16];
+    ssize_t r;
+    while ((r = read(fd, buf, sizeof(buf))) > 0) data.append(buf, (size_t)r);
+    close(fd);
+    if (data.empty()) return true;
+
+    Header h;
+    if (data.size() < sizeof(h) || memcmp(data.data(), "TLWALOG1", 8) != 0) {
+        error = path + ": not a write-ahead log";
+        return false;
+    }
+    memcpy(&h, data.data(), sizeof(h));
+    if (h.version != VERSION || h.n != tl.n || h.m != tl.m) {
+        error = path + ": log was written for a different tree or version";
+        return false;
+    }
+    res.startLsn = h.startLsn;
+    if (h.startLsn > fromLsn) {
+        error = path + ": log starts at LSN " + std::to_string(h.startLsn) + " but the state is only at LSN " +
+                std::to_string(fromLsn);
+        return false;
+    }
+
+    const char* p = data.data() + sizeof(h);
+    const char* end = data.data() + data.size();
+    Record rec;
+    while (p < end && decode(p, end, rec)) {
+        if (h.startLsn + res.skipped < fromLsn) {
+            ++res.skipped;
+            continue;
+        }
+        bool ok = false;
+        if (rec.v >= 0 && rec.v < tl.n) {
+            if (rec.type == LOCK) ok = tl.lockNode(rec.v, rec.uid);
+            else if (rec.type == UNLOCK) ok = tl.unlockNode(rec.v, rec.uid);
+            else ok = tl.upgradeNode(rec.v, rec.uid);
+        }
+        if (!ok) {
+            error = path + ": record " + std::to_string(h.startLsn + res.skipped + res.records) + " does not apply";
+            return false;
+        }
+        ++res.records;
+    }
+    res.validBytes = (uint64_t)(p - data.data());
+    res.tornTail = p < end;
+    return true;
+}
+
+class Log : public ChangeSink, public Committer {
+public:
+    // Opens 'path' for appending after recover(): 'validBytes' is the intact prefix
+    // it reported (0 for a new log) and 'nextLsn' the LSN the next record gets.
+    bool open(const std::string& path, int n, int m, Durability d, int intervalUs, uint64_t validBytes,
+              uint64_t nextLsn, std::string& error) {
+        fd = ::open(path.c_str(), O_WRONLY | O_CREAT, 0644);
+        if (fd < 0) {
+            error = "cannot open " + path;
+            return false;
+        }
+        treeN = n;
+        treeM = m;
+        if (validBytes == 0) {
+            Header h = header(nextLsn);
+            if (ftruncate(fd, 0) != 0 || pwrite(fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h)) {
+                error = "cannot initialise " + path;
+                return false;
+            }
+            validBytes = sizeof(h);
+        } else if (ftruncate(fd, (off_t)validBytes) != 0) { // Drop a torn tail.
+            error = "cannot truncate " + path;
+            return false;
+        }
+        fileEnd = validBytes;
+        if (d != OFF) fdatasync(fd);
+        this->path = path;
+        durability = d;
+        interval = std::chrono::microseconds(intervalUs > 0 ? intervalUs : 1);
+        appended = durable = nextLsn;
+        running = true;
+        flusher = std::thread([this] { loop(); });
+        return true;
+    }
+
+    void onLock(int v, int uid) override { append(LOCK, v, uid, nullptr); }
+    void onUnlock(int v, int uid) override { append(UNLOCK, v, uid, nullptr); }
+    void onUpgrade(int v, int uid, const std::vector<int>& unlocked) override { append(UPGRADE, v, uid, &unlocked); }
+
+    // Blocks until every change appended so far is durable (written, and fsynced
+    // unless durability is off). Callers batch acknowledgements around it. False
+    // once the log has failed: those changes will never be durable.
+    bool commit() override {
+        std::unique_lock<std::mutex> g(mx);
+        uint64_t target = appended;
+        if (durable >= target) return true;
+        urgent = true;
+        wake.notify_one();
+        done.wait(g, [&] { return durable >= target || !running || writeFailed; });
+        return durable >= target;
+    }
+
+    bool strict() const { return durability == STRICT; }
+
+    // Whether a write or fsync has failed; nothing has been logged since.
+    bool failed() {
+        std::lock_guard<std::mutex> g(mx);
+        return writeFailed;
+    }
+
+    // Whether the flusher may use io_uring (the default). Call before open().
+    void useIoUring(bool on) { uringWanted = on; }
+
+    // LSN the next change will get.
+    uint64_t nextLsn() {
+        std::lock_guard<std::mutex> g(mx);
+        return appended;
+    }
+
+    // Sets the log aside at the current LSN without waiting for any I/O: the
+    // records appended so far stay in the current file, which the flusher makes
+    // durable and renames to 'asidePath', and later ones go to a fresh file at the
+    // original path. Returns that LSN, which the fresh file starts at. One rotation
+    // at a time; rotating() and waitRotation() follow it. If it fails the old file
+    // simply stays current.
+    uint64_t requestRotate(const std::string& asidePath) {
+        std::lock_guard<std::mutex> g(mx);
+        rotateOk = false;
+        if (!running) return appended;
+        rotateTo = asidePath;
+        rotateLsn = appended;
+        rotateBytes = active.size();
+        urgent = true;
+        wake.notify_one();
+        return rotateLsn;
+    }
+
+    // Whether a requested rotation has not finished yet.
+    bool rotating() {
+        std::lock_guard<std::mutex> g(mx);
+        return !rotateTo.empty();
+    }
+
+    // Waits for a requested rotation; returns whether the fresh file was started.
+    bool waitRotation() {
+        std::unique_lock<std::mutex> g(mx);
+        done.wait(g, [&] { return rotateTo.empty() || !running; });
+        return rotateOk;
+    }
+
+    // Flushes everything and stops the background thread.
+    void close() {
+        {
+            std::lock_guard<std::mutex> g(mx);
+            if (!running) return;
+            running = false;
+        }
+        wake.notify_one();
+        flusher.join();
+        ::close(fd);
+        fd = -1;
+    }
+
+    ~Log() { close(); }
+
+private:
+    std::string path;
+    int fd = -1;
+    uint64_t fileEnd = 0; // Where the next batch goes; only the flusher touches it after open().
+    int treeN = 0, treeM = 0;
+    Durability durability = GROUP;
+    std::chrono::microseconds interval{1000};
+    std::mutex mx;                     // Guards everything below.
+    std::condition_variable wake, done;
+    std::string active;                // Encoded records not yet handed to the flusher.
+    uint64_t appended = 0, durable = 0; // LSNs: next to assign, first not yet durable.
+    bool urgent = false, running = false;
+    bool writeFailed = false;
+    bool uringWanted = true;
+    std::string rotateTo;              // Set by requestRotate(), cleared by the flusher once done.
+    uint64_t rotateLsn = 0;            // The fresh file's first LSN.
+    size_t rotateBytes = 0;            // Bytes of 'active' that still belong to the old file.
+    bool rotateOk = false;
+    std::thread flusher;
+
+    void append(int type, int v, int uid, const std::vector<int>* unlocked) {
+        thread_local std::string rec; // Encoded before taking the lock, reusing its capacity.
+        rec.clear();
+        encode(rec, type, v, uid, unlocked);
+        std::lock_guard<std::mutex> g(mx);
+        active += rec;
+        ++appended;
+        if (active.size() >= (4u << 20)) wake.notify_one(); // Do not let a burst grow unbounded.
+    }
+
+    Header header(uint64_t startLsn) const {
+        Header h;
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, "TLWALOG1", 8);
+        h.version = VERSION;
+        h.n = treeN;
+        h.m = treeM;
+        h.startLsn = startLsn;
+        return h;
+    }
+
+    // Moves the current file to 'aside' and switches to a new one starting at
+    // 'startLsn'. On failure the old file is put back and stays current.
+    bool startSegment(const std::string& aside, uint64_t startLsn) {
+        if (rename(path.c_str(), aside.c_str()) != 0) return false;
+        int next = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        Header h = header(startLsn);
+        if (next < 0 || write(next, &h, sizeof(h)) != (ssize_t)sizeof(h) || fsync(next) != 0) {
+            if (next >= 0) ::close(next);
+            rename(aside.c_str(), path.c_str());
+            return false;
+        }
+        syncDirectory(path);
+        ::close(fd);
+        fd = next;
+        fileEnd = sizeof(h);
+        return true;
+    }
+
+    // Writes 'data' at fileEnd and, with 'sync', fdatasync()s it. On
+    // the ring the write and the fsync linked behind it cost one system call; a
+    // short or failed write cancels the fsync and the rest goes the plain way.
+    // Returns false, with 'err' set, if the data may not have reached the disk.
+    bool appendFile(uring::Ring* ring, const char* data, size_t len, bool sync, int& err) {
+        size_t off = 0;
+        if (ring && len > 0) {
+            io_uring_sqe* w = ring->sqe();
+            w->opcode = IORING_OP_WRITE;
+            w->fd = fd;
+            w->addr = (uint64_t)(uintptr_t)data;
+            w->len = (uint32_t)std::min<size_t>(len, 1u << 30);
+            w->off = fileEnd;
+            if (sync) {
+                w->flags = IOSQE_IO_LINK;
+                io_uring_sqe* f = ring->sqe();
+                f->opcode = IORING_OP_FSYNC;
+                f->fd = fd;
+                f->fsync_flags = IORING_FSYNC_DATASYNC;
+                f->user_data = 1; // The write is 0.
+            }
+            unsigned expect = sync ? 2 : 1, seen = 0;
+            int written = -1, synced = -ECANCELED; // An fsync never reaped is redone the plain way.
+            while (seen < expect && ring->submit(expect - seen) >= 0)
+                seen += ring->drain([&](const io_uring_cqe& c) {
+                    if (c.user_data == 0) written = c.res;
+                    else synced = c.res;
+                });
+            if (written > 0) off = (size_t)written;
+            if (off == len && (!sync || synced == 0)) return true;
+            if (off == len && synced != -ECANCELED) { // A failed fsync is not retried: the error is reported once.
+                err = -synced;
+                return false;
+            }
+        }
+        while (off < len) {
+            ssize_t w = pwrite(fd, data + off, len - off, (off_t)(fileEnd + off));
+            if (w < 0 && errno == EINTR) continue;
+            if (w <= 0) {
+                err = w < 0 ? errno : ENOSPC;
+                return false;
+            }
+            off += (size_t)w;
+        }
+        if (!sync || len == 0) return true;
+        int r;
+        do r = fdatasync(fd);
+        while (r != 0 && errno == EINTR);
+        if (r != 0) err = errno;
+        return r == 0;
+    }
+
+    void loop() {
+        uring::Ring ring; // Set up here: the ring belongs to the flusher thread.
+        bool ringOk = uringWanted && ring.init(8);
+        std::string writing;
+        std::unique_lock<std::mutex> g(mx);
+        while (true) {
+            wake.wait_for(g, interval, [&] { return urgent || !running || active.size() >= (4u << 20); });
+            bool stopping = !running;
+            urgent = false;
+            uint64_t batchEnd = appended;
+            std::string aside = rotateTo;
+            size_t split = aside.empty() ? active.size() : rotateBytes;
+            uint64_t startLsn = rotateLsn;
+            writing.swap(active);
+            g.unlock();
+
+            // The file is only touched here, outside the lock, so appenders never wait on I/O.
+            // Once a batch has failed nothing more is written: it would follow a hole.
+            // A rotation splits the batch: its head completes the old file, the
+            // rest opens the new one.
+            bool failedBefore = writeFailed, ok = !failedBefore, rotated = false;
+            int err = 0;
+            auto put = [&](const char* data, size_t len) {
+                if (!ok) return;
+                ok = appendFile(ringOk ? &ring : nullptr, data, len, durability != OFF, err);
+                if (ok) {
+                    fileEnd += len;
+                } else {
+                    // Cut the torn batch off, so recovery still reads up to the last good one.
+                    if (ftruncate(fd, (off_t)fileEnd) == 0 && durability != OFF) fdatasync(fd);
+                    std::cerr << "wal: cannot write " << path << ": " << strerror(err)
+                              << "; no further changes are logged\n";
+                }
+            };
+            put(writing.data(), split);
+            if (ok && !aside.empty()) rotated = startSegment(aside, startLsn);
+            put(writing.data() + split, writing.size() - split);
+            writing.clear();
+
+            g.lock();
+            if (ok) durable = batchEnd;
+            else writeFailed = true;
+            if (!aside.empty()) {
+                rotateOk = rotated;
+                rotateTo.clear();
+            }
+            done.notify_all();
+            if (stopping) return;
+        }
+    }
+};
+
+} // namespace wal
@@ -0,0 +1,204 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <random>
+#include <cmath>
+#include <cstdint>
+#include <ostream>
+
+// Synthetic workload generator for the tree lockers.
+// Produces the same "N m Q / names / op name uid" stream the drivers read from stdin,
+// or the already-resolved op list for in-process benchmarks.
+
+// Tunables for a generated workload. Fractions in the op mix need not sum to 1;
+// they are normalised.
+struct WorkloadConfig {
+    int n = 100000;            // Number of nodes in the implicit m-ary tree.
+    int m = 4;                 // Children per node.
+    long long q = 1000000;     // Number of queries.
+    double lockFrac = 0.5;     // Share of op 1 (lock).
+    double unlockFrac = 0.4;   // Share of op 2 (unlock).
+    double upgradeFrac = 0.1;  // Share of op 3 (upgrade).
+    double zipf = 0.0;         // Zipf exponent for node popularity inside a level; 0 is uniform.
+    int uids = 64;             // Number of distinct user ids (1..uids).
+    double depthBias = 0.0;    // > 0 favours shallow nodes, < 0 favours leaves, 0 is uniform over nodes.
+    uint64_t seed = 42;
+};
+
+// One resolved query: op code, node index and user id.
+struct WorkloadOp {
+    int op;
+    int node;
+    int uid;
+};
+
+// Zipf sampler over ranks 1..n using rejection-inversion (Hormann & Derflinger).
+// O(1) memory and O(1) expected time per sample, so it works for levels with
+// millions of nodes without materialising a CDF. Exponent 0 degenerates to uniform.
+struct ZipfSampler {
+    long long n;
+    double s;
+    double hIntegralX1, hIntegralN, threshold;
+
+    ZipfSampler(long long n_ = 1, double s_ = 0.0) : n(n_ < 1 ? 1 : n_), s(s_) {
+        hIntegralX1 = hIntegral(1.5) - 1.0;
+        hIntegralN = hIntegral((double)n + 0.5);
+        threshold = 2.0 - hIntegralInverse(hIntegral(2.5) - h(2.0));
+    }
+
+    // Returns a rank in [1, n]; rank 1 is the most popular.
+    template <class Rng>
+    long long sample(Rng& rng) const {
+        std::uniform_real_distribution<double> uni(0.0, 1.0);
+        while (true) {
+            double u = hIntegralN + uni(rng) * (hIntegralX1 - hIntegralN);
+            double x = hIntegralInverse(u);
+            long long k = (long long)(x + 0.5);
+            if (k < 1) k = 1;
+            else if (k > n) k = n;
+            if ((double)k - x <= threshold || u >= hIntegral((double)k + 0.5) - h((double)k)) return k;
+        }
+    }
+
+    double h(double x) const { return std::exp(-s * std::log(x)); }
+
+    double hIntegral(double x) const {
+        double logX = std::log(x);
+        return helper2((1.0 - s) * logX) * logX;
+    }
+
+    double hIntegralInverse(double x) const {
+        double t = x * (1.0 - s);
+        if (t < -1.0) t = -1.0;
+        return std::exp(helper1(t) * x);
+    }
+
+    // log1p(x)/x and expm1(x)/x, both continuous at 0.
+    static double helper1(double x) { return std::fabs(x) > 1e-8 ? std::log1p(x) / x : 1.0 - x * (0.5 - x / 3.0); }
+    static double helper2(double x) { return std::fabs(x) > 1e-8 ? std::expm1(x) / x : 1.0 + x * 0.5 * (1.0 + x / 3.0); }
+};
+
+struct WorkloadGenerator {
+    WorkloadConfig cfg;
+    std::mt19937_64 rng;
+    std::vector<long long> levelStart;  // First node index of every level.
+    std::vector<long long> levelCount;  // Number of nodes on every level.
+    std::vector<double> levelCdf;       // Cumulative level weights after the depth bias.
+    std::vector<ZipfSampler> levelZipf; // Node popularity inside each level.
+    // Recently locked nodes per uid, so unlocks and upgrades mostly target plausible nodes
+    // instead of failing trivially. Bounded to keep the generator O(uids) in memory.
+    std::vector<std::vector<int>> recent;
+    static const size_t RECENT_CAP = 64;
+
+    explicit WorkloadGenerator(const WorkloadConfig& c) : cfg(c), rng(c.seed) {
+        if (cfg.m < 1) cfg.m = 1;
+        if (cfg.uids < 1) cfg.uids = 1;
+        long long start = 0, width = 1;
+        while (start < cfg.n) {
+            long long cnt = std::min(width, (long long)cfg.n - start);
+            levelStart.push_back(start);
+            levelCount.push_back(cnt);
+            start += cnt;
+            width = std::min(width * cfg.m, (long long)cfg.n);
+        }
+        double acc = 0;
+        for (size_t d = 0; d < levelCount.size(); ++d) {
+            acc += (double)levelCount[d] * std::exp(cfg.depthBias * -(double)d);
+            levelCdf.push_back(acc);
+            levelZipf.emplace_back(levelCount[d], cfg.zipf);
+        }
+        recent.resize(cfg.uids + 1);
+    }
+
+    // Picks a node: first a level by the biased weights, then a node in it by Zipf rank.
+    // Rank 1 is the leftmost node of the level, so hot spots share ancestors the way a
+    // popular artist's albums and songs do.
+    int pickNode() {
+        std::uniform_real_distribution<double> uni(0.0, levelCdf.back());
+        double r = uni(rng);
+        size_t d = std::lower_bound(levelCdf.begin(), levelCdf.end(), r) - levelCdf.begin();
+        if (d >= levelCdf.size()) d = levelCdf.size() - 1;
+        return (int)(levelStart[d] + levelZipf[d].sample(rng) - 1);
+    }
+
+    int pickUid() { return std::uniform_int_distribution<int>(1, cfg.uids)(rng); }
+
+    WorkloadOp next() {
+        double total = cfg.lockFrac + cfg.unlockFrac + cfg.upgradeFrac;
+        double r = std::uniform_real_distribution<double>(0.0, total > 0 ? total : 1.0)(rng);
+        WorkloadOp o;
+        o.uid = pickUid();
+        std::vector<int>& mine = recent[o.uid];
+        if (r < cfg.lockFrac || total <= 0) {
+            o.op = 1;
+            o.node = pickNode();
+            if (mine.size() < RECENT_CAP) mine.push_back(o.node);
+            else mine[rng() % RECENT_CAP] = o.node;
+        } else if (r < cfg.lockFrac + cfg.unlockFrac) {
+            o.op = 2;
+            if (mine.empty()) {
+                o.node = pickNode();
+            } else {
+                size_t k = rng() % mine.size();
+                o.node = mine[k];
+                mine[k] = mine.back();
+                mine.pop_back();
+            }
+        } else {
+            o.op = 3;
+            if (mine.empty()) {
+                o.node = pickNode();
+            } else {
+                // Upgrade to an ancestor one or two levels above something this uid locked.
+                int v = mine[rng() % mine.size()];
+                int hops = 1 + (int)(rng() % 2);
+                while (hops-- > 0 && v > 0) v = (v - 1) / cfg.m;
+                o.node = v;
+            }
+        }
+        return o;
+    }
+
+    std::vector<WorkloadOp> generate() {
+        std::vector<WorkloadOp> ops;
+        ops.reserve((size_t)cfg.q);
+        for (long long i = 0; i < cfg.q; ++i) ops.push_back(next());
+        return ops;
+    }
+
+    static std::string nodeName(int i) { return "n" + std::to_string(i); }
+
+    // Writes the workload in the stdin format of Song_S / Song_M / mulSongs.
+    void writeInput(std::ostream& out) {
+        out << cfg.n << "\n" << cfg.m << "\n" << cfg.q << "\n";
+        for (int i = 0; i < cfg.n; ++i) out << nodeName(i) << "\n";
+        for (long long i = 0; i < cfg.q; ++i) {
+            WorkloadOp o = next();
+            out << o.op << " " << nodeName(o.node) << " " << o.uid << "\n";
+        }
+    }
+};
+
+// Parses "--key value" style flags shared by the workload tools. Returns false on an
+// unknown flag so callers can print their own usage.
+inline bool parseWorkloadFlag(WorkloadConfig& c, const std::string& key, const std::string& val) {
+    if (key == "--n") c.n = std::stoi(val);
+    else if (key == "--m") c.m = std::stoi(val);
+    else if (key == "--q") c.q = std::stoll(val);
+    else if (key == "--lock") c.lockFrac = std::stod(val);
+    else if (key == "--unlock") c.unlockFrac = std::stod(val);
+    else if (key == "--upgrade") c.upgradeFrac = std::stod(val);
+    else if (key == "--zipf") c.zipf = std::stod(val);
+    else if (key == "--uids") c.uids = std::stoi(val);
+    else if (key == "--depth-bias") c.depthBias = std::stod(val);
+    else if (key == "--seed") c.seed = std::stoull(val);
+    else return false;
+    return true;
+}
+
+inline const char* workloadFlagsUsage() {
+    return "  --n N  --m M  --q Q  --lock F  --unlock F  --upgrade F\n"
+           "  --zipf S  --uids U  --depth-bias B  --seed X\n";
+}
@@ -0,0 +1,27 @@
+#include <iostream>
+#include <string>
+
+#include "workload.h"
+
+using namespace std;
+
+// Writes a synthetic query stream in the stdin format of Song_S / Song_M / mulSongs,
+// so any variant can be driven end to end:
+//   ./workloadGen --n 100000 --m 4 --q 1000000 --zipf 0.99 | ./Song_M > /dev/null
+int main(int argc, char** argv) {
+    ios::sync_with_stdio(false);
+
+    WorkloadConfig cfg;
+    for (int i = 1; i < argc; ++i) {
+        string key = argv[i];
+        if (i + 1 >= argc || !parseWorkloadFlag(cfg, key, argv[i + 1])) {
+            cerr << "usage: " << argv[0] << " [flags]\n" << workloadFlagsUsage();
+            return 1;
+        }
+        ++i;
+    }
+
+    WorkloadGenerator gen(cfg);
+    gen.writeInput(cout);
+    return 0;
+}